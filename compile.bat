@@ -14,7 +14,13 @@ REM cl /EHsc .\src\main.cpp /link /OUT:C:\temp\sdl\bin\main /SUBSYSTEM:CONSOLE
 
 REM cl /EHsc .\src\main.cpp /link /out:%OUTPUT% /SUBSYSTEM:CONSOLE
 echo.
-IF "%ARG1%"=="release" (
+IF "%ARG1%"=="headless" (
+    echo ---- HEADLESS BUILD, no libtcod / window ---- 
+
+    cl /nologo /EHsc /W4 /O2 /wd4996 /wd4100 /DHEADLESS %SOURCE% /link /out:%~dp0bin\main_headless.exe /SUBSYSTEM:CONSOLE
+
+    echo ---- COMPLETED HEADLESS BUILD ---- 
+) ELSE IF "%ARG1%"=="release" (
     echo ---- RELEASE BUILD, no optimizations or completed config ---- 
 
     cl /EHsc %SOURCE% %SOURCEEXTERN% /I %SDLINC% /I %SDL_TTFINC% /I %~dp0src\extern\ /I %~dp0src\headers\ /link /LIBPATH:%SDLLIB% /LIBPATH:%SDL_TTFLIB% SDL2main.lib SDL2.lib SDL2_ttf.lib opengl32.lib /out:%OUTPUT% /SUBSYSTEM:CONSOLE
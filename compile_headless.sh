@@ -0,0 +1,6 @@
+#!/bin/sh
+# Headless build for linux/mac, no libtcod or SDL needed.
+#   ./compile_headless.sh && ./bin/main_headless headless 10000 1
+cd "$(dirname "$0")"
+mkdir -p bin
+g++ -std=c++17 -O2 -Wall -DHEADLESS src/main.cpp -o bin/main_headless -lpthread
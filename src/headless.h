@@ -0,0 +1,356 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+// Stand-in for the parts of libtcod the game uses, for HEADLESS builds.
+// No window, no SDL, no libtcod binary, so the simulation builds and runs on
+// any box with a C++ compiler (soak tests, profiling on servers).
+// Consoles and images swallow every draw call. A console only keeps cells
+// (TCOD_ConsoleTile, same layout as libtcod's) when a bench sizes `tiles`,
+// then the map gets copied in there. The game does its own fov now,
+// TCODMap is only here for `main fovbench` and does Bresenham ray casting
+// which is close enough to FOV_BASIC to compare against.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+struct TCOD_color_t {
+    uint8_t r, g, b;
+};
+
+class TCODColor {
+public:
+    uint8_t r, g, b;
+
+    TCODColor() : r(0), g(0), b(0) {}
+    TCODColor(int r_, int g_, int b_) : r((uint8_t)r_), g((uint8_t)g_), b((uint8_t)b_) {}
+    TCODColor(const TCOD_color_t &col) : r(col.r), g(col.g), b(col.b) {}
+
+    TCODColor operator*(float value) const {
+        return TCODColor(std::min(255, (int)(r * value)), std::min(255, (int)(g * value)), std::min(255, (int)(b * value)));
+    }
+    bool operator==(const TCODColor &other) const {
+        return r == other.r && g == other.g && b == other.b;
+    }
+    bool operator!=(const TCODColor &other) const {
+        return !(*this == other);
+    }
+
+    static const TCODColor black;
+    static const TCODColor white;
+    static const TCODColor lightGrey;
+};
+const TCODColor TCODColor::black = TCODColor(0, 0, 0);
+const TCODColor TCODColor::white = TCODColor(255, 255, 255);
+const TCODColor TCODColor::lightGrey = TCODColor(159, 159, 159);
+
+// same values as libtcod's color table
+static const TCOD_color_t TCOD_white = { 255, 255, 255 };
+static const TCOD_color_t TCOD_light_grey = { 159, 159, 159 };
+static const TCOD_color_t TCOD_red = { 255, 0, 0 };
+static const TCOD_color_t TCOD_light_red = { 255, 63, 63 };
+static const TCOD_color_t TCOD_dark_red = { 191, 0, 0 };
+static const TCOD_color_t TCOD_darker_red = { 127, 0, 0 };
+static const TCOD_color_t TCOD_orange = { 255, 127, 0 };
+static const TCOD_color_t TCOD_darker_orange = { 127, 63, 0 };
+static const TCOD_color_t TCOD_amber = { 255, 191, 0 };
+static const TCOD_color_t TCOD_yellow = { 255, 255, 0 };
+static const TCOD_color_t TCOD_light_yellow = { 255, 255, 63 };
+static const TCOD_color_t TCOD_green = { 0, 255, 0 };
+static const TCOD_color_t TCOD_light_green = { 63, 255, 63 };
+static const TCOD_color_t TCOD_darker_green = { 0, 127, 0 };
+static const TCOD_color_t TCOD_desaturated_green = { 63, 127, 63 };
+static const TCOD_color_t TCOD_sky = { 0, 191, 255 };
+static const TCOD_color_t TCOD_light_azure = { 63, 159, 255 };
+static const TCOD_color_t TCOD_violet = { 127, 0, 255 };
+static const TCOD_color_t TCOD_light_pink = { 255, 63, 159 };
+
+//// INPUT
+
+enum TCOD_keycode_t {
+    TCODK_NONE,
+    TCODK_ESCAPE,
+    TCODK_ENTER,
+    TCODK_UP,
+    TCODK_DOWN,
+    TCODK_LEFT,
+    TCODK_RIGHT,
+    TCODK_PAGEUP,
+    TCODK_PAGEDOWN,
+    TCODK_END,
+    TCODK_CHAR
+};
+
+struct TCOD_key_t {
+    TCOD_keycode_t vk;
+    char c;
+    bool pressed;
+    bool lalt;
+    bool lctrl;
+    bool ralt;
+    bool rctrl;
+    bool shift;
+};
+
+struct TCOD_mouse_t {
+    int x, y;
+    int dx, dy;
+    int cx, cy;
+    int dcx, dcy;
+    bool lbutton;
+    bool rbutton;
+    bool mbutton;
+    bool lbutton_pressed;
+    bool rbutton_pressed;
+    bool mbutton_pressed;
+    bool wheel_up;
+    bool wheel_down;
+};
+
+//// CONSOLE
+
+enum TCOD_bkgnd_flag_t {
+    TCOD_BKGND_NONE,
+    TCOD_BKGND_SET,
+    TCOD_BKGND_SCREEN,
+    TCOD_BKGND_DEFAULT
+};
+
+enum TCOD_alignment_t {
+    TCOD_LEFT,
+    TCOD_RIGHT,
+    TCOD_CENTER
+};
+
+struct TCOD_ColorRGBA {
+    uint8_t r, g, b, a;
+};
+
+struct TCOD_ConsoleTile {
+    int ch;
+    TCOD_ColorRGBA fg;
+    TCOD_ColorRGBA bg;
+};
+
+class TCODConsole {
+public:
+    int width, height;
+    std::vector<TCOD_ConsoleTile> tiles; // empty unless a bench wants the cells
+
+    TCODConsole(int w, int h) : width(w), height(h) {}
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+    static TCODConsole *root;
+
+    void setDefaultForeground(TCODColor) {}
+    void setDefaultBackground(TCODColor) {}
+    void clear() {}
+    void rect(int, int, int, int, bool, TCOD_bkgnd_flag_t = TCOD_BKGND_DEFAULT) {}
+    void print(int, int, const char *, ...) {}
+    void printEx(int, int, TCOD_bkgnd_flag_t, TCOD_alignment_t, const char *, ...) {}
+    int printRectEx(int, int, int, int, TCOD_bkgnd_flag_t, TCOD_alignment_t, const char *, ...) { return 1; }
+    int getHeightRect(int, int, int, int, const char *, ...) { return 1; }
+    void setCharBackground(int, int, const TCODColor &, TCOD_bkgnd_flag_t = TCOD_BKGND_SET) {}
+    void putChar(int, int, int, TCOD_bkgnd_flag_t = TCOD_BKGND_DEFAULT) {}
+    void putCharEx(int, int, int, const TCODColor &, const TCODColor &) {}
+
+    static void blit(const TCODConsole *, int, int, int, int, TCODConsole *, int, int, float = 1.0f, float = 1.0f) {}
+    static void setFullscreen(bool) {}
+    static bool isFullscreen() { return false; }
+    static bool isWindowClosed();
+    static void flush();
+};
+TCODConsole *TCODConsole::root = NULL;
+
+//// SYSTEM
+// Keys come from a queue that any thread can push to with headless_push_key,
+// so a driver thread can run the real main loop (see `main idle`). flush()
+// measures how long a key sat in the queue until the frame that handled it
+// was done.
+
+enum TCOD_event_t {
+    TCOD_EVENT_NONE = 0,
+    TCOD_EVENT_KEY_PRESS = 1,
+    TCOD_EVENT_KEY_RELEASE = 2,
+    TCOD_EVENT_KEY = 3,
+    TCOD_EVENT_MOUSE_MOVE = 4,
+    TCOD_EVENT_MOUSE_PRESS = 8,
+    TCOD_EVENT_MOUSE_RELEASE = 16,
+    TCOD_EVENT_MOUSE = 28
+};
+
+struct HeadlessInput {
+    typedef std::chrono::steady_clock clock;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<TCOD_key_t, clock::time_point>> keys;
+    bool closed = false;
+
+    bool handled = false;
+    clock::time_point handled_pushed_at;
+    int latency_count = 0;
+    double latency_total_us = 0;
+    double latency_worst_us = 0;
+};
+HeadlessInput headless_input;
+
+void headless_push_key(TCOD_key_t key) {
+    {
+        std::lock_guard<std::mutex> lock(headless_input.mutex);
+        headless_input.keys.push_back({ key, HeadlessInput::clock::now() });
+    }
+    headless_input.cv.notify_one();
+}
+
+void headless_close_window() {
+    {
+        std::lock_guard<std::mutex> lock(headless_input.mutex);
+        headless_input.closed = true;
+    }
+    headless_input.cv.notify_one();
+}
+
+bool TCODConsole::isWindowClosed() {
+    std::lock_guard<std::mutex> lock(headless_input.mutex);
+    return headless_input.closed;
+}
+
+void TCODConsole::flush() {
+    if(!headless_input.handled) {
+        return;
+    }
+    headless_input.handled = false;
+    double us = std::chrono::duration<double, std::micro>(HeadlessInput::clock::now() - headless_input.handled_pushed_at).count();
+    headless_input.latency_count++;
+    headless_input.latency_total_us += us;
+    headless_input.latency_worst_us = std::max(headless_input.latency_worst_us, us);
+}
+
+class TCODSystem {
+public:
+    static TCOD_event_t checkForEvent(int, TCOD_key_t *key, TCOD_mouse_t *mouse) {
+        std::lock_guard<std::mutex> lock(headless_input.mutex);
+        return pop(key, mouse);
+    }
+
+    static TCOD_event_t waitForEvent(int, TCOD_key_t *key, TCOD_mouse_t *mouse, bool) {
+        std::unique_lock<std::mutex> lock(headless_input.mutex);
+        headless_input.cv.wait(lock, [] { return !headless_input.keys.empty() || headless_input.closed; });
+        return pop(key, mouse);
+    }
+
+private:
+    static TCOD_event_t pop(TCOD_key_t *key, TCOD_mouse_t *mouse) {
+        *key = TCOD_key_t();
+        *mouse = TCOD_mouse_t();
+        if(headless_input.keys.empty()) {
+            return TCOD_EVENT_NONE;
+        }
+        *key = headless_input.keys.front().first;
+        headless_input.handled = true;
+        headless_input.handled_pushed_at = headless_input.keys.front().second;
+        headless_input.keys.pop_front();
+        return TCOD_EVENT_KEY_PRESS;
+    }
+};
+
+class TCODImage {
+public:
+    TCODImage(const char *) {}
+    void blit2x(TCODConsole *, int, int, int = 0, int = 0, int = -1, int = -1) const {}
+};
+
+//// FOV
+
+enum TCOD_fov_algorithm_t {
+    FOV_BASIC
+};
+
+class TCODMap {
+public:
+    int width, height;
+    std::vector<bool> transparent;
+    std::vector<bool> in_fov;
+
+    TCODMap(int w, int h) : width(w), height(h), transparent(w * h, false), in_fov(w * h, false) {}
+
+    void clear(bool is_transparent, bool) {
+        std::fill(transparent.begin(), transparent.end(), is_transparent);
+        std::fill(in_fov.begin(), in_fov.end(), false);
+    }
+
+    void setProperties(int x, int y, bool is_transparent, bool) {
+        transparent[x + y * width] = is_transparent;
+    }
+
+    bool isInFov(int x, int y) const {
+        if(x < 0 || y < 0 || x >= width || y >= height) {
+            return false;
+        }
+        return in_fov[x + y * width];
+    }
+
+    // Bresenham rays from the origin to every cell on the edge of the view box,
+    // a ray stops on (and lights) the first opaque cell. radius 0 = unlimited.
+    void computeFov(int player_x, int player_y, int max_radius, bool light_walls, TCOD_fov_algorithm_t) {
+        std::fill(in_fov.begin(), in_fov.end(), false);
+        int x_min = 0, y_min = 0, x_max = width - 1, y_max = height - 1;
+        if(max_radius > 0) {
+            x_min = std::max(x_min, player_x - max_radius);
+            y_min = std::max(y_min, player_y - max_radius);
+            x_max = std::min(x_max, player_x + max_radius);
+            y_max = std::min(y_max, player_y + max_radius);
+        }
+        for(int x = x_min; x <= x_max; x++) {
+            cast_ray(player_x, player_y, x, y_min, max_radius, light_walls);
+            cast_ray(player_x, player_y, x, y_max, max_radius, light_walls);
+        }
+        for(int y = y_min; y <= y_max; y++) {
+            cast_ray(player_x, player_y, x_min, y, max_radius, light_walls);
+            cast_ray(player_x, player_y, x_max, y, max_radius, light_walls);
+        }
+    }
+
+private:
+    void cast_ray(int x0, int y0, int x1, int y1, int radius, bool light_walls) {
+        int dx = abs(x1 - x0), dy = -abs(y1 - y0);
+        int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+        int err = dx + dy;
+        int x = x0, y = y0;
+        while(true) {
+            if(radius > 0 && (x - x0) * (x - x0) + (y - y0) * (y - y0) > radius * radius) {
+                return;
+            }
+            int idx = x + y * width;
+            if(!transparent[idx] && (x != x0 || y != y0)) {
+                if(light_walls) {
+                    in_fov[idx] = true;
+                }
+                return;
+            }
+            in_fov[idx] = true;
+            if(x == x1 && y == y1) {
+                return;
+            }
+            int e2 = 2 * err;
+            if(e2 >= dy) {
+                err += dy;
+                x += sx;
+            }
+            if(e2 <= dx) {
+                err += dx;
+                y += sy;
+            }
+        }
+    }
+};
+
+#endif
@@ -1,131 +1,251 @@
+#ifdef HEADLESS
+#include "headless.h"
+#else
 #include "libtcod.hpp"
+#endif
 #include <iostream>
 #include <unordered_map>
 #include <time.h>
 #include <stdlib.h>
 #include <stdarg.h>
-#include <functional>
-
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+//// ALLOCATIONS
+// Every trip to the global heap is counted so the headless runner can say how
+// many allocations a turn or a floor change costs. Per thread, the floor
+// worker allocates too but that's off the main loop. Headless builds only,
+// the game itself keeps the stock operator new and its counts stay at 0.
+#include <new>
+#include <stdint.h>
+
+struct AllocStats {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+};
+thread_local AllocStats alloc_stats;
+
+#ifdef HEADLESS
+// gcc warns about new/free mismatches once these get inlined into callers
+#ifdef __GNUC__
+#define ALLOC_NOINLINE __attribute__((noinline))
+#else
+#define ALLOC_NOINLINE
+#endif
+
+ALLOC_NOINLINE void *operator new(size_t size) {
+    alloc_stats.count++;
+    alloc_stats.bytes += size;
+    void *p = malloc(size ? size : 1);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+ALLOC_NOINLINE void operator delete(void *p) noexcept {
+    free(p);
+}
+ALLOC_NOINLINE void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+#endif
 
 // http://rogueliketutorials.com/tutorials/tcod/part-13/
 // http://www.roguebasin.com/index.php?title=Complete_roguelike_tutorial_using_C%2B%2B_and_libtcod_-_part_10.1:_persistence
 
 ////// ECS
-// #include <queue>
-// #include <bitset>
-
-// const unsigned ENTITY_INDEX_BITS = 22;
-// const unsigned ENTITY_INDEX_MASK = (1<<ENTITY_INDEX_BITS)-1;
-// const unsigned ENTITY_GENERATION_BITS = 8;
-// const unsigned ENTITY_GENERATION_MASK = (1<<ENTITY_GENERATION_BITS)-1;
-
-// typedef unsigned EntityId;
-
-// struct Entity {
-//     EntityId id = 0;
-//     unsigned index() const { return id & ENTITY_INDEX_MASK; }
-//     unsigned generation() const { return (id >> ENTITY_INDEX_BITS) & ENTITY_GENERATION_MASK; }
-//     bool equals(Entity other) {
-//         return id == other.id;
-//     }
-//     const bool equals(const Entity &other) const {
-//         return id == other.id;
-//     }
-// };
-
-// class ComponentID {
-//     static size_t counter;
-//     public:
-//         template<typename T>
-//         static size_t value() {
-//             static size_t id = counter++;
-//             return id;
-//         }
-// };
-
-// const unsigned MINIMUM_FREE_INDICES = 1024;
-// struct EntityManager {
-//     std::vector<unsigned char> _generation;
-//     std::queue<unsigned> _free_indices;
-
-//     Entity create() {
-//         unsigned idx;
-//         if (_free_indices.size() > MINIMUM_FREE_INDICES) {
-//             idx = _free_indices.front();
-//             _free_indices.pop();
-//         } else {
-//             _generation.push_back(0);
-//             idx = _generation.size() - 1;
-//             // ASSERT_WITH_MSG(idx < (1 << ENTITY_INDEX_BITS), "idx is malformed, larger than 22 bits?");
-//         }
-//         return make_entity(idx, _generation[idx]);
-//     }
-
-//     Entity make_entity(unsigned idx, unsigned char generation) {
-//         Entity e;
-//         auto id = generation << ENTITY_INDEX_BITS | idx;
-//         e.id = id;
-//         return e;
-//     }
-
-//     bool alive(Entity e) const {
-//         return _generation[e.index()] == e.generation();
-//     }
-
-//     void destroy(Entity e) {
-//         if(!alive(e))
-//             return;
-//         const unsigned idx = e.index();
-//         ++_generation[idx];
-//         _free_indices.push(idx);
-//     }
-// };
-
-// typedef std::bitset<512> ComponentMask;
-
-// struct PositionComponent { int x; };
-// struct VisualComponent { char visual; };
-// struct PlayerInput { int input; };
-// std::vector<Entity> entities;
-// struct Components {
-//     std::vector<PositionComponent> positions;
-//     std::vector<VisualComponent> visuals;
-//     std::vector<PlayerInput> player_inputs;
-// } comps;
-
-// template<typename ComponentType>
-// void add_component(EntityX &e, std::vector<ComponentType> &tv, const ComponentType &t) {
-//     tv[e.id] = t;
-//     e.bitset += 1;
-// }
-
-// void create_entity() {
-//     EntityX x = { 0, 1 };
-//     add_component(x, comps.positions, { 32 });
-// }
-
-// void sample_system(std::vector<PositionComponent> &positions) {
-//     int system_bitset = 2;
-//     for(auto &e : entities) {
-//         if(e.bitset & system_bitset) {
-//             auto &p = positions[e.id];
-//             p.x += 2;
-//         }
-//     }
-// }
+#include <queue>
+#include <algorithm>
+
+// Entities are just handles, index + generation packed in 32 bits.
+// The generation is bumped when an entity is destroyed so stale handles
+// (e.g. an equipped item that got used up) never resolve to a new entity.
+const unsigned ENTITY_INDEX_BITS = 22;
+const unsigned ENTITY_INDEX_MASK = (1<<ENTITY_INDEX_BITS)-1;
+const unsigned ENTITY_GENERATION_BITS = 8;
+const unsigned ENTITY_GENERATION_MASK = (1<<ENTITY_GENERATION_BITS)-1;
+
+typedef unsigned EntityId;
+const EntityId ENTITY_INVALID_ID = 0xffffffff;
+
+struct Entity {
+    EntityId id = ENTITY_INVALID_ID;
+    unsigned index() const { return id & ENTITY_INDEX_MASK; }
+    unsigned generation() const { return (id >> ENTITY_INDEX_BITS) & ENTITY_GENERATION_MASK; }
+    bool valid() const { return id != ENTITY_INVALID_ID; }
+    bool equals(const Entity &other) const {
+        return id == other.id;
+    }
+    bool operator==(const Entity &other) const { return id == other.id; }
+    bool operator!=(const Entity &other) const { return id != other.id; }
+};
+const Entity ENTITY_NONE = Entity();
+
+const unsigned MINIMUM_FREE_INDICES = 1024;
+struct EntityManager {
+    std::vector<unsigned char> _generation;
+    // FIFO of free indices, popped from _free_head. A vector instead of a
+    // std::queue so recycling indices doesn't allocate and free deque chunks.
+    std::vector<unsigned> _free_indices;
+    size_t _free_head = 0;
+
+    Entity create() {
+        unsigned idx;
+        if (_free_indices.size() - _free_head > MINIMUM_FREE_INDICES) {
+            idx = _free_indices[_free_head++];
+            if(_free_head >= MINIMUM_FREE_INDICES) {
+                _free_indices.erase(_free_indices.begin(), _free_indices.begin() + _free_head);
+                _free_head = 0;
+            }
+        } else {
+            _generation.push_back(0);
+            idx = (unsigned)_generation.size() - 1;
+        }
+        return make_entity(idx, _generation[idx]);
+    }
+
+    Entity make_entity(unsigned idx, unsigned char generation) {
+        Entity e;
+        e.id = generation << ENTITY_INDEX_BITS | idx;
+        return e;
+    }
+
+    bool alive(Entity e) const {
+        return e.valid() && e.index() < _generation.size() && _generation[e.index()] == e.generation();
+    }
+
+    void destroy(Entity e) {
+        if(!alive(e))
+            return;
+        const unsigned idx = e.index();
+        _generation[idx] = (_generation[idx] + 1) & ENTITY_GENERATION_MASK;
+        _free_indices.push_back(idx);
+    }
+};
+
+// One bit per component type, stored per entity index so "has X and Y" is one AND.
+// Tag components (Blocks etc) only exist as a bit.
+typedef unsigned ComponentMask;
+enum ComponentBit : ComponentMask {
+    COMPONENT_POSITION   = 1 << 0,
+    COMPONENT_RENDERABLE = 1 << 1,
+    COMPONENT_NAME       = 1 << 2,
+    COMPONENT_FIGHTER    = 1 << 3,
+    COMPONENT_AI         = 1 << 4,
+    COMPONENT_INVENTORY  = 1 << 5,
+    COMPONENT_ITEM       = 1 << 6,
+    COMPONENT_STAIRS     = 1 << 7,
+    COMPONENT_LEVEL      = 1 << 8,
+    COMPONENT_EQUIPMENT  = 1 << 9,
+    COMPONENT_EQUIPPABLE = 1 << 10,
+    COMPONENT_MODIFIERS  = 1 << 11,
+    // tags
+    TAG_BLOCKS           = 1 << 16,
+    TAG_MARKED_FOR_DELETION = 1 << 17
+};
+
+// Sparse set: components are packed in `dense` (iterate that in systems),
+// `sparse` maps entity index -> dense slot. Removal swaps the last element in,
+// so pointers/references into `dense` are only valid until the next add/remove.
+const unsigned COMPONENT_INVALID_SLOT = 0xffffffff;
+template<typename T>
+struct ComponentArray {
+    ComponentMask bit;
+    std::vector<T> dense;
+    std::vector<Entity> owners;
+    std::vector<unsigned> sparse;
+
+    ComponentArray(ComponentMask bit) : bit(bit) {}
+
+    size_t size() const { return dense.size(); }
+
+    void reserve(size_t entities) {
+        dense.reserve(entities);
+        owners.reserve(entities);
+        sparse.reserve(entities);
+    }
+
+    T &add(Entity e, const T &component) {
+        unsigned idx = e.index();
+        if(idx >= sparse.size()) {
+            sparse.resize(idx + 1, COMPONENT_INVALID_SLOT);
+        }
+        unsigned slot = sparse[idx];
+        if(slot != COMPONENT_INVALID_SLOT && owners[slot] == e) {
+            dense[slot] = component;
+            return dense[slot];
+        }
+        sparse[idx] = (unsigned)dense.size();
+        dense.push_back(component);
+        owners.push_back(e);
+        return dense.back();
+    }
+
+    T *get(Entity e) {
+        unsigned idx = e.index();
+        if(!e.valid() || idx >= sparse.size()) {
+            return NULL;
+        }
+        unsigned slot = sparse[idx];
+        if(slot == COMPONENT_INVALID_SLOT || owners[slot] != e) {
+            return NULL;
+        }
+        return &dense[slot];
+    }
+
+    void remove(Entity e) {
+        if(!get(e)) {
+            return;
+        }
+        unsigned slot = sparse[e.index()];
+        unsigned last = (unsigned)dense.size() - 1;
+        if(slot != last) {
+            dense[slot] = std::move(dense[last]);
+            owners[slot] = owners[last];
+            sparse[owners[slot].index()] = slot;
+        }
+        dense.pop_back();
+        owners.pop_back();
+        sparse[e.index()] = COMPONENT_INVALID_SLOT;
+    }
+
+    // Drops every component whose owner is dead in one pass, keeps the order of the rest
+    void remove_dead(const EntityManager &manager) {
+        size_t out = 0;
+        for(size_t i = 0; i < dense.size(); i++) {
+            Entity e = owners[i];
+            if(!manager.alive(e)) {
+                sparse[e.index()] = COMPONENT_INVALID_SLOT;
+                continue;
+            }
+            if(out != i) {
+                dense[out] = std::move(dense[i]);
+                owners[out] = e;
+            }
+            sparse[e.index()] = (unsigned)out;
+            out++;
+        }
+        dense.erase(dense.begin() + out, dense.end());
+        owners.erase(owners.begin() + out, owners.end());
+    }
+
+    void clear() {
+        dense.clear();
+        owners.clear();
+        sparse.clear();
+    }
+};
 
 // Skipped things:
 // - A* movement for monsters (Part 6)
 // - Separate drop item inventory listing (Part 8)
-// - SAVING & LOADING => too many pointers and fucked up architecture
-//   - better handle that from the start on refactoring phase
 
 // Things to do
 
 // - input handling (check ben porter how its done)
 // - event handling and decoupling
 // - remove all the naked pointers (do this or ECS first?)
-// - save/load
 
 // Intressant uppdelning 
 //   => http://i.imgur.com/PCKu0ip.png
@@ -150,21 +270,92 @@
 // https://blog.therocode.net/2018/08/simplest-entity-component-system
 // https://austinmorlan.com/posts/entity_component_system/
 
-int rand_int(int min, int max) {
-    int lower = min;
-    int upper = max;
-    return (rand() % (upper - lower + 1)) + lower; 
+//// RANDOM
+// xoshiro128** (http://prng.di.unimi.it/), one instance per subsystem so
+// e.g. a confused monster stumbling around doesn't change the next floor's layout.
+// Streams are derived from the game seed with splitmix64, level and spawn
+// streams are seeded per floor so a floor only depends on (seed, level).
+#include <stdint.h>
+
+struct Rng {
+    uint32_t s[4];
+};
+
+uint64_t splitmix64(uint64_t &state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(Rng &rng, uint64_t seed) {
+    uint64_t state = seed;
+    uint64_t a = splitmix64(state);
+    uint64_t b = splitmix64(state);
+    rng.s[0] = (uint32_t)a;
+    rng.s[1] = (uint32_t)(a >> 32);
+    rng.s[2] = (uint32_t)b;
+    rng.s[3] = (uint32_t)(b >> 32);
+}
+
+static inline uint32_t rng_rotl(const uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+uint32_t rng_next(Rng &rng) {
+    uint32_t *s = rng.s;
+    const uint32_t result = rng_rotl(s[1] * 5, 7) * 9;
+    const uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 11);
+    return result;
+}
+
+enum RngStream {
+    RNG_LEVEL,
+    RNG_SPAWN,
+    RNG_AI,
+    RNG_COMBAT,
+    RNG_STREAM_COUNT
+};
+
+// level and spawn streams live in floor generation (floor_plan_generate)
+struct RngStreams {
+    uint64_t seed = 0;
+    Rng ai;
+    Rng combat;
+} rng;
+
+uint64_t rng_stream_seed(uint64_t seed, RngStream stream, int floor) {
+    uint64_t state = seed ^ ((uint64_t)stream << 56) ^ ((uint64_t)(uint32_t)floor << 24);
+    return splitmix64(state);
+}
+
+void rng_seed_game(uint64_t seed) {
+    rng.seed = seed;
+    rng_seed(rng.ai, rng_stream_seed(seed, RNG_AI, 0));
+    rng_seed(rng.combat, rng_stream_seed(seed, RNG_COMBAT, 0));
+}
+
+int rand_int(Rng &rng, int min, int max) {
+    uint32_t range = (uint32_t)(max - min) + 1;
+    // multiply-shift instead of modulo, bias is negligible for our ranges
+    return min + (int)(((uint64_t)rng_next(rng) * range) >> 32);
 }
 
 /// returns an weighted index from an array of weights 
 /// input e.g.: [10, 10, 80], 3
 /// output: one of 0, 1, 2 depending on rand_int result
-int rand_weighted_index(int *chances, int size) {
+int rand_weighted_index(Rng &rng, int *chances, int size) {
     int sum_of_chances = 0;
     for(int i = 0; i < size; i++) {
         sum_of_chances += chances[i];
     }
-    int random_chance = rand_int(1, sum_of_chances);
+    int random_chance = rand_int(rng, 1, sum_of_chances);
 
     int running_sum = 0;
     int choice = 0;
@@ -182,7 +373,7 @@ struct WeightByLevel {
     int weight;
     int level;
 };
-int from_dungeon_level(std::vector<WeightByLevel> &table, int dungeon_level) {
+int from_dungeon_level(const std::vector<WeightByLevel> &table, int dungeon_level) {
     for(size_t i = table.size(); i--;) {
         if(dungeon_level >= table[i].level) {
             return table[i].weight;
@@ -191,6 +382,129 @@ int from_dungeon_level(std::vector<WeightByLevel> &table, int dungeon_level) {
     return 0;
 }
 
+// Weighted picks in O(1) however many outcomes there are: Vose's alias method.
+// Every column holds an outcome, the chance (of 2^32) of keeping it and the
+// outcome it gives otherwise. An outcome can be a whole other table
+// (a loot table inside a loot table), which gets picked from in turn.
+// Build once, the picking is read only so any thread can share a table.
+struct SpawnTable;
+
+struct SpawnWeight {
+    int weight;
+    int outcome;                      // caller's index, e.g. into monster_data
+    const SpawnTable *nested = NULL;  // picked from instead of returning `outcome`
+};
+
+struct SpawnTable {
+    std::vector<uint32_t> keep;
+    std::vector<uint32_t> alias;
+    std::vector<int> outcomes;  // -1 - i = nested[i]
+    std::vector<const SpawnTable *> nested;
+
+    bool empty() const {
+        return keep.empty();
+    }
+};
+
+// zero weights are left out, they never come up
+void spawn_table_build(SpawnTable &table, const std::vector<SpawnWeight> &weights) {
+    table = SpawnTable();
+    uint64_t total = 0;
+    for(auto &w : weights) {
+        if(w.weight <= 0) {
+            continue;
+        }
+        if(w.nested) {
+            table.outcomes.push_back(-1 - (int)table.nested.size());
+            table.nested.push_back(w.nested);
+        } else {
+            table.outcomes.push_back(w.outcome);
+        }
+        total += (uint64_t)w.weight;
+    }
+    const uint32_t n = (uint32_t)table.outcomes.size();
+    if(n == 0) {
+        return;
+    }
+
+    // in units where a full column is `total`
+    std::vector<uint64_t> scaled;
+    std::vector<uint32_t> small, large;
+    for(auto &w : weights) {
+        if(w.weight > 0) {
+            scaled.push_back((uint64_t)w.weight * n);
+            (scaled.back() < total ? small : large).push_back((uint32_t)scaled.size() - 1);
+        }
+    }
+    table.keep.assign(n, 0xffffffffu);
+    table.alias.resize(n);
+    for(uint32_t i = 0; i < n; i++) {
+        table.alias[i] = i;
+    }
+    while(!small.empty() && !large.empty()) {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        table.keep[s] = (uint32_t)std::min(4294967295.0, (double)scaled[s] / (double)total * 4294967296.0);
+        table.alias[s] = l;
+        // l fills up the rest of the column
+        scaled[l] -= total - scaled[s];
+        if(scaled[l] < total) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // what's left is full columns give or take rounding
+}
+
+// One rng_next: the high half of the product picks the column, the low half
+// is uniform within it and decides keep or alias. -1 if the table is empty.
+int spawn_table_pick(const SpawnTable &table, Rng &rng) {
+    const SpawnTable *t = &table;
+    while(!t->empty()) {
+        uint64_t r = (uint64_t)rng_next(rng) * t->keep.size();
+        uint32_t column = (uint32_t)(r >> 32);
+        uint32_t index = (uint32_t)r < t->keep[column] ? column : t->alias[column];
+        int outcome = t->outcomes[index];
+        if(outcome >= 0) {
+            return outcome;
+        }
+        t = t->nested[-1 - outcome];
+    }
+    return -1;
+}
+
+// A table per dungeon level for blueprints with `weights` by level. Past the
+// deepest level any weight changes at they all stay the same, so that's
+// where the list ends.
+struct SpawnLevels {
+    std::vector<SpawnTable> levels;
+
+    const SpawnTable &at(int level) const {
+        return levels[std::max(1, std::min(level, (int)levels.size())) - 1];
+    }
+};
+
+template<typename Blueprint>
+SpawnLevels spawn_levels_build(const std::vector<Blueprint> &blueprints) {
+    int deepest = 1;
+    for(auto &b : blueprints) {
+        for(auto &w : b.weights) {
+            deepest = std::max(deepest, w.level);
+        }
+    }
+    SpawnLevels spawns;
+    spawns.levels.resize(deepest);
+    std::vector<SpawnWeight> weights;
+    for(int level = 1; level <= deepest; level++) {
+        weights.clear();
+        for(size_t i = 0; i < blueprints.size(); i++) {
+            weights.push_back({ from_dungeon_level(blueprints[i].weights, level), (int)i });
+        }
+        spawn_table_build(spawns.levels[level - 1], weights);
+    }
+    return spawns;
+}
+
 struct Rect {
     int x, y, w, h, x2, y2;
 };
@@ -244,28 +558,161 @@ enum GameState {
     CHARACTER_SCREEN
 };
 
-enum EventType {
+//// MESSAGES
+// Everything the game can say to the player. Events only carry the id and
+// its arguments, text is put together when it goes into the log. In a format
+// each %s takes the next of: the event's text (if set), the subject's name,
+// the other entity's name. %d is the event's value.
+enum MessageId : uint8_t {
+    MSG_TEXT,
+    MSG_WELCOME,
+    MSG_ATTACK_HIT,
+    MSG_ATTACK_NO_DAMAGE,
+    MSG_NO_LONGER_CONFUSED,
+    MSG_ITEM_CANNOT_BE_USED,
+    MSG_ALREADY_FULL_HEALTH,
+    MSG_WOUNDS_BETTER,
+    MSG_LIGHTNING_HIT,
+    MSG_LIGHTNING_NO_TARGET,
+    MSG_TARGET_OUT_OF_FOV,
+    MSG_FIREBALL_EXPLODES,
+    MSG_FIREBALL_BURN,
+    MSG_CONFUSED,
+    MSG_NO_TARGETABLE,
+    MSG_TARGETING_CANCELLED,
+    MSG_NOTHING_TO_PICK_UP,
+    MSG_NO_STAIRS,
+    MSG_REST,
+    MSG_PLAYER_DIED,
+    MSG_DIED,
+    MSG_XP_GAINED,
+    MSG_LEVEL_UP,
+    MSG_PICKED_UP,
+    MSG_INVENTORY_FULL,
+    MSG_DEQUIPPED,
+    MSG_EQUIPPED,
+    MSG_COUNT
+};
+
+struct MessageInfo {
+    const char *format;
+    TCOD_color_t color;
+};
+const MessageInfo message_info[MSG_COUNT] = {
+    { "%s", TCOD_yellow },
+    { "Welcome %s \nA throne is the most devious trap of them all..", TCOD_light_azure },
+    { "%s attacks %s for %d hit points", TCOD_amber },
+    { "%s attacks %s but deals no damage", TCOD_light_grey },
+    { "The %s is no longer confused!", TCOD_red },
+    { "The %s cannot be used.", TCOD_yellow },
+    { "You are already at full health", TCOD_yellow },
+    { "Your wounds start to feel better!", TCOD_green },
+    { "A lighting bolt strikes the %s with a loud thunder! \nThe damage is %d", TCOD_amber },
+    { "No enemy is close enough to strike.", TCOD_red },
+    { "You cannot target a tile outside your field of view.", TCOD_yellow },
+    { "The fireball explodes, burning everything within %d tiles!", TCOD_orange },
+    { "The %s gets burned for %d hit points.", TCOD_orange },
+    { "The eyes of the %s looks vacant as it starts to stumble around!", TCOD_light_green },
+    { "There is no targetable entity at that location.", TCOD_yellow },
+    { "Targeting cancelled", TCOD_yellow },
+    { "There is nothing here to pick up.", TCOD_yellow },
+    { "There are no stairs here.", TCOD_yellow },
+    { "You take a moment to rest, and recover your strength.", TCOD_white },
+    { "YOU died!", TCOD_red },
+    { "%s died!", TCOD_light_green },
+    { "You gain %d experience points.", TCOD_yellow },
+    { "You become stronger! You reached level %d", TCOD_yellow },
+    { "You picked up the %s !", TCOD_yellow },
+    { "You cannot carry anymore, inventory full", TCOD_yellow },
+    { "You dequipped the %s", TCOD_yellow },
+    { "You equipped the %s", TCOD_yellow }
+};
+
+//// EVENTS
+// Fixed size ring of small structured events, nothing on the heap. Systems
+// subscribe per event type (game_subscribe_events) and get called in queue
+// order. Handlers may queue more events while the queue is being dispatched.
+enum class EventType : uint8_t {
     Message,
+    Attack,
     EntityDead,
     ItemPickup,
     NextFloor,
-    EquipmentChange
+    EquipmentChange,
+    COUNT
 };
 
-struct EntityFat;
-
-
 struct Event {
     EventType type;
-    EntityFat *entity = NULL;
-    std::string message;
-    TCOD_color_t color;
-    int flag;
+    MessageId message;  // Message events
+    Entity entity;      // subject: attacker, dead entity, item... events whose subject is gone are dropped
+    Entity other;       // attack target, second name in a message
+    int value;          // damage, equip flag (1 = equipped), message number
+    const char *text;   // MSG_TEXT, points at static data
 };
 
-std::vector<Event> _event_queue; 
-void events_queue(Event e) {
-    _event_queue.push_back(e);
+typedef void (*EventHandler)(const Event &e);
+
+const unsigned EVENT_CAPACITY = 4096; // to start with, a power of two so the ring can mask
+const unsigned EVENT_MAX_SUBSCRIBERS = 4;
+struct EventBus {
+    std::vector<Event> ring = std::vector<Event>(EVENT_CAPACITY);
+    unsigned head = 0, tail = 0;
+    unsigned peak = 0, grown = 0; // for the headless report
+    EventHandler subscribers[(int)EventType::COUNT][EVENT_MAX_SUBSCRIBERS];
+    unsigned subscriber_count[(int)EventType::COUNT] = {};
+} event_bus;
+
+void events_subscribe(EventType type, EventHandler handler) {
+    unsigned &count = event_bus.subscriber_count[(int)type];
+    if(count == EVENT_MAX_SUBSCRIBERS) {
+        engine_log(LogStatus::Error, "Too many subscribers for event type " + std::to_string((int)type));
+        return;
+    }
+    event_bus.subscribers[(int)type][count++] = handler;
+}
+
+Event &events_at(unsigned i) {
+    return event_bus.ring[i & (event_bus.ring.size() - 1)];
+}
+
+void events_queue(const Event &e) {
+    unsigned count = event_bus.tail - event_bus.head;
+    if(count == event_bus.ring.size()) {
+        // never drop one, a lost EntityDead leaves a monster half dead. A turn
+        // that queues thousands has bigger problems though, so grow and say so
+        std::vector<Event> bigger(event_bus.ring.size() * 2);
+        for(unsigned i = 0; i < count; i++) {
+            bigger[i] = events_at(event_bus.head + i);
+        }
+        event_bus.ring.swap(bigger);
+        event_bus.head = 0;
+        event_bus.tail = count;
+        event_bus.grown++;
+        engine_log(LogStatus::Warning, "Event queue full, grew it to " + std::to_string(event_bus.ring.size()));
+    }
+    events_at(event_bus.tail++) = e;
+    event_bus.peak = std::max(event_bus.peak, count + 1);
+}
+
+void events_queue(EventType type, Entity entity, Entity other = ENTITY_NONE, int value = 0) {
+    events_queue({ type, MSG_TEXT, entity, other, value, NULL });
+}
+
+void events_message(MessageId message, Entity subject = ENTITY_NONE, Entity other = ENTITY_NONE, int value = 0) {
+    events_queue({ EventType::Message, message, subject, other, value, NULL });
+}
+
+void events_message_text(const char *text) {
+    events_queue({ EventType::Message, MSG_TEXT, ENTITY_NONE, ENTITY_NONE, 0, text });
+}
+
+bool events_pending() {
+    return event_bus.head != event_bus.tail;
+}
+
+void events_clear() {
+    event_bus.head = event_bus.tail = 0;
 }
 
     const int Map_Width = 80;
@@ -273,24 +720,435 @@ void events_queue(Event e) {
     const int Room_max_size = 10;
     const int Room_min_size = 6;
     const int Max_rooms = 30; 
-    const TCOD_fov_algorithm_t fov_algorithm = FOV_BASIC;
     const bool fov_light_walls = true;
     const int fov_radius = 10;
 
-struct Tile {
-    bool blocked = true;
-    bool block_sight = true;
-    bool explored = false;
+//// BIT PLANES
+// One bit per map cell. Rows are padded to whole 64 bit words so a row op never
+// touches the next row, and the padding bits are always 0 so count() is exact.
+// Bulk ops are plain loops over words, the compiler turns those into SIMD.
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+// 32 bit halves, the 64 bit intrinsics don't exist on x86
+inline int bits_popcount(uint64_t v) {
+    return (int)(__popcnt((unsigned)v) + __popcnt((unsigned)(v >> 32)));
+}
+inline int bits_ctz(uint64_t v) {
+    unsigned long i;
+    if(_BitScanForward(&i, (unsigned long)v)) {
+        return (int)i;
+    }
+    _BitScanForward(&i, (unsigned long)(v >> 32));
+    return (int)i + 32;
+}
+#else
+inline int bits_popcount(uint64_t v) {
+#ifdef __POPCNT__
+    return __builtin_popcountll(v);
+#else
+    // the builtin is a libgcc call without -mpopcnt, this one vectorizes
+    v = v - ((v >> 1) & 0x5555555555555555ull);
+    v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (int)((v * 0x0101010101010101ull) >> 56);
+#endif
+}
+inline int bits_ctz(uint64_t v) {
+    return __builtin_ctzll(v);
+}
+#endif
+
+template<int W, int H>
+struct BitPlane {
+    static const int Row_words = (W + 63) / 64;
+    static const int Words = Row_words * H;
+    uint64_t words[Words] = {};
+
+    // the bits of the last word in a row that are on the map
+    static uint64_t tail_mask() {
+        return W % 64 ? ~0ull >> (64 - W % 64) : ~0ull;
+    }
+
+    bool get(int x, int y) const {
+        return (words[y * Row_words + (x >> 6)] >> (x & 63)) & 1;
+    }
+    void set(int x, int y) {
+        words[y * Row_words + (x >> 6)] |= 1ull << (x & 63);
+    }
+    void reset(int x, int y) {
+        words[y * Row_words + (x >> 6)] &= ~(1ull << (x & 63));
+    }
+
+    // sets [x0, x1) on row y
+    void set_span(int y, int x0, int x1) {
+        for(int w = x0 >> 6; x0 < x1; w++) {
+            int end = std::min(x1, (w + 1) * 64);
+            uint64_t bits = ~0ull >> (64 - (end - x0));
+            words[y * Row_words + w] |= bits << (x0 & 63);
+            x0 = end;
+        }
+    }
+
+    void clear() {
+        std::fill(words, words + Words, 0ull);
+    }
+    void fill() {
+        std::fill(words, words + Words, ~0ull);
+        for(int y = 0; y < H; y++) {
+            words[y * Row_words + Row_words - 1] = tail_mask();
+        }
+    }
+
+    // this |= other
+    void unite(const BitPlane &other) {
+        for(int i = 0; i < Words; i++) {
+            words[i] |= other.words[i];
+        }
+    }
+    // this &= other
+    void intersect(const BitPlane &other) {
+        for(int i = 0; i < Words; i++) {
+            words[i] &= other.words[i];
+        }
+    }
+    // this &= ~other
+    void subtract(const BitPlane &other) {
+        for(int i = 0; i < Words; i++) {
+            words[i] &= ~other.words[i];
+        }
+    }
+
+    int count() const {
+        int n = 0;
+        for(int i = 0; i < Words; i++) {
+            n += bits_popcount(words[i]);
+        }
+        return n;
+    }
+
+    // first set cell on row y at or after x, W if there is none
+    int next_set(int y, int x) const {
+        if(x >= W) {
+            return W;
+        }
+        const uint64_t *row = words + y * Row_words;
+        int w = x >> 6;
+        uint64_t bits = row[w] & (~0ull << (x & 63));
+        while(!bits) {
+            if(++w == Row_words) {
+                return W;
+            }
+            bits = row[w];
+        }
+        return w * 64 + bits_ctz(bits);
+    }
+};
+
+typedef BitPlane<Map_Width, Map_Height> MapBits;
+
+//// FOV
+// Reads the map's transparent plane and writes a visible plane, nothing from
+// libtcod. radius 0 = unlimited. The origin is always visible.
+//   FOV_SHADOWCAST - recursive shadowcasting, 8 octants, symmetric-ish and cheap
+//   FOV_RAYS       - Bresenham rays to every cell on the edge of the view box,
+//                    close to libtcod's FOV_BASIC
+
+enum FovAlgorithm {
+    FOV_SHADOWCAST,
+    FOV_RAYS
 };
+FovAlgorithm fov_algorithm = FOV_SHADOWCAST;
+
+// octant -> map transform, x = cx + col * xx + row * xy, y = cy + col * yx + row * yy
+static const int fov_octants[8][4] = {
+    { 1, 0, 0, 1 }, { 0, 1, 1, 0 }, { 0, -1, 1, 0 }, { -1, 0, 0, 1 },
+    { -1, 0, 0, -1 }, { 0, -1, -1, 0 }, { 0, 1, -1, 0 }, { 1, 0, 0, -1 }
+};
+
+// Lights rows `row`..radius of one octant between slopes start (high) and end
+// (low), recursing past each run of opaque cells.
+template<int W, int H>
+void fov_cast_light(const BitPlane<W, H> &transparent, BitPlane<W, H> &visible, int cx, int cy, 
+    int row, float start, float end, int radius, const int *t, bool light_walls) {
+    if(start < end) {
+        return;
+    }
+    float new_start = 0.0f;
+    for(int j = row; j <= radius; j++) {
+        bool blocked = false;
+        for(int dx = -j, dy = -j; dx <= 0; dx++) {
+            float l_slope = (dx - 0.5f) / (dy + 0.5f);
+            float r_slope = (dx + 0.5f) / (dy - 0.5f);
+            if(start < r_slope) {
+                continue;
+            } else if(end > l_slope) {
+                break;
+            }
+
+            int x = cx + dx * t[0] + dy * t[1];
+            int y = cy + dx * t[2] + dy * t[3];
+            bool inside = x >= 0 && y >= 0 && x < W && y < H;
+            bool opaque = !inside || !transparent.get(x, y);
+            if(inside && dx * dx + dy * dy <= radius * radius && (light_walls || !opaque)) {
+                visible.set(x, y);
+            }
+
+            if(blocked) {
+                if(opaque) {
+                    new_start = r_slope;
+                } else {
+                    blocked = false;
+                    start = new_start;
+                }
+            } else if(opaque && j < radius) {
+                blocked = true;
+                fov_cast_light(transparent, visible, cx, cy, j + 1, start, l_slope, radius, t, light_walls);
+                new_start = r_slope;
+            }
+        }
+        if(blocked) {
+            break;
+        }
+    }
+}
+
+template<int W, int H>
+void fov_cast_ray(const BitPlane<W, H> &transparent, BitPlane<W, H> &visible, int x0, int y0, int x1, int y1, int radius, bool light_walls) {
+    int dx = abs(x1 - x0), dy = -abs(y1 - y0);
+    int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+    int x = x0, y = y0;
+    while(true) {
+        if((x - x0) * (x - x0) + (y - y0) * (y - y0) > radius * radius) {
+            return;
+        }
+        if(!transparent.get(x, y) && (x != x0 || y != y0)) {
+            if(light_walls) {
+                visible.set(x, y);
+            }
+            return;
+        }
+        visible.set(x, y);
+        if(x == x1 && y == y1) {
+            return;
+        }
+        int e2 = 2 * err;
+        if(e2 >= dy) {
+            err += dy;
+            x += sx;
+        }
+        if(e2 <= dx) {
+            err += dx;
+            y += sy;
+        }
+    }
+}
+
+template<int W, int H>
+void fov_compute(const BitPlane<W, H> &transparent, BitPlane<W, H> &visible, int x, int y, int radius, bool light_walls, FovAlgorithm algorithm) {
+    visible.clear();
+    if(radius <= 0) {
+        radius = W + H;
+    }
+    visible.set(x, y);
+    if(algorithm == FOV_SHADOWCAST) {
+        for(int o = 0; o < 8; o++) {
+            fov_cast_light(transparent, visible, x, y, 1, 1.0f, 0.0f, radius, fov_octants[o], light_walls);
+        }
+    } else {
+        int x_min = std::max(0, x - radius), y_min = std::max(0, y - radius);
+        int x_max = std::min(W - 1, x + radius), y_max = std::min(H - 1, y + radius);
+        for(int cx = x_min; cx <= x_max; cx++) {
+            fov_cast_ray(transparent, visible, x, y, cx, y_min, radius, light_walls);
+            fov_cast_ray(transparent, visible, x, y, cx, y_max, radius, light_walls);
+        }
+        for(int cy = y_min; cy <= y_max; cy++) {
+            fov_cast_ray(transparent, visible, x, y, x_min, cy, radius, light_walls);
+            fov_cast_ray(transparent, visible, x, y, x_max, cy, radius, light_walls);
+        }
+    }
+}
 
 struct GameMap {
-    Tile tiles[Map_Width * Map_Height];
-    TCODMap *tcod_fov_map;
+    // tile state, one plane per property
+    MapBits walkable;
+    MapBits transparent;
+    MapBits explored;
+    MapBits visible; // as of the last map_compute_fov
     int num_rooms = 0;
     std::vector<Rect> rooms;
     int level = 1;
+    // origin of the last fov compute, -1 = none yet
+    int fov_x = -1, fov_y = -1;
+};
+
+//// FLOW FIELDS
+// Dijkstra maps: for every walkable cell the cost to the nearest goal, moves
+// in 8 directions all costing Flow_step. One field toward the player is shared
+// by every monster, a monster just steps to its cheapest free neighbour, so
+// pathing costs one field per player move instead of a search per monster.
+// Entities don't block the field, they're dealt with when stepping.
+// The field has a border of Flow_wall cells around the map and walls are
+// Flow_wall too, so spreading doesn't need bounds or walkable checks.
+
+static const int Flow_step = 10;
+static const int Flow_unreachable = 0x7fffffff;
+static const int Flow_wall = -0x7fffffff - 1;
+
+// neighbour order, straight moves first so ties go to those
+static const int flow_dirs[8][2] = {
+    { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 }, { -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 }
+};
+
+template<int W, int H>
+struct FlowField {
+    static const int Stride = W + 2;
+    static const int Cells = (W + 2) * (H + 2);
+    int cost[Cells];
+    // walls and border as Flow_wall, the rest Flow_unreachable, what every
+    // compute starts from. Only rebuilt when the terrain changes.
+    int terrain[Cells];
+    // reused by every compute so nothing is allocated after the first
+    std::vector<int> seeds;
+    std::vector<int> queue;
+    // what the field was last computed for, see map_flow_update
+    int goal_x = -1, goal_y = -1;
+    bool dirty = true;
+
+    static int cell(int x, int y) {
+        return (x + 1) + (y + 1) * Stride;
+    }
+    int at(int x, int y) const {
+        return cost[cell(x, y)];
+    }
+
+    void set_terrain(const BitPlane<W, H> &walkable) {
+        std::fill(terrain, terrain + Stride, Flow_wall);
+        std::fill(terrain + Cells - Stride, terrain + Cells, Flow_wall);
+        for(int y = 0; y < H; y++) {
+            int *row = terrain + cell(0, y);
+            row[-1] = Flow_wall;
+            row[W] = Flow_wall;
+            const uint64_t *bits = walkable.words + y * BitPlane<W, H>::Row_words;
+            for(int x = 0; x < W; x++) {
+                // lowest int - 1 wraps to the highest, no branch
+                unsigned walk = (unsigned)(bits[x >> 6] >> (x & 63)) & 1;
+                row[x] = (int)(0x80000000u - walk);
+            }
+        }
+    }
 };
 
+// Spreads field.cost out from field.seeds (cells), which have to be sorted by
+// cost. All steps cost the same so the FIFO stays sorted too, always taking the
+// cheaper of the two fronts is Dijkstra without a heap. Stops at max_cost,
+// cells past that stay unreachable.
+template<int W, int H>
+void flow_spread(FlowField<W, H> &field, int max_cost = Flow_unreachable) {
+    const int S = FlowField<W, H>::Stride;
+    const int offsets[8] = { -S, S, -1, 1, -S - 1, -S + 1, S - 1, S + 1 };
+    int *cost = field.cost;
+    auto &seeds = field.seeds;
+    auto &queue = field.queue;
+    queue.clear();
+    queue.reserve(W * H);
+    size_t s = 0, q = 0;
+    while(s < seeds.size() || q < queue.size()) {
+        int c;
+        if(q == queue.size() || (s < seeds.size() && cost[seeds[s]] <= cost[queue[q]])) {
+            c = seeds[s++];
+        } else {
+            c = queue[q++];
+        }
+        int next_cost = cost[c] + Flow_step;
+        if(next_cost > max_cost) {
+            continue;
+        }
+        for(int d = 0; d < 8; d++) {
+            int n = c + offsets[d];
+            // walls are the lowest int, never more than next_cost
+            if(cost[n] > next_cost) {
+                cost[n] = next_cost;
+                queue.push_back(n);
+            }
+        }
+    }
+}
+
+// toward the nearest of several goals, cells from FlowField::cell
+template<int W, int H>
+void flow_to(FlowField<W, H> &field, const int *goals, int goal_count, int max_cost = Flow_unreachable) {
+    std::copy(field.terrain, field.terrain + FlowField<W, H>::Cells, field.cost);
+    field.seeds.assign(goals, goals + goal_count);
+    for(int i = 0; i < goal_count; i++) {
+        field.cost[goals[i]] = 0;
+    }
+    flow_spread(field, max_cost);
+}
+
+// Away from the goals of `toward`. Negating the costs alone walks monsters into
+// the nearest dead end, scaling by more than 1 and spreading again makes going
+// around the goal to get further away worth it.
+template<int W, int H>
+void flow_flee(FlowField<W, H> &field, const FlowField<W, H> &toward) {
+    field.seeds.clear();
+    for(int c = 0; c < FlowField<W, H>::Cells; c++) {
+        int t = toward.cost[c];
+        if(t == Flow_wall || t == Flow_unreachable) {
+            field.cost[c] = t;
+        } else {
+            field.cost[c] = -t * 6 / 5;
+            field.seeds.push_back(c);
+        }
+    }
+    std::sort(field.seeds.begin(), field.seeds.end(), [&field](int a, int b) {
+        return field.cost[a] < field.cost[b];
+    });
+    flow_spread(field);
+}
+
+// Cheapest neighbour of (x, y) that is cheaper than (x, y) and can_enter lets
+// in. false = nowhere better to go.
+template<int W, int H, typename F>
+bool flow_next_step(const FlowField<W, H> &field, int x, int y, int &step_x, int &step_y, F can_enter) {
+    int best = field.at(x, y);
+    bool found = false;
+    for(auto &d : flow_dirs) {
+        int nx = x + d[0], ny = y + d[1];
+        int c = field.at(nx, ny);
+        if(c != Flow_wall && c < best && can_enter(nx, ny)) {
+            best = c;
+            step_x = nx;
+            step_y = ny;
+            found = true;
+        }
+    }
+    return found;
+}
+
+typedef FlowField<Map_Width, Map_Height> MapFlow;
+MapFlow player_flow;
+// monsters only chase what they can see, paths longer than this around a wall
+// fall back to walking straight at it
+static const int Flow_chase_steps = 3 * fov_radius;
+
+// Recomputes only when the goal moved or the field was marked dirty (new
+// floor, terrain changed), the terrain only in the second case.
+void map_flow_update(MapFlow &flow, const GameMap &map, int x, int y) {
+    if(!flow.dirty && flow.goal_x == x && flow.goal_y == y) {
+        return;
+    }
+    if(flow.dirty) {
+        flow.set_terrain(map.walkable);
+    }
+    int goal = flow.cell(x, y);
+    flow_to(flow, &goal, 1, Flow_chase_steps * Flow_step);
+    flow.goal_x = x;
+    flow.goal_y = y;
+    flow.dirty = false;
+}
+
 struct Movement {
     int x, y;
 };
@@ -303,72 +1161,78 @@ struct RenderPriority {
     int ENTITY = 3;
 } render_priority;
 
-struct Fighter;
-struct Ai;
-struct Inventory;
-struct Item;
-struct Stairs;
-struct Level;
-struct Equippable;
-struct Equipment;
-
-struct EntityFat {
-    int x,y;
-    int gfx;
-    TCODColor color;
-    std::string name;
-    bool blocks = false;
-    int render_order = 0;
-    bool marked_for_deletion = false;
-
-    EntityFat(int x_, int y_, int gfx_, TCODColor color_, std::string name_, bool blocks_, int render_order_) : 
-        x(x_), y(y_), gfx(gfx_), color(color_), name(name_), blocks(blocks_), render_order(render_order_) {
-    }
-
-    // components
-    Fighter *fighter = NULL;
-    Ai *ai = NULL;
-    Inventory *inventory = NULL;
-    Item *item = NULL;
-    Stairs *stairs = NULL;
-    Level *level = NULL;
-    Equipment *equipment = NULL;
-    Equippable *equippable = NULL;
-};
-
-void move_towards(const GameMap &map, EntityFat *entity, int target_x, int target_y);
+void move_towards(const GameMap &map, Entity entity, int target_x, int target_y);
+bool step_towards(const GameMap &map, int x, int y, int target_x, int target_y, int &step_x, int &step_y);
+bool step_along(const GameMap &map, const MapFlow &flow, int x, int y, int target_x, int target_y, int &step_x, int &step_y);
+bool map_in_fov(const GameMap &map, int x, int y);
 
 struct ItemArgs {
     int amount = 0;
     float range = 0.0f;
-    EntityFat *target = NULL;
+    Entity target;
     int target_x = 0;
     int target_y = 0;
 };
 
-struct Context {
-    std::vector<EntityFat *> &entities;
-    GameMap &map;
-
-    Context(std::vector<EntityFat *> &entities, GameMap &map) :
-        entities(entities), map(map) {}
-};
+struct Context;
 
-enum Targeting {
+enum class Targeting {
     None,
     Position
 };
 
-struct Stairs {
-    int floor;
+// What using an item does, items keep the index into item_effects. Everything
+// that is the same for every item of a kind lives in the table.
+enum ItemEffectId {
+    EFFECT_NONE,
+    EFFECT_HEAL,
+    EFFECT_LIGHTNING,
+    EFFECT_FIREBALL,
+    EFFECT_CONFUSE,
+    EFFECT_COUNT
+};
 
-    Stairs(int floor) : floor(floor) {} 
+struct ItemEffect {
+    bool (*use)(Entity user, const ItemArgs &args, Context &context);
+    Targeting targeting;
+    const char *targeting_message;
 };
+extern const ItemEffect item_effects[EFFECT_COUNT];
 
+//// COMPONENTS
+// Plain data, stored in the dense arrays in World.
+// Anything on the map has a Position, items in an inventory don't.
+// Change positions through world.move so the occupancy grid follows.
+
+struct Position {
+    int x, y;
+};
+
+struct Renderable {
+    int gfx;
+    TCODColor color;
+    int render_order;
+};
+
+// points at blueprint data, a literal or floor_arena, never owned
+struct Name {
+    const char *name;
+};
+
+struct Stairs {
+    int floor;
+
+    Stairs(int floor) : floor(floor) {} 
+};
+
+// add a slot here and a name below, Equipment sizes itself off the count
 enum EquipmentSlot {
     MAIN_HAND,
-    OFF_HAND
+    OFF_HAND,
+    EQUIPMENT_SLOT_COUNT
 };
+const char *const Equipment_slot_names[EQUIPMENT_SLOT_COUNT] = { "main hand", "off hand" };
+
 struct Equippable {
     EquipmentSlot slot;
     int power_bonus;
@@ -380,80 +1244,71 @@ struct Equippable {
         {}
 };
 struct Equipment {
-    EntityFat *main_hand = NULL;
-    EntityFat *off_hand = NULL;
-
-    int max_hp_bonus() {
-        int bonus = 0;
-        bonus += (main_hand && main_hand->equippable) ? main_hand->equippable->max_hp_bonus : 0;
-        bonus += (off_hand && off_hand->equippable) ? off_hand->equippable->max_hp_bonus : 0;
-        return bonus;
-    }
+    Entity _owner;
+    Entity slots[EQUIPMENT_SLOT_COUNT];
 
-    int power_bonus() {
-        int bonus = 0;
-        bonus += (main_hand && main_hand->equippable) ? main_hand->equippable->power_bonus : 0;
-        bonus += (off_hand && off_hand->equippable) ? off_hand->equippable->power_bonus : 0;
-        return bonus;
-    }
+    Equipment(Entity owner) : _owner(owner) {}
 
-    int defense_bonus() {
-        int bonus = 0;
-        bonus += (main_hand && main_hand->equippable) ? main_hand->equippable->defense_bonus : 0;
-        bonus += (off_hand && off_hand->equippable) ? off_hand->equippable->defense_bonus : 0;
-        return bonus;
+    bool equipped(Entity item) const {
+        return slot_of(item) >= 0;
     }
-
-    void toggle_equipment(EntityFat *equippable_entity) {
-        auto slot = equippable_entity->equippable->slot;
-
-        if(slot == MAIN_HAND) {
-            if(main_hand == equippable_entity) {
-                events_queue({ EventType::EquipmentChange, equippable_entity, "", TCOD_amber, 0 });
-                main_hand = NULL;
-            } else {
-                if(main_hand) {
-                    events_queue({ EventType::EquipmentChange, main_hand, "", TCOD_amber, 0 });
-                }
-                main_hand = equippable_entity;
-                events_queue({ EventType::EquipmentChange, equippable_entity, "", TCOD_amber, 1 });
+    int slot_of(Entity item) const {
+        for(int i = 0; i < EQUIPMENT_SLOT_COUNT; i++) {
+            if(slots[i] == item) {
+                return i;
             }
-        } else if(slot == OFF_HAND) {
-            if(off_hand == equippable_entity) {
-                events_queue({ EventType::EquipmentChange, equippable_entity, "", TCOD_amber, 0 });
-                off_hand = NULL;
-            } else {
-                if(off_hand) {
-                    events_queue({ EventType::EquipmentChange, off_hand, "", TCOD_amber, 0 });
-                }
-                off_hand = equippable_entity;
-                events_queue({ EventType::EquipmentChange, equippable_entity, "", TCOD_amber, 1 });
-            }
-        } else {
-            engine_log(LogStatus::Warning, "Equipment slot is not implemented " + std::to_string(slot));
         }
+        return -1;
     }
+    void toggle_equipment(Entity equippable_entity);
+    void equip(Entity equippable_entity);
+    void unequip(int slot);
+};
+
+// Stats that modifiers can change. Fighter keeps the summed bonus per stat.
+enum Stat {
+    STAT_MAX_HP,
+    STAT_POWER,
+    STAT_DEFENSE,
+    STAT_COUNT
+};
+
+// One stat change, from an equipped item (source) or a buff/debuff (no source).
+// turns < 0 lasts until it's removed, otherwise counts down once per game turn.
+struct Modifier {
+    Entity source;
+    uint8_t stat;
+    int16_t amount;
+    int16_t turns;
+};
+
+// Modifier stack of a fighter, fixed size so it saves like any other component.
+// Only changes through modifier_add/modifier_remove_source/modifiers_tick, which
+// fold it into Fighter::bonus, so attacks never walk it.
+const int Modifier_capacity = 32;
+struct Modifiers {
+    int count = 0;
+    int timed = 0; // how many have turns >= 0, ticking skips stacks with none
+    Modifier list[Modifier_capacity];
 };
 
 struct Item {
-    int id;
-    std::string name;
-    std::function<bool(EntityFat* entity, const ItemArgs &args, Context &context)> on_use = NULL;
+    int id = -1; // item_data id, -1 = not from item_data
+    const char *name;
+    uint8_t effect = EFFECT_NONE;
     ItemArgs args;
-    Targeting targeting = Targeting::None;
-    std::string targeting_message = "";
 };
 
 struct Inventory {
-    EntityFat *_owner;
-    std::vector<EntityFat*> items;
+    Entity _owner;
+    std::vector<Entity> items;
     int capacity;
-    Inventory(EntityFat *owner, int capacity) : _owner(owner), capacity(capacity) {}
+    Inventory(Entity owner, int capacity) : _owner(owner), capacity(capacity) {}
 
     int _dirty_shit = 0;
 
-    bool add_item(EntityFat *item) {
-        if(items.size() >= capacity) {
+    bool add_item(Entity item) {
+        if(items.size() >= (size_t)capacity) {
             return false;
         } 
         items.push_back(item);
@@ -464,43 +1319,15 @@ struct Inventory {
         return use(items[index], context);
     }
 
-    bool use(EntityFat *item, Context &context) {
-        if(item->equippable) {
-            _owner->equipment->toggle_equipment(item);
-            return false;
-        }
-
-        if(!item->item->on_use) {    
-            std::string msg = "The " + item->item->name + " cannot be used.";
-            events_queue({ EventType::Message, NULL, msg, TCOD_yellow});
-            return false;
-        }
-
-        if(requires_target(item)) {
-            return false;
-        }
-
-        bool consumed = item->item->on_use(_owner, item->item->args, context);
-        remove(item);
-        delete item; // Shitty memory handling
-        return true;
-    }
+    bool use(Entity item, Context &context);
     
     bool requires_target(size_t index) {
         return requires_target(items[index]);
     }
 
-    bool requires_target(EntityFat *item) {    
-        if(item->item->targeting == Targeting::None) {
-            return false;
-        }
-        if(item->item->targeting != Targeting::None && !(item->item->args.target_x || item->item->args.target_y)) {
-            return true;
-        }
-        return false;
-    }
+    bool requires_target(Entity item);
 
-    void remove(EntityFat *item) {
+    void remove(Entity item) {
         int delete_count = 0;
         int index = 0;
         for(auto &i : items) {
@@ -512,6 +1339,7 @@ struct Inventory {
         }
         if(delete_count == 0) {
             engine_log(LogStatus::Error, "NO ITEM REMOVED WHEN PICKED UP! (Inventory::remove)");
+            return;
         }
         items.erase(items.begin() + index);
     }
@@ -523,52 +1351,17 @@ struct Fighter {
     int defense_max;
     int power_max;
     int xp;
-    EntityFat *_owner;
-    
-    Fighter(EntityFat* owner, int hp_, int defense_, int power_, int xp = 0) 
-        : hp(hp_), hp_max(hp_), defense_max(defense_), power_max(power_), _owner(owner), xp(xp) {}
-
-    int max_hp() {
-        int bonus = _owner && _owner->equipment ? _owner->equipment->max_hp_bonus() : 0;
-        return hp_max + bonus;
-    }
-
-    int power() {
-        int bonus = _owner && _owner->equipment ? _owner->equipment->power_bonus() : 0;
-        return power_max + bonus;
-    }
-
-    int defense() {
-        int bonus = _owner && _owner->equipment ? _owner->equipment->defense_bonus() : 0;
-        return defense_max + bonus;
-    }
+    Entity _owner;
+    int bonus[STAT_COUNT] = {}; // cached sum of the modifier stack
     
-    void take_damage(int amount) {
-        hp -= amount;
-
-        if(hp <= 0) {
-            events_queue({ EventType::EntityDead, _owner });
-            _owner->marked_for_deletion = true;
-        }
-    }
-
-    void attack(EntityFat *entity) {
-        int damage = power() - entity->fighter->defense();
+    Fighter(Entity owner, int hp_, int defense_, int power_, int xp = 0) 
+        : hp(hp_), hp_max(hp_), defense_max(defense_), power_max(power_), xp(xp), _owner(owner) {}
 
-        if(damage > 0) {
-            // VERY SHITTY STRING ALLOCATION
-            char buffer[255];
-            sprintf(buffer, "%s attacks %s for %d hit points", _owner->name.c_str(), entity->name.c_str(), damage);
-            events_queue({ EventType::Message, NULL, buffer, TCOD_amber });
-
-            entity->fighter->take_damage(damage);
-        } else {
-            // VERY SHITTY STRING ALLOCATION
-            char buffer[255];
-            sprintf(buffer, "%s attacks %s but deals no damage", _owner->name.c_str(), entity->name.c_str());
-            events_queue({ EventType::Message, NULL, buffer, TCOD_light_grey });
-        }
-    }
+    int max_hp() const { return hp_max + bonus[STAT_MAX_HP]; }
+    int power() const { return power_max + bonus[STAT_POWER]; }
+    int defense() const { return defense_max + bonus[STAT_DEFENSE]; }
+    void take_damage(int amount);
+    void attack(Entity entity);
 
     void heal(int amount) {
         hp += amount;
@@ -578,62 +1371,38 @@ struct Fighter {
     }
 };
 
-struct Ai {
-    virtual void take_turn(EntityFat *target, GameMap &map) = 0;
+// No more virtual take_turn, the ai is a tag for which behaviour to run
+// so it can live in a dense array like everything else.
+enum AiType {
+    BASIC_MONSTER,
+    CONFUSED_MONSTER
 };
 
-float distance_to(int x, int y, int target_x, int target_y) {
-    int dx = target_x - x;
-    int dy = target_y - y;
-    return sqrtf(dx*dx + dy*dy);
-}
-
-struct BasicMonster : Ai {
-    EntityFat *_owner;
-    void take_turn(EntityFat *target, GameMap &map) override {
-        if(map.tcod_fov_map->isInFov(_owner->x, _owner->y)) {
-            if(distance_to(_owner->x, _owner->y, target->x, target->y) >= 2.0f) {
-
-                // CAN REPLACE HITS WITH ASTAR MOVEMENT
-
-                move_towards(map, _owner, target->x, target->y);
-            } else if(target->fighter->hp > 0) {
-                _owner->fighter->attack(target);
-                //printf("Deal damage to %s.\n", target->name);
-            }
-
-        }
-    }
-
-    BasicMonster(EntityFat *owner) {
-        _owner = owner;
-    }
+// What an ai is going to do this turn, see enemy_turn
+enum AiIntentType {
+    AI_IDLE,
+    AI_MOVE,    // to (x, y)
+    AI_BLOCKED, // wants to move but nowhere to go
+    AI_ATTACK,
+    AI_ACT_NOW  // decided while acting (uses the rng)
 };
 
-struct ConfusedMonster : Ai {
-    EntityFat *_owner;
-    Ai *previous;
-    int turns_remaining;
-    void take_turn(EntityFat *target, GameMap &map) override {
-        if(turns_remaining > 0) {
-            turns_remaining--;
-
-            int rx = _owner->x + rand_int(0, 2) - 1;
-            int ry = _owner->y + rand_int(0, 2) - 1;
+struct AiIntent {
+    AiIntentType type = AI_IDLE;
+    int x = 0, y = 0;
+};
 
-            if(rx != _owner->x && ry != _owner->y) {
-                move_towards(map, _owner, rx, ry);
-            }
-        } else {
-            std::string msg = "The " + _owner->name + " is no longer confused!";
-            events_queue({ EventType::Message, NULL, msg, TCOD_red });
+struct Ai {
+    Entity _owner;
+    AiType type;
+    AiType previous = BASIC_MONSTER;
+    int turns_remaining = 0;
 
-            _owner->ai = previous;
-        }
-    }
+    Ai(Entity owner, AiType type) : _owner(owner), type(type) {}
 
-    ConfusedMonster(EntityFat *owner, Ai *previous, int turns) 
-        : _owner(owner), previous(previous), turns_remaining(turns) {}
+    bool chases(Entity target, const GameMap &map) const;
+    AiIntent decide(Entity target, const GameMap &map) const;
+    void act(const AiIntent &intent, Entity target, GameMap &map, Rng &rng);
 };
 
 struct Level {
@@ -663,1029 +1432,6743 @@ struct Level {
     }
 };
 
-bool cast_heal_entity(EntityFat *entity, const ItemArgs &args, Context &context) {
-    if(entity->fighter->hp == entity->fighter->hp_max) {
-        events_queue({ EventType::Message, NULL, "You are already at full health", TCOD_yellow });
-        return false;
-    } 
-    entity->fighter->heal(args.amount);
-    events_queue({ EventType::Message, NULL, "Your wounds start to feel better!", TCOD_green });
-    return true;
-}
+//// ARENA
+// Bump allocator for data that lives exactly as long as a floor (corpse names
+// for now). Blocks are kept around, so after the first floor nothing in here
+// touches the heap and reset() is the whole teardown.
+const size_t ARENA_BLOCK_SIZE = 16 * 1024;
+struct Arena {
+    std::vector<char *> blocks;
+    size_t block = 0;
+    size_t used = 0;
+
+    void *alloc(size_t size) {
+        size = (size + 7) & ~(size_t)7;
+        if(size > ARENA_BLOCK_SIZE) {
+            return NULL;
+        }
+        if(block < blocks.size() && used + size > ARENA_BLOCK_SIZE) {
+            block++;
+            used = 0;
+        }
+        if(block == blocks.size()) {
+            blocks.push_back(new char[ARENA_BLOCK_SIZE]);
+        }
+        void *p = blocks[block] + used;
+        used += size;
+        return p;
+    }
 
-bool cast_lightning_bolt(EntityFat *caster, const ItemArgs &args, Context &context) {
-    EntityFat *closest = NULL;
-    float closest_distance = 1000000.f;
-    for(auto &e : context.entities) {
-        if(e->fighter && e != caster && context.map.tcod_fov_map->isInFov(e->x, e->y)) {
-            float distance = distance_to(caster->x, caster->y, e->x, e->y);
-            if(distance < closest_distance) {
-                closest = e;
-                closest_distance = distance;
-            }
+    void reset() {
+        block = 0;
+        used = 0;
+    }
+
+    ~Arena() {
+        for(auto b : blocks) {
+            delete[] b;
         }
     }
+} floor_arena;
 
-    if(closest) {
-        closest->fighter->take_damage(args.amount);
-        std::string msg = "A lighting bolt strikes the " + closest->name + " with a loud thunder! \nThe damage is " + std::to_string(args.amount);
-        events_queue({ EventType::Message, NULL, msg, TCOD_amber });
-        return true;
-    } else {
-        events_queue({ EventType::Message, NULL, "No enemy is close enough to strike.", TCOD_red });
-        return false;
+const char *arena_printf(Arena &arena, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int length = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+    char *text = (char *)arena.alloc(length + 1);
+    if(!text) {
+        return "";
     }
+    va_start(ap, format);
+    vsnprintf(text, length + 1, format, ap);
+    va_end(ap);
+    return text;
 }
 
-bool cast_fireball(EntityFat *caster, const ItemArgs &args, Context &context) {
-    if(!context.map.tcod_fov_map->isInFov(args.target_x, args.target_y)) {
-        events_queue({ EventType::Message, NULL, "You cannot target a tile outside your field of view.", TCOD_yellow });
-        return false;
+//// OCCUPANCY
+// Per-tile index of what is standing where, kept in sync by World on every
+// place / move / remove / blocks change. Each tile has its blocker (if any) and
+// an intrusive list through `next` (indexed by entity index) of everything on it.
+const unsigned OCCUPANCY_NONE = 0xffffffff;
+
+// Tiles whose look may have changed since the map was last drawn. Occupancy
+// marks every tile something enters or leaves, fov marks the box it covered,
+// floor changes and menus mark everything. See game_render.
+struct DirtyTiles {
+    bool all = true;
+    bool flag[Map_Width * Map_Height] = {};
+    std::vector<int> list;
+
+    DirtyTiles() {
+        list.reserve(Map_Width * Map_Height);
+    }
+
+    void mark(int tile) {
+        if(!flag[tile]) {
+            flag[tile] = true;
+            list.push_back(tile);
+        }
     }
 
-    std::string msg = "The fireball explodes, burning everything within " + std::to_string(args.range) + " tiles!";
-    events_queue({ EventType::Message, NULL, msg, TCOD_orange });
+    void mark_all() {
+        all = true;
+    }
 
-    for(auto &e : context.entities) {
-        if(e->fighter && distance_to(e->x, e->y, args.target_x, args.target_y) <= args.range) {
-            msg = "The " + e->name + " gets burned for " + std::to_string(args.amount) + " hit points.";
-            events_queue({ EventType::Message, NULL, msg, TCOD_orange });
-            e->fighter->take_damage(args.amount);
+    void clear() {
+        for(int tile : list) {
+            flag[tile] = false;
+        }
+        list.clear();
+        all = false;
+    }
+} dirty_tiles;
+
+// Tiles whose entity stack changed (something spawned, died, moved, or got a
+// new look/render_order) since the renderer last picked their top entity.
+// A subset of dirty_tiles, fov changes don't land here.
+DirtyTiles restacked_tiles;
+
+// Tiles whose occupancy changed since the journal last wrote a turn, see JOURNAL
+DirtyTiles unsaved_tiles;
+
+// Entity indices the journal has to write out with the next turn, same idea
+// as DirtyTiles. World marks what goes through it (add, remove, move, tags),
+// game code marks what it changes in place with World::changed.
+struct DirtyEntities {
+    bool all = true;
+    std::vector<uint8_t> flag;
+    std::vector<unsigned> list;
+
+    void mark(unsigned idx) {
+        if(all) {
+            return;
+        }
+        if(idx >= flag.size()) {
+            flag.resize(idx + 1, 0);
+        }
+        if(!flag[idx]) {
+            flag[idx] = 1;
+            list.push_back(idx);
         }
     }
 
-    return true;
-}
+    void mark_all() {
+        all = true;
+    }
 
-bool cast_confuse(EntityFat *caster, const ItemArgs &args, Context &context) {
-    if(!context.map.tcod_fov_map->isInFov(args.target_x, args.target_y)) {
-        events_queue({ EventType::Message, NULL, "You cannot target a tile outside your field of view.", TCOD_yellow });
-        return false;
+    void clear() {
+        for(unsigned idx : list) {
+            flag[idx] = 0;
+        }
+        list.clear();
+        all = false;
     }
+} unsaved_entities;
 
-    for(auto &e : context.entities) {
-        if(e->ai && e->x == args.target_x &&  e->y == args.target_y) {
-            std::string msg = "The eyes of the " + e->name + " looks vacant as it starts to stumble around!";
-            events_queue({ EventType::Message, NULL, msg, TCOD_light_green });
-            e->ai = new ConfusedMonster(e, e->ai, 10);
-            return true;
+struct OccupancyGrid {
+    Entity blocker[Map_Width * Map_Height];
+    unsigned head[Map_Width * Map_Height];
+    std::vector<unsigned> next;
+    std::vector<Entity> handles;
+
+    OccupancyGrid() {
+        std::fill(head, head + Map_Width * Map_Height, OCCUPANCY_NONE);
+    }
+
+    static bool in_bounds(int x, int y) {
+        return x >= 0 && y >= 0 && x < Map_Width && y < Map_Height;
+    }
+
+    void link(Entity e, int x, int y, bool blocks) {
+        if(!in_bounds(x, y)) {
+            return;
+        }
+        unsigned idx = e.index();
+        if(idx >= next.size()) {
+            next.resize(idx + 1, OCCUPANCY_NONE);
+            handles.resize(idx + 1);
+        }
+        int tile = x + Map_Width * y;
+        dirty_tiles.mark(tile);
+        restacked_tiles.mark(tile);
+        unsaved_tiles.mark(tile);
+        unsaved_entities.mark(idx);
+        handles[idx] = e;
+        next[idx] = head[tile];
+        head[tile] = idx;
+        if(blocks) {
+            blocker[tile] = e;
         }
     }
 
-    std::string msg = "There is no targetable entity at that location.";
-    events_queue({ EventType::Message, NULL, msg, TCOD_yellow });
-    return false;
-}
+    void unlink(Entity e, int x, int y) {
+        if(!in_bounds(x, y)) {
+            return;
+        }
+        unsigned idx = e.index();
+        int tile = x + Map_Width * y;
+        dirty_tiles.mark(tile);
+        restacked_tiles.mark(tile);
+        unsaved_tiles.mark(tile);
+        unsaved_entities.mark(idx);
+        unsigned *link = &head[tile];
+        while(*link != OCCUPANCY_NONE) {
+            if(*link == idx) {
+                *link = next[idx];
+                break;
+            }
+            // the last of these ends up pointing past it
+            unsaved_entities.mark(*link);
+            link = &next[*link];
+        }
+        next[idx] = OCCUPANCY_NONE;
+        if(blocker[tile] == e) {
+            blocker[tile] = ENTITY_NONE;
+        }
+    }
 
-// UI
-const int Bar_width = 20;
-const int Panel_height = 7;
-const int Panel_y = SCREEN_HEIGHT - Panel_height;
-//
+    void clear() {
+        dirty_tiles.mark_all();
+        restacked_tiles.mark_all();
+        unsaved_tiles.mark_all();
+        unsaved_entities.mark_all();
+        std::fill(head, head + Map_Width * Map_Height, OCCUPANCY_NONE);
+        std::fill(blocker, blocker + Map_Width * Map_Height, ENTITY_NONE);
+        next.clear();
+        handles.clear();
+    }
+};
 
-std::vector<EntityFat*> _entities;
+struct World {
+    EntityManager manager;
+    std::vector<ComponentMask> masks;
+    OccupancyGrid occupancy;
+
+    ComponentArray<Position> positions = ComponentArray<Position>(COMPONENT_POSITION);
+    ComponentArray<Renderable> renderables = ComponentArray<Renderable>(COMPONENT_RENDERABLE);
+    ComponentArray<Name> names = ComponentArray<Name>(COMPONENT_NAME);
+    ComponentArray<Fighter> fighters = ComponentArray<Fighter>(COMPONENT_FIGHTER);
+    ComponentArray<Ai> ais = ComponentArray<Ai>(COMPONENT_AI);
+    ComponentArray<Inventory> inventories = ComponentArray<Inventory>(COMPONENT_INVENTORY);
+    ComponentArray<Item> items = ComponentArray<Item>(COMPONENT_ITEM);
+    ComponentArray<Stairs> stairs = ComponentArray<Stairs>(COMPONENT_STAIRS);
+    ComponentArray<Level> levels = ComponentArray<Level>(COMPONENT_LEVEL);
+    ComponentArray<Equipment> equipments = ComponentArray<Equipment>(COMPONENT_EQUIPMENT);
+    ComponentArray<Equippable> equippables = ComponentArray<Equippable>(COMPONENT_EQUIPPABLE);
+    ComponentArray<Modifiers> modifiers = ComponentArray<Modifiers>(COMPONENT_MODIFIERS);
+
+    // Room for `live` entities and `indices` entity indices up front, so the
+    // first floors don't grow every array one push_back at a time
+    void reserve(size_t live, size_t indices) {
+        manager._generation.reserve(indices);
+        manager._free_indices.reserve(indices);
+        masks.reserve(indices);
+        occupancy.next.reserve(indices);
+        occupancy.handles.reserve(indices);
+        positions.reserve(live);
+        renderables.reserve(live);
+        names.reserve(live);
+        fighters.reserve(live);
+        ais.reserve(live);
+        items.reserve(live);
+        equippables.reserve(live);
+    }
 
+    Entity create() {
+        size_t free_head = manager._free_head;
+        Entity e = manager.create();
+        // the free list got compacted, every entry moved
+        if(manager._free_head < free_head) {
+            unsaved_entities.mark_all();
+        }
+        if(e.index() >= masks.size()) {
+            masks.resize(e.index() + 1, 0);
+        }
+        masks[e.index()] = 0;
+        unsaved_entities.mark(e.index());
+        return e;
+    }
 
-int map_index(int x, int y) {
-    return x + Map_Width * y;
-}
+    bool alive(Entity e) const {
+        return manager.alive(e);
+    }
 
-bool map_blocked(const GameMap &map, int x, int y) {
-    if(map.tiles[map_index(x, y)].blocked) {
-        return true;
+    bool has(Entity e, ComponentMask mask) const {
+        return alive(e) && (masks[e.index()] & mask) == mask;
     }
-    return false;
-}
 
-void map_make_room(GameMap &map, const Rect &room) {
-    for(int x = room.x + 1; x < room.x2; x++) {
-        for(int y = room.y + 1; y < room.y2; y++) {
-            map.tiles[map_index(x, y)].blocked = false;
-            map.tiles[map_index(x, y)].block_sight = false;   
-            map.tcod_fov_map->setProperties(x, y, true, true);
-        }    
+    // components changed in place, the journal writes the entity out with the next turn
+    void changed(Entity e) {
+        if(e.valid()) {
+            unsaved_entities.mark(e.index());
+        }
     }
-}
 
-void map_make_h_tunnel(GameMap &map, int x1, int x2, int y) {
-    for(int x = std::min(x1, x2); x < std::max(x1, x2) + 1; x++) {
-        map.tiles[map_index(x, y)].blocked = false;
-        map.tiles[map_index(x, y)].block_sight = false;
-        map.tcod_fov_map->setProperties(x, y, true, true);
+    template<typename T>
+    T &add(ComponentArray<T> &array, Entity e, const T &component) {
+        masks[e.index()] |= array.bit;
+        unsaved_entities.mark(e.index());
+        return array.add(e, component);
     }
-//     def create_h_tunnel(self, x1, x2, y):
-// +       for x in range(min(x1, x2), max(x1, x2) + 1):
-// +           self.tiles[x][y].blocked = False
-// +           self.tiles[x][y].block_sight = False
-}
-void map_make_v_tunnel(GameMap &map, int y1, int y2, int x) {
-    for(int y = std::min(y1, y2); y < std::max(y1, y2) + 1; y++) {
-        map.tiles[map_index(x, y)].blocked = false;
-        map.tiles[map_index(x, y)].block_sight = false;
-        map.tcod_fov_map->setProperties(x, y, true, true);
+
+    // the last component moves into the slot, so that one changed too
+    template<typename T>
+    void drop(ComponentArray<T> &array, Entity e) {
+        if(array.get(e)) {
+            unsaved_entities.mark(e.index());
+            unsaved_entities.mark(array.owners.back().index());
+            array.remove(e);
+        }
     }
-// +   def create_v_tunnel(self, y1, y2, x):
-// +       for y in range(min(y1, y2), max(y1, y2) + 1):
-// +           self.tiles[x][y].blocked = False
-// +           self.tiles[x][y].block_sight = False
-}
 
-void map_generate(GameMap &map, int max_rooms, int room_min_size, int room_max_size, int map_width, int map_height) {
-    for(int i = 0; i < max_rooms; i++) {
-        // random width and height
-        int w = rand_int(room_min_size, room_max_size);
-        int h = rand_int(room_min_size, room_max_size);
-        // random position without going out of the boundaries of the map
-        int x = rand_int(0, map_width - w - 1);
-        int y = rand_int(0, map_height - h - 1);
+    template<typename T>
+    void remove(ComponentArray<T> &array, Entity e) {
+        masks[e.index()] &= ~array.bit;
+        drop(array, e);
+    }
 
-        Rect new_room = rect_make(x, y, w, h);
+    // positions go through these so the occupancy grid is always up to date
 
-        // See if any room intersects
-        bool intersects = false;
-        for(auto &r : map.rooms) {
-            if(rect_intersects(r, new_room)) {
-                intersects = true;
-                break;
-            }
+    Position &add(ComponentArray<Position> &array, Entity e, const Position &position) {
+        if(auto old = array.get(e)) {
+            occupancy.unlink(e, old->x, old->y);
         }
+        masks[e.index()] |= array.bit;
+        unsaved_entities.mark(e.index());
+        occupancy.link(e, position.x, position.y, (masks[e.index()] & TAG_BLOCKS) != 0);
+        return array.add(e, position);
+    }
 
-        if(intersects) {
-            continue;
+    void remove(ComponentArray<Position> &array, Entity e) {
+        if(auto old = array.get(e)) {
+            occupancy.unlink(e, old->x, old->y);
         }
+        masks[e.index()] &= ~array.bit;
+        drop(array, e);
+    }
 
-        // "paint" it to the map's tiles
-        map_make_room(map, new_room);
-        int new_x, new_y;
-        rect_center(new_room, new_x, new_y);
+    void move(Entity e, int x, int y) {
+        unsaved_entities.mark(e.index());
+        auto position = positions.get(e);
+        occupancy.unlink(e, position->x, position->y);
+        position->x = x;
+        position->y = y;
+        occupancy.link(e, x, y, (masks[e.index()] & TAG_BLOCKS) != 0);
+    }
 
-        if(map.num_rooms > 0) {
-            int prev_x, prev_y;
-            rect_center(map.rooms[map.num_rooms - 1], prev_x, prev_y);
-            if(rand_int(0, 1) == 1) {
-                map_make_h_tunnel(map, prev_x, new_x, prev_y);
-                map_make_v_tunnel(map, prev_y, new_y, new_x);
-            } else {
-                map_make_v_tunnel(map, prev_y, new_y, new_x);
-                map_make_h_tunnel(map, prev_x, new_x, prev_y);
+    void set_tag(Entity e, ComponentMask tag, bool value) {
+        unsaved_entities.mark(e.index());
+        if(value) {
+            masks[e.index()] |= tag;
+        } else {
+            masks[e.index()] &= ~tag;
+        }
+        if(tag == TAG_BLOCKS) {
+            if(auto p = positions.get(e)) {
+                occupancy.unlink(e, p->x, p->y);
+                occupancy.link(e, p->x, p->y, value);
             }
         }
+    }
 
-        map.rooms.push_back(new_room);
-        map.num_rooms++;
+    // renderable changed in place, nothing moved but the tile looks different
+    void touch(Entity e) {
+        changed(e);
+        auto p = positions.get(e);
+        if(p && OccupancyGrid::in_bounds(p->x, p->y)) {
+            dirty_tiles.mark(p->x + Map_Width * p->y);
+            restacked_tiles.mark(p->x + Map_Width * p->y);
+        }
     }
-}
 
-struct MonsterBlueprint {
-    std::vector<WeightByLevel> weights;
-    std::string name;
-    char visual;
-    TCODColor color;
-    int hp;
-    int defense;
-    int power;
-    int xp;
-};
-std::vector<MonsterBlueprint> monster_data = {  
-    { 
-        { { 80, 1 } },
-        "Orc", 'o', TCOD_desaturated_green, 10, 0, 4, 35 
-    },
-    { 
-        { { 15, 3 }, { 30, 5 }, { 60, 7 } },
-        "Troll", 'T', TCOD_darker_green, 30, 2, 8, 100 
+    Entity blocker_at(int x, int y) const {
+        if(!OccupancyGrid::in_bounds(x, y)) {
+            return ENTITY_NONE;
+        }
+        return occupancy.blocker[x + Map_Width * y];
     }
-};
-void map_add_monsters(GameMap &map) {
-    for(const Rect &room : map.rooms) {
-        std::vector<WeightByLevel> weights = { { 2, 1 }, { 3, 4 }, { 5, 6 } };
-        int number_of_monsters = from_dungeon_level(weights, map.level);
-        // int number_of_monsters = rand_int(0, max_monsters_per_room);
-        for(int i = 0; i < number_of_monsters; i++) {
-            int x = rand_int(room.x + 1, room.x2 - 1); 
-            int y = rand_int(room.y + 1, room.y2 - 1);
-
-            bool occupied = false;
-            for(int ei = 0; ei < _entities.size(); ei++) {
-                EntityFat *e = _entities[ei];
-                if(e->x == x && e->y == y) {
-                    occupied = true;
-                    break;
-                }
-            }
-            if(occupied) {
-                continue;
-            }
 
-            std::vector<int> chances;
-            chances.reserve(monster_data.size());
-            for(auto md : monster_data) {
-                int chance = from_dungeon_level(md.weights, map.level);
-                if(chance > 0)
-                    chances.push_back(chance);
+    // for(Entity e = world.first_on_tile(x, y); e.valid(); e = world.next_on_tile(e))
+    Entity first_on_tile(int x, int y) const {
+        if(!OccupancyGrid::in_bounds(x, y)) {
+            return ENTITY_NONE;
+        }
+        unsigned idx = occupancy.head[x + Map_Width * y];
+        return idx == OCCUPANCY_NONE ? ENTITY_NONE : occupancy.handles[idx];
+    }
+
+    Entity next_on_tile(Entity e) const {
+        unsigned idx = occupancy.next[e.index()];
+        return idx == OCCUPANCY_NONE ? ENTITY_NONE : occupancy.handles[idx];
+    }
+
+    void destroy(Entity e) {
+        if(!alive(e)) {
+            return;
+        }
+        remove(positions, e);
+        drop(renderables, e);
+        drop(names, e);
+        drop(fighters, e);
+        drop(ais, e);
+        drop(inventories, e);
+        drop(items, e);
+        drop(stairs, e);
+        drop(levels, e);
+        drop(equipments, e);
+        drop(equippables, e);
+        drop(modifiers, e);
+        masks[e.index()] = 0;
+        unsaved_entities.mark(e.index());
+        manager.destroy(e);
+    }
+
+    // Floor teardown, everything with a position except `keep` goes. Kills the
+    // entities first, then each array drops its dead in one pass and the grid is
+    // wiped, instead of a swap-and-pop and unlink per entity.
+    void destroy_floor(Entity keep) {
+        for(auto e : positions.owners) {
+            if(e != keep) {
+                masks[e.index()] = 0;
+                manager.destroy(e);
             }
-            auto blueprint_index = rand_weighted_index(chances.data(), chances.size());
-            auto &m = monster_data[blueprint_index];
-            EntityFat *e;
-            e = new EntityFat(x, y, m.visual, m.color, m.name, true, render_priority.ENTITY );
-            e->fighter = new Fighter(e, m.hp, m.defense, m.power, m.xp);
-            e->ai = new BasicMonster(e);
-            _entities.push_back(e);            
+        }
+        positions.remove_dead(manager);
+        renderables.remove_dead(manager);
+        names.remove_dead(manager);
+        fighters.remove_dead(manager);
+        ais.remove_dead(manager);
+        inventories.remove_dead(manager);
+        items.remove_dead(manager);
+        stairs.remove_dead(manager);
+        levels.remove_dead(manager);
+        equipments.remove_dead(manager);
+        equippables.remove_dead(manager);
+        modifiers.remove_dead(manager);
+
+        occupancy.clear();
+        if(auto p = positions.get(keep)) {
+            occupancy.link(keep, p->x, p->y, (masks[keep.index()] & TAG_BLOCKS) != 0);
         }
     }
+} world;
+
+Entity entity_create(int gfx, TCODColor color, const char *name, bool blocks, int render_order) {
+    Entity e = world.create();
+    world.add(world.renderables, e, { gfx, color, render_order });
+    world.add(world.names, e, { name });
+    world.set_tag(e, TAG_BLOCKS, blocks);
+    return e;
 }
 
+Entity entity_spawn(int x, int y, int gfx, TCODColor color, const char *name, bool blocks, int render_order) {
+    Entity e = entity_create(gfx, color, name, blocks, render_order);
+    world.add(world.positions, e, Position { x, y });
+    return e;
+}
 
-struct ItemBlueprint {
-    std::vector<WeightByLevel> weights;
-    int id;
-    std::string name;
-    char visual;
-    TCODColor color;
+const char *entity_name(Entity e) {
+    auto name = world.names.get(e);
+    return name ? name->name : "";
+}
+
+struct Context {
+    World &world;
+    GameMap &map;
+
+    Context(World &world, GameMap &map) :
+        world(world), map(map) {}
 };
-std::vector<ItemBlueprint> item_data = {  
-    { 
-        { { 35, 1 } },
-        0, "Health Potion", '!', TCOD_violet
-    },
-    { 
-        { { 25, 4 } },
-        1, "Fireball Scroll", '#', TCOD_red
-    },
-    { 
-        { { 25, 6 } },
-        2, "Confusion Scroll", '#', TCOD_light_pink
-    },
-    { 
-        { { 10, 2 } },
-        3, "Lightning Scroll", '#', TCOD_violet
-    },
-    { 
-        { { 5, 4 } },
-        4, "Sword", '/', TCOD_sky
-    },
-    { 
-        { { 15, 8 } },
-        5, "Shield", '[', TCOD_darker_orange
+
+// Fighter::bonus is only ever rebuilt here, from the whole stack
+void modifiers_fold(Entity e) {
+    world.changed(e);
+    auto fighter = world.fighters.get(e);
+    if(!fighter) {
+        return;
     }
-};
-void map_add_items(GameMap &map) {
-    for(const Rect &room : map.rooms) {
-        std::vector<WeightByLevel> weights = { {1, 1}, {2, 4} };
-        int number_of_items = from_dungeon_level(weights, map.level);
-        // int number_of_items = rand_int(0, max_items_per_room);
-        for(int i = 0; i < number_of_items; i++) {
-            int x = rand_int(room.x + 1, room.x2 - 1); 
-            int y = rand_int(room.y + 1, room.y2 - 1);
-
-            bool occupied = false;
-            for(int ei = 0; ei < _entities.size(); ei++) {
-                EntityFat *e = _entities[ei];
-                if(e->x == x && e->y == y) {
-                    occupied = true;
-                    break;
-                }
-            }
-            if(occupied) {
-                continue;
-            }
+    std::fill(fighter->bonus, fighter->bonus + STAT_COUNT, 0);
+    if(auto modifiers = world.modifiers.get(e)) {
+        for(int i = 0; i < modifiers->count; i++) {
+            fighter->bonus[modifiers->list[i].stat] += modifiers->list[i].amount;
+        }
+    }
+}
 
-            // We probably want some other way of generating the item etc
-            // so this will change in the future anyway
+bool modifier_add(Entity e, const Modifier &modifier) {
+    auto modifiers = world.modifiers.get(e);
+    if(!modifiers) {
+        modifiers = &world.add(world.modifiers, e, Modifiers());
+    }
+    if(modifiers->count == Modifier_capacity) {
+        engine_log(LogStatus::Warning, "Modifier stack is full");
+        return false;
+    }
+    modifiers->list[modifiers->count++] = modifier;
+    if(modifier.turns >= 0) {
+        modifiers->timed++;
+    }
+    modifiers_fold(e);
+    return true;
+}
 
-            // Also perhaps split items into different categories
-            // so we can select a random category or a set number from each category
-            std::vector<int> chances;
-            chances.reserve(item_data.size());
-            for(auto id : item_data) {
-                int chance = from_dungeon_level(id.weights, map.level);
-                if(chance > 0) {
-                    chances.push_back(chance);
-                }
-            }
-            auto blueprint_index = rand_weighted_index(chances.data(), chances.size());
-            auto &item = item_data[blueprint_index];
-            //int index = rand_weighted_index(item_weights.data(), item_weights.size());
-            EntityFat *e;
-            e = new EntityFat(x, y, item.visual, item.color, item.name, false, render_priority.ITEM );
-            e->item = new Item();
-            e->item->name = item.name;
-            if(item.id == 0) {
-                e->item->args = { 40 };
-                e->item->on_use = cast_heal_entity;
-            } else if(item.id == 1) {
-                e->item->args = { 25, 3 };
-                e->item->on_use = cast_fireball;
-                e->item->targeting = Targeting::Position;
-                e->item->targeting_message = "Left-click a target tile for the fireball, or right click to cancel.";
-            } else if(item.id == 2) {
-                e->item->on_use = cast_confuse;
-                e->item->targeting = Targeting::Position;
-                e->item->targeting_message = "Left-click an enemy to confuse it, or right click to cancel.";
-            } else if(item.id == 3) {
-                e->item->args = { 40, 5 };
-                e->item->on_use = cast_lightning_bolt;
-            } else if(item.id == 4) {
-                e->equippable = new Equippable(MAIN_HAND, 3, 0, 0);
-            } else if(item.id == 5) {
-                e->equippable = new Equippable(OFF_HAND, 0, 1, 0);
-            } else {
-                delete e->item;
-                delete e;
-                std::string message = "No item with id; " + std::to_string(item.id);
-                engine_log(LogStatus::Warning, message);
-                continue;
+void modifier_remove_at(Modifiers &modifiers, int i) {
+    if(modifiers.list[i].turns >= 0) {
+        modifiers.timed--;
+    }
+    modifiers.list[i] = modifiers.list[--modifiers.count];
+}
+
+void modifier_remove_source(Entity e, Entity source) {
+    auto modifiers = world.modifiers.get(e);
+    if(!modifiers) {
+        return;
+    }
+    for(int i = modifiers->count - 1; i >= 0; i--) {
+        if(modifiers->list[i].source == source) {
+            modifier_remove_at(*modifiers, i);
+        }
+    }
+    modifiers_fold(e);
+}
+
+// once per game turn, counts down buffs/debuffs and drops the ones that ran out
+void modifiers_tick() {
+    for(size_t slot = 0; slot < world.modifiers.dense.size(); slot++) {
+        auto &modifiers = world.modifiers.dense[slot];
+        if(modifiers.timed == 0) {
+            continue;
+        }
+        world.changed(world.modifiers.owners[slot]);
+        bool expired = false;
+        for(int i = modifiers.count - 1; i >= 0; i--) {
+            auto &modifier = modifiers.list[i];
+            if(modifier.turns >= 0 && --modifier.turns <= 0) {
+                modifier_remove_at(modifiers, i);
+                expired = true;
             }
-            _entities.push_back(e);
+        }
+        if(expired) {
+            modifiers_fold(world.modifiers.owners[slot]);
         }
     }
 }
 
-void map_add_stairs(GameMap &map) {
-    auto &last_room = map.rooms[map.num_rooms - 1];
-    // auto &last_room = map.rooms[0];
-    int center_x, center_y;
-    rect_center(last_room, center_x, center_y);
-    EntityFat *e;
-    e = new EntityFat(center_x, center_y, '>', TCOD_white, "Stairs", false, render_priority.STAIRS );
-    e->stairs = new Stairs(map.level + 1);
-    _entities.push_back(e);
+void Equipment::toggle_equipment(Entity equippable_entity) {
+    int slot = world.equippables.get(equippable_entity)->slot;
+    if(slot < 0 || slot >= EQUIPMENT_SLOT_COUNT) {
+        engine_log(LogStatus::Warning, "Equipment slot is not implemented " + std::to_string(slot));
+        return;
+    }
+
+    if(slots[slot] == equippable_entity) {
+        unequip(slot);
+    } else {
+        if(slots[slot].valid()) {
+            unequip(slot);
+        }
+        equip(equippable_entity);
+    }
 }
 
-bool entity_blocking_at(int x, int y, EntityFat **found_entity) {
-    for(int i = 0; i < _entities.size(); i++) {
-        auto entity = _entities[i];
-        if(x == entity->x && y == entity->y && entity->blocks) {
-            *found_entity = _entities[i];
-            return true;
+void Equipment::equip(Entity equippable_entity) {
+    auto equippable = world.equippables.get(equippable_entity);
+    slots[equippable->slot] = equippable_entity;
+    events_queue(EventType::EquipmentChange, equippable_entity, ENTITY_NONE, 1);
+
+    const int amounts[STAT_COUNT] = { equippable->max_hp_bonus, equippable->power_bonus, equippable->defense_bonus };
+    for(int stat = 0; stat < STAT_COUNT; stat++) {
+        if(amounts[stat] != 0) {
+            modifier_add(_owner, Modifier { equippable_entity, (uint8_t)stat, (int16_t)amounts[stat], -1 });
         }
     }
-    return false;
 }
 
-bool can_walk(const GameMap &map, int x, int y) {
-    EntityFat *target;
-    return !map_blocked(map, x, y) && !entity_blocking_at(x, y, &target);
+void Equipment::unequip(int slot) {
+    events_queue(EventType::EquipmentChange, slots[slot], ENTITY_NONE, 0);
+    modifier_remove_source(_owner, slots[slot]);
+    slots[slot] = ENTITY_NONE;
 }
 
-void move_towards(const GameMap &map, EntityFat *entity, int target_x, int target_y) {
-    int dx, dy;
-    dx = target_x - entity->x;
-    dy = target_y - entity->y;
-    float distance = sqrtf(dx*dx+dy*dy);
-    
-    dx = (int)(round(dx/distance));
-    dy = (int)(round(dy/distance));
+bool Inventory::use(Entity item_entity, Context &context) {
+    if(world.equippables.get(item_entity)) {
+        world.equipments.get(_owner)->toggle_equipment(item_entity);
+        return false;
+    }
+
+    auto item = world.items.get(item_entity);
+    if(item->effect == EFFECT_NONE) {    
+        events_message(MSG_ITEM_CANNOT_BE_USED, item_entity);
+        return false;
+    }
 
-    if(can_walk(map, entity->x + dx, entity->y + dy)) {
-        entity->x = entity->x + dx;
-        entity->y = entity->y + dy;
-    } else if(can_walk(map, entity->x + dx, entity->y)) {
-        entity->x = entity->x + dx;
-    } else if(can_walk(map, entity->x, entity->y + dy)) {
-        entity->y = entity->y + dy;
+    if(requires_target(item_entity)) {
+        return false;
     }
+
+    item_effects[item->effect].use(_owner, item->args, context);
+    remove(item_entity);
+    world.destroy(item_entity);
+    return true;
 }
 
-bool entity_render_sort(const EntityFat *first, const EntityFat *second) {
-    return first->render_order < second->render_order;
+bool Inventory::requires_target(Entity item_entity) {
+    auto item = world.items.get(item_entity);
+    Targeting targeting = item_effects[item->effect].targeting;
+    if(targeting == Targeting::None) {
+        return false;
+    }
+    if(targeting != Targeting::None && !(item->args.target_x || item->args.target_y)) {
+        return true;
+    }
+    return false;
 }
 
-void gui_render_bar(TCODConsole *panel, int x, int y, int total_width, std::string name, 
-                    int value, int maximum, TCOD_color_t bar_color, TCOD_color_t back_color) {
-    int bar_width = int(float(value) / maximum * total_width);
+void Fighter::take_damage(int amount) {
+    hp -= amount;
 
-    panel->setDefaultBackground(back_color);
-    panel->rect(x, y, total_width, 1, false, TCOD_BKGND_SCREEN);
+    if(hp <= 0) {
+        events_queue(EventType::EntityDead, _owner);
+        world.set_tag(_owner, TAG_MARKED_FOR_DELETION, true);
+    }
+}
 
-    panel->setDefaultBackground(bar_color);
-    if(bar_width > 0) {
-        panel->rect(x, y, bar_width, 1, false, TCOD_BKGND_SCREEN);
+void Fighter::attack(Entity entity) {
+    auto target = world.fighters.get(entity);
+    int damage = power() - target->defense();
+
+    events_queue(EventType::Attack, _owner, entity, std::max(damage, 0));
+    if(damage > 0) {
+        target->take_damage(damage);
     }
+}
 
-    panel->setDefaultForeground(TCOD_white);
-    panel->printEx(x + total_width / 2, y, TCOD_BKGND_NONE, TCOD_CENTER, "%s: %d/%d", name.c_str(), value, maximum);
+float distance_to(int x, int y, int target_x, int target_y) {
+    int dx = target_x - x;
+    int dy = target_y - y;
+    return sqrtf(dx*dx + dy*dy);
 }
 
-struct LogEntry {
-    char *text;
-    TCODColor color;
-    LogEntry(const char *text_, const TCODColor &col_) : 
-        text(strdup(text_)), color(col_) {    
+// wants player_flow this turn
+bool Ai::chases(Entity target, const GameMap &map) const {
+    auto position = world.positions.get(_owner);
+    auto target_position = world.positions.get(target);
+    return type == BASIC_MONSTER && map_in_fov(map, position->x, position->y) &&
+        distance_to(position->x, position->y, target_position->x, target_position->y) >= 2.0f;
+}
+
+// Read only, safe to run for many ais at once. player_flow has to be up to date
+// for the ais that chase.
+AiIntent Ai::decide(Entity target, const GameMap &map) const {
+    AiIntent intent;
+    auto position = world.positions.get(_owner);
+    if(type == BASIC_MONSTER) {
+        if(map_in_fov(map, position->x, position->y)) {
+            auto target_position = world.positions.get(target);
+            if(distance_to(position->x, position->y, target_position->x, target_position->y) >= 2.0f) {
+                bool moves = step_along(map, player_flow, position->x, position->y, target_position->x, target_position->y, intent.x, intent.y);
+                intent.type = moves ? AI_MOVE : AI_BLOCKED;
+            } else if(world.fighters.get(target)->hp > 0) {
+                intent.type = AI_ATTACK;
+            }
+        }
+    } else if(type == CONFUSED_MONSTER) {
+        intent.type = AI_ACT_NOW;
     }
-    ~LogEntry() {
-        free(text);
-    } 
+    return intent;
+}
+
+void Ai::act(const AiIntent &intent, Entity target, GameMap &map, Rng &rng) {
+    auto position = world.positions.get(_owner);
+    if(intent.type == AI_MOVE) {
+        world.move(_owner, intent.x, intent.y);
+    } else if(intent.type == AI_ATTACK) {
+        world.fighters.get(_owner)->attack(target);
+    } else if(intent.type == AI_ACT_NOW && type == CONFUSED_MONSTER) {
+        if(turns_remaining > 0) {
+            turns_remaining--;
+            world.changed(_owner);
+
+            int rx = position->x + rand_int(rng, 0, 2) - 1;
+            int ry = position->y + rand_int(rng, 0, 2) - 1;
+
+            if(rx != position->x && ry != position->y) {
+                move_towards(map, _owner, rx, ry);
+            }
+        } else {
+            events_message(MSG_NO_LONGER_CONFUSED, _owner);
+
+            type = previous;
+        }
+    }
+}
+
+//// AREA OF EFFECT
+// Spell areas as map cells, and whoever stands on them. Offsets come from one
+// disc of Aoe_max_radius sorted by distance, the stencil of radius r is its
+// first disc_count[r * r] entries, so a query only visits its own area and
+// finds fighters through the occupancy grid. Nothing here looks at how many
+// entities the floor has.
+//   AOE_CIRCLE - disc around the target cell
+//   AOE_BURST  - disc around the caster, caster's cell left out
+//   AOE_CONE   - from the caster toward the target, cone_degrees wide
+//   AOE_LINE   - Bresenham from the caster through the target
+// contained areas only get cells a flood from the center (the caster for
+// cones) reaches through transparent cells inside the shape, so walls stop
+// them. A contained line stops at the first opaque cell.
+
+enum AoeShape {
+    AOE_CIRCLE,
+    AOE_BURST,
+    AOE_CONE,
+    AOE_LINE
 };
-std::vector<LogEntry*> gui_log;
-static const int Log_x = Bar_width + 2;
-static const int Log_height = Panel_height - 1;
-void gui_log_message(const TCODColor &col, const char *text, ...) {
-    va_list ap;
-    char buf[128];
-    va_start(ap, text);
-    vsprintf(buf, text, ap);
-    va_end(ap);
 
-    char *lineBegin = buf;
-    char *lineEnd;
+struct AoeQuery {
+    AoeShape shape = AOE_CIRCLE;
+    int x = 0, y = 0; // caster
+    int target_x = 0, target_y = 0;
+    float radius = 0.0f;
+    int cone_degrees = 90;
+    bool contained = true;
+};
+
+static const int Aoe_max_radius = 2 * fov_radius;
+static const int Aoe_side = 2 * Aoe_max_radius + 1;
+
+struct AoeOffset {
+    int8_t dx, dy;
+    uint16_t d2;
+};
+
+struct AoeStencil {
+    std::vector<AoeOffset> disc;
+    // offsets with d2 <= i
+    int disc_count[Aoe_max_radius * Aoe_max_radius + 1];
+};
 
-    do {
-        // make room for the new message
-        if ( gui_log.size() == Log_height ) {
-            LogEntry *toRemove = gui_log.at(0);
-            gui_log.erase(gui_log.begin());
-            delete toRemove;
+AoeStencil aoe_stencil_build() {
+    AoeStencil stencil;
+    const int r2 = Aoe_max_radius * Aoe_max_radius;
+    for(int dy = -Aoe_max_radius; dy <= Aoe_max_radius; dy++) {
+        for(int dx = -Aoe_max_radius; dx <= Aoe_max_radius; dx++) {
+            if(dx * dx + dy * dy <= r2) {
+                stencil.disc.push_back({ (int8_t)dx, (int8_t)dy, (uint16_t)(dx * dx + dy * dy) });
+            }
         }
-        // detect end of the line
-        lineEnd=strchr(lineBegin,'\n');
-        if ( lineEnd ) {
-            *lineEnd='\0';
+    }
+    // same distance goes in row order, so picks don't depend on the sort
+    std::sort(stencil.disc.begin(), stencil.disc.end(), [](const AoeOffset &a, const AoeOffset &b) {
+        if(a.d2 != b.d2) {
+            return a.d2 < b.d2;
+        }
+        return a.dy != b.dy ? a.dy < b.dy : a.dx < b.dx;
+    });
+    size_t i = 0;
+    for(int d2 = 0; d2 <= r2; d2++) {
+        while(i < stencil.disc.size() && stencil.disc[i].d2 <= d2) {
+            i++;
         }
-        // add a new message to the log
-        LogEntry *msg = new LogEntry(lineBegin, col);
-        gui_log.push_back(msg);
-        // go to next line
-        lineBegin = lineEnd+1;
-   } while ( lineEnd );
+        stencil.disc_count[d2] = (int)i;
+    }
+    return stencil;
 }
+const AoeStencil aoe_stencil = aoe_stencil_build();
 
-void gui_render_mouse_look(TCODConsole *con, const GameMap &map, int mouse_x, int mouse_y) {
-    if(!map.tcod_fov_map->isInFov(mouse_x, mouse_y)) {
-        return;
+// the stencil of everything within radius, cells at distance <= radius like distance_to
+int aoe_stencil_count(float radius) {
+    if(radius < 0.0f) {
+        return 0;
     }
+    int r2 = (int)(radius * radius);
+    return aoe_stencil.disc_count[std::min(r2, Aoe_max_radius * Aoe_max_radius)];
+}
 
-    std::string name_list = "";
-    for(size_t i = 0; i < _entities.size(); i++) {
-        auto entity = _entities[i];
-        if(entity->x == mouse_x && entity->y == mouse_y) {
-            if(name_list == "") {
-                name_list = entity->name;
-            } else {
-                name_list += ", " + entity->name;
+// reused by every query so nothing is allocated after the first
+struct AoeScratch {
+    std::vector<int> cells; // map indices of the last query, nearest first
+    std::vector<Entity> hits;
+    std::vector<int> queue;
+    unsigned in_shape[Aoe_side * Aoe_side] = {};
+    unsigned reached[Aoe_side * Aoe_side] = {};
+    unsigned stamp = 0;
+
+    static int local(int dx, int dy) {
+        return (dx + Aoe_max_radius) + (dy + Aoe_max_radius) * Aoe_side;
+    }
+    void next_stamp() {
+        if(++stamp == 0) {
+            std::fill(in_shape, in_shape + Aoe_side * Aoe_side, 0u);
+            std::fill(reached, reached + Aoe_side * Aoe_side, 0u);
+            stamp = 1;
+        }
+    }
+} aoe;
+
+// Flood from (cx, cy) over transparent cells marked in_shape, opaque ones get
+// reached but don't pass it on. The center always counts as reached.
+void aoe_flood(const GameMap &map, int cx, int cy) {
+    aoe.queue.clear();
+    aoe.reached[AoeScratch::local(0, 0)] = aoe.stamp;
+    if(map.transparent.get(cx, cy)) {
+        aoe.queue.push_back(AoeScratch::local(0, 0));
+    }
+    for(size_t q = 0; q < aoe.queue.size(); q++) {
+        int l = aoe.queue[q];
+        int dx = l % Aoe_side - Aoe_max_radius, dy = l / Aoe_side - Aoe_max_radius;
+        for(auto &d : flow_dirs) {
+            int nx = dx + d[0], ny = dy + d[1];
+            if(nx < -Aoe_max_radius || ny < -Aoe_max_radius || nx > Aoe_max_radius || ny > Aoe_max_radius) {
+                continue;
+            }
+            int n = AoeScratch::local(nx, ny);
+            if(aoe.in_shape[n] != aoe.stamp || aoe.reached[n] == aoe.stamp) {
+                continue;
+            }
+            aoe.reached[n] = aoe.stamp;
+            if(map.transparent.get(cx + nx, cy + ny)) {
+                aoe.queue.push_back(n);
             }
         }
     }
-
-    con->setDefaultForeground(TCODColor::lightGrey);
-    con->print(1, 0, name_list.c_str());
 }
 
-TCODConsole *menu;
-void gui_render_menu(TCODConsole *con, std::string header, const std::vector<std::string> &options, 
-    int width, int screen_width, int screen_height) {
-    if(options.size() > 26) {
-        engine_log(LogStatus::Error, "Cannot have a menu with more than 26 options");
+void aoe_line(const AoeQuery &q, const GameMap &map) {
+    int dx = abs(q.target_x - q.x), dy = -abs(q.target_y - q.y);
+    if(dx == 0 && dy == 0) {
+        return;
     }
-    
-    // calculate total height for the header (after auto-wrap) and one line per option
-    int header_height = con->getHeightRect(0, 0, width, screen_height, header.c_str());
-    int height = options.size() + header_height;
-
-    // create an off-screen console that represents the menu's window
-    // SEEMS REALLY BAD TO KEEP CREATING NEW CONSOLE INSTANCES
-    if(menu) {
-        delete menu;
+    int sx = q.x < q.target_x ? 1 : -1, sy = q.y < q.target_y ? 1 : -1;
+    int err = dx + dy;
+    int x = q.x, y = q.y;
+    float r2 = q.radius * q.radius;
+    while(true) {
+        int e2 = 2 * err;
+        if(e2 >= dy) {
+            err += dy;
+            x += sx;
+        }
+        if(e2 <= dx) {
+            err += dx;
+            y += sy;
+        }
+        if(!OccupancyGrid::in_bounds(x, y) || (float)((x - q.x) * (x - q.x) + (y - q.y) * (y - q.y)) > r2) {
+            return;
+        }
+        if(q.contained && !map.transparent.get(x, y)) {
+            return;
+        }
+        aoe.cells.push_back(x + Map_Width * y);
     }
-    menu = new TCODConsole(width, height);
+}
 
-    // # print the header, with auto-wrap
-    menu->setDefaultForeground(TCOD_white);
-    menu->printRectEx(0, 0, width, height, TCOD_BKGND_NONE, TCOD_LEFT, header.c_str());
+// fills aoe.cells
+const std::vector<int> &aoe_cells(const AoeQuery &q, const GameMap &map) {
+    aoe.cells.clear();
+    if(q.shape == AOE_LINE) {
+        aoe_line(q, map);
+        return aoe.cells;
+    }
 
-    int y = header_height;
-    char letter_index = 'a';
-    for(auto &o : options) {        
-        menu->printEx(0, y, TCOD_BKGND_NONE, TCOD_LEFT, "(%c) %s", letter_index, o.c_str());
-        y++;
-        letter_index++;
+    int cx = q.shape == AOE_CIRCLE ? q.target_x : q.x;
+    int cy = q.shape == AOE_CIRCLE ? q.target_y : q.y;
+    if(!OccupancyGrid::in_bounds(cx, cy)) {
+        return aoe.cells;
+    }
+    // cone: cos(angle to the aim)^2 >= cos(half)^2 with the sign checked apart, no sqrt per cell
+    int ax = q.target_x - q.x, ay = q.target_y - q.y;
+    float cos_half = cosf(q.cone_degrees * 0.5f * 3.14159265f / 180.0f);
+    float aim2 = (float)(ax * ax + ay * ay) * cos_half * fabsf(cos_half);
+    bool wide = cos_half < 0.0f;
+
+    aoe.next_stamp();
+    int count = aoe_stencil_count(q.radius);
+    for(int i = 0; i < count; i++) {
+        const AoeOffset &o = aoe_stencil.disc[i];
+        int x = cx + o.dx, y = cy + o.dy;
+        if(!OccupancyGrid::in_bounds(x, y)) {
+            continue;
+        }
+        if(q.shape != AOE_CIRCLE && o.d2 == 0) {
+            continue;
+        }
+        if(q.shape == AOE_CONE) {
+            float dot = (float)(o.dx * ax + o.dy * ay);
+            float lhs = dot * fabsf(dot);
+            if(wide ? lhs < aim2 * (float)o.d2 : (dot <= 0.0f || lhs < aim2 * (float)o.d2)) {
+                continue;
+            }
+        }
+        aoe.in_shape[AoeScratch::local(o.dx, o.dy)] = aoe.stamp;
+        if(!q.contained) {
+            aoe.cells.push_back(x + Map_Width * y);
+        }
     }
+    if(q.contained) {
+        aoe_flood(map, cx, cy);
+        for(int i = 0; i < count; i++) {
+            const AoeOffset &o = aoe_stencil.disc[i];
+            int l = AoeScratch::local(o.dx, o.dy);
+            if(aoe.in_shape[l] == aoe.stamp && aoe.reached[l] == aoe.stamp) {
+                aoe.cells.push_back((cx + o.dx) + Map_Width * (cy + o.dy));
+            }
+        }
+    }
+    return aoe.cells;
+}
 
-    int x = int(screen_width / 2 - width / 2);
-    y = int(screen_height / 2 - height / 2);
-    TCODConsole::blit(menu, 0, 0, width, height, con, x, y, 1.0, 0.7);
+// Fighters standing in the area, nearest first. Fills aoe.hits.
+const std::vector<Entity> &aoe_fighters(const AoeQuery &q, const GameMap &map) {
+    aoe.hits.clear();
+    for(int cell : aoe_cells(q, map)) {
+        for(Entity e = world.first_on_tile(cell % Map_Width, cell / Map_Width); e.valid(); e = world.next_on_tile(e)) {
+            if(world.fighters.get(e)) {
+                aoe.hits.push_back(e);
+            }
+        }
+    }
+    return aoe.hits;
 }
 
-void gui_render_inventory(TCODConsole *con, const std::string header, const EntityFat *player, int inventory_width, int screen_width, int screen_height) {
-    std::vector<std::string> options;
-    if(player->inventory->items.size() == 0) {
-        options.push_back("Inventory is empty.");
-    } else {
-        for(auto item : player->inventory->items) {
-            if(player->equipment->main_hand == item) {
-                options.push_back(item->item->name + " (in main hand)");
-            } else if(player->equipment->off_hand == item) {
-                options.push_back(item->item->name + " (in off hand)");
-            } else {
-                options.push_back(item->item->name);
+// Up to k fighters in fov and within radius of (x, y), nearest first, skip
+// left out. Walks the stencil outward and stops at the k-th. Fills aoe.hits.
+const std::vector<Entity> &aoe_nearest(const GameMap &map, int x, int y, float radius, int k, Entity skip) {
+    aoe.hits.clear();
+    int count = aoe_stencil_count(radius);
+    for(int i = 0; i < count && (int)aoe.hits.size() < k; i++) {
+        int tx = x + aoe_stencil.disc[i].dx, ty = y + aoe_stencil.disc[i].dy;
+        if(!map_in_fov(map, tx, ty)) {
+            continue;
+        }
+        for(Entity e = world.first_on_tile(tx, ty); e.valid() && (int)aoe.hits.size() < k; e = world.next_on_tile(e)) {
+            if(e != skip && world.fighters.get(e)) {
+                aoe.hits.push_back(e);
             }
         }
-    } 
+    }
+    return aoe.hits;
+}
 
-    gui_render_menu(con, header, options, inventory_width, screen_width, screen_height);
+bool cast_heal_entity(Entity entity, const ItemArgs &args, Context &context) {
+    auto fighter = context.world.fighters.get(entity);
+    if(fighter->hp == fighter->hp_max) {
+        events_message(MSG_ALREADY_FULL_HEALTH);
+        return false;
+    } 
+    fighter->heal(args.amount);
+    events_message(MSG_WOUNDS_BETTER);
+    return true;
 }
 
-void gui_render_main_menu(TCODConsole *con, int screen_width, int screen_height) {
-    // static so only executed once
-    static TCODImage img("data/menu_background.png");
-    img.blit2x(con, 0, 0);
-    
-    con->setDefaultForeground(TCOD_light_yellow);
-    con->printEx(screen_width / 2, (screen_height / 2) - 4, TCOD_BKGND_NONE, TCOD_CENTER, 
-        "CASTLE OF THE DRAGON");
-    con->printEx(screen_width / 2, (screen_height / 2) - 3, TCOD_BKGND_NONE, TCOD_CENTER, 
-        "By Henke.");
+bool cast_lightning_bolt(Entity caster, const ItemArgs &args, Context &context) {
+    auto caster_position = context.world.positions.get(caster);
+    // anything in view, fov never reaches past fov_radius
+    auto &nearest = aoe_nearest(context.map, caster_position->x, caster_position->y, (float)fov_radius, 1, caster);
 
-    static std::vector<std::string> options = { "New Game", "Continue", "Quit" }; 
-    gui_render_menu(con, "", options, 24, screen_width, screen_height);
+    if(!nearest.empty()) {
+        Entity target = nearest[0];
+        // message first, names are looked up when it's logged and dying renames
+        events_message(MSG_LIGHTNING_HIT, target, ENTITY_NONE, args.amount);
+        context.world.fighters.get(target)->take_damage(args.amount);
+        return true;
+    } else {
+        events_message(MSG_LIGHTNING_NO_TARGET);
+        return false;
+    }
 }
 
-void gui_render_level_up_menu(TCODConsole *con, std::string header, EntityFat *player, int menu_width, int screen_width, int screen_height) {
-    std::vector<std::string> options = {
-        "Constitution | +20 HP, current: " + std::to_string(player->fighter->hp_max),
-        "Strength | +1 attack, current: " + std::to_string(player->fighter->power_max),
-        "Agility | +1 defense, current: " + std::to_string(player->fighter->defense_max)
-    };
+bool cast_fireball(Entity, const ItemArgs &args, Context &context) {
+    if(!map_in_fov(context.map, args.target_x, args.target_y)) {
+        events_message(MSG_TARGET_OUT_OF_FOV);
+        return false;
+    }
 
-    gui_render_menu(con, header, options, menu_width, screen_width, screen_height);
-}
+    events_message(MSG_FIREBALL_EXPLODES, ENTITY_NONE, ENTITY_NONE, args.range);
 
-TCODConsole *character_screen;
-void gui_render_character_screen(TCODConsole *con, EntityFat *player, int character_screen_width, int character_screen_height,  
-    int screen_width, int screen_height) {
-    // create an off-screen console that represents the menu's window
-    // SEEMS REALLY BAD TO KEEP CREATING NEW CONSOLE INSTANCES
-    if(character_screen) {
-        delete character_screen;
+    AoeQuery blast;
+    blast.shape = AOE_CIRCLE;
+    blast.target_x = args.target_x;
+    blast.target_y = args.target_y;
+    blast.radius = args.range;
+    for(Entity e : aoe_fighters(blast, context.map)) {
+        events_message(MSG_FIREBALL_BURN, e, ENTITY_NONE, args.amount);
+        context.world.fighters.get(e)->take_damage(args.amount);
     }
-    character_screen = new TCODConsole(character_screen_width, character_screen_height);
 
-    character_screen->setDefaultForeground(TCOD_white);
-    character_screen->printRectEx(0, 1, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
-        "Character Information");
-    character_screen->printRectEx(0, 2, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
-        "Level: %d", player->level->current_level);
-    character_screen->printRectEx(0, 3, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
-        "Experience: %d", player->level->current_xp);
-    character_screen->printRectEx(0, 4, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
-        "Experience to level: %d", player->level->experience_to_next_level());
-    character_screen->printRectEx(0, 6, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
-        "Maximum HP: %d", player->fighter->hp_max);
-    character_screen->printRectEx(0, 7, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
-        "Attack: %d", player->fighter->power());
-    character_screen->printRectEx(0, 8, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
-        "Defense: %d", player->fighter->defense());
+    return true;
+}
 
-    int x = screen_width / 2 - character_screen_width / 2;
-    int y = screen_height / 2 - character_screen_height / 2;
-    
+bool cast_confuse(Entity, const ItemArgs &args, Context &context) {
+    if(!map_in_fov(context.map, args.target_x, args.target_y)) {
+        events_message(MSG_TARGET_OUT_OF_FOV);
+        return false;
+    }
+
+    for(Entity e = context.world.first_on_tile(args.target_x, args.target_y); e.valid(); e = context.world.next_on_tile(e)) {
+        auto ai = context.world.ais.get(e);
+        if(ai) {
+            events_message(MSG_CONFUSED, e);
+            // already confused just gets a longer stumble
+            if(ai->type != CONFUSED_MONSTER) {
+                ai->previous = ai->type;
+                ai->type = CONFUSED_MONSTER;
+            }
+            ai->turns_remaining = 10;
+            return true;
+        }
+    }
+
+    events_message(MSG_NO_TARGETABLE);
+    return false;
+}
+
+const ItemEffect item_effects[EFFECT_COUNT] = {
+    { NULL, Targeting::None, "" },
+    { cast_heal_entity, Targeting::None, "" },
+    { cast_lightning_bolt, Targeting::None, "" },
+    { cast_fireball, Targeting::Position, "Left-click a target tile for the fireball, or right click to cancel." },
+    { cast_confuse, Targeting::Position, "Left-click an enemy to confuse it, or right click to cancel." }
+};
+
+// UI
+const int Bar_width = 20;
+const int Panel_height = 7;
+const int Panel_y = SCREEN_HEIGHT - Panel_height;
+//
+
+int map_index(int x, int y) {
+    return x + Map_Width * y;
+}
+
+bool map_blocked(const GameMap &map, int x, int y) {
+    return !map.walkable.get(x, y);
+}
+
+bool map_in_fov(const GameMap &map, int x, int y) {
+    if(x < 0 || y < 0 || x >= Map_Width || y >= Map_Height) {
+        return false;
+    }
+    return map.visible.get(x, y);
+}
+
+// cells fov from (x, y) can reach, clipped to the map
+void map_fov_box(int x, int y, int &x0, int &y0, int &x1, int &y1) {
+    if(fov_radius <= 0) {
+        x0 = 0, y0 = 0, x1 = Map_Width - 1, y1 = Map_Height - 1;
+        return;
+    }
+    x0 = std::max(0, x - fov_radius);
+    y0 = std::max(0, y - fov_radius);
+    x1 = std::min(Map_Width - 1, x + fov_radius);
+    y1 = std::min(Map_Height - 1, y + fov_radius);
+}
+
+// Recomputes fov from (x, y) and marks what's in view as explored. Only cells
+// around the old and the new origin can look different afterwards, those get
+// marked dirty for the renderer.
+void map_compute_fov(GameMap &map, int x, int y) {
+    int x0, y0, x1, y1;
+    if(map.fov_x >= 0) {
+        map_fov_box(map.fov_x, map.fov_y, x0, y0, x1, y1);
+        for(int cy = y0; cy <= y1; cy++) {
+            for(int cx = x0; cx <= x1; cx++) {
+                dirty_tiles.mark(map_index(cx, cy));
+            }
+        }
+    }
+
+    fov_compute(map.transparent, map.visible, x, y, fov_radius, fov_light_walls, fov_algorithm);
+    map.fov_x = x;
+    map.fov_y = y;
+
+    map_fov_box(x, y, x0, y0, x1, y1);
+    for(int cy = y0; cy <= y1; cy++) {
+        for(int cx = x0; cx <= x1; cx++) {
+            dirty_tiles.mark(map_index(cx, cy));
+        }
+    }
+    map.explored.unite(map.visible);
+}
+
+void map_make_room(GameMap &map, const Rect &room) {
+    for(int y = room.y + 1; y < room.y2; y++) {
+        map.walkable.set_span(y, room.x + 1, room.x2);
+        map.transparent.set_span(y, room.x + 1, room.x2);
+    }
+}
+
+void map_make_h_tunnel(GameMap &map, int x1, int x2, int y) {
+    map.walkable.set_span(y, std::min(x1, x2), std::max(x1, x2) + 1);
+    map.transparent.set_span(y, std::min(x1, x2), std::max(x1, x2) + 1);
+//     def create_h_tunnel(self, x1, x2, y):
+// +       for x in range(min(x1, x2), max(x1, x2) + 1):
+// +           self.tiles[x][y].blocked = False
+// +           self.tiles[x][y].block_sight = False
+}
+void map_make_v_tunnel(GameMap &map, int y1, int y2, int x) {
+    for(int y = std::min(y1, y2); y < std::max(y1, y2) + 1; y++) {
+        map.walkable.set(x, y);
+        map.transparent.set(x, y);
+    }
+// +   def create_v_tunnel(self, y1, y2, x):
+// +       for y in range(min(y1, y2), max(y1, y2) + 1):
+// +           self.tiles[x][y].blocked = False
+// +           self.tiles[x][y].block_sight = False
+}
+
+void map_generate(GameMap &map, Rng &rng, int max_rooms, int room_min_size, int room_max_size, int map_width, int map_height) {
+    for(int i = 0; i < max_rooms; i++) {
+        // random width and height
+        int w = rand_int(rng, room_min_size, room_max_size);
+        int h = rand_int(rng, room_min_size, room_max_size);
+        // random position without going out of the boundaries of the map
+        int x = rand_int(rng, 0, map_width - w - 1);
+        int y = rand_int(rng, 0, map_height - h - 1);
+
+        Rect new_room = rect_make(x, y, w, h);
+
+        // See if any room intersects
+        bool intersects = false;
+        for(auto &r : map.rooms) {
+            if(rect_intersects(r, new_room)) {
+                intersects = true;
+                break;
+            }
+        }
+
+        if(intersects) {
+            continue;
+        }
+
+        // "paint" it to the map's tiles
+        map_make_room(map, new_room);
+        int new_x, new_y;
+        rect_center(new_room, new_x, new_y);
+
+        if(map.num_rooms > 0) {
+            int prev_x, prev_y;
+            rect_center(map.rooms[map.num_rooms - 1], prev_x, prev_y);
+            if(rand_int(rng, 0, 1) == 1) {
+                map_make_h_tunnel(map, prev_x, new_x, prev_y);
+                map_make_v_tunnel(map, prev_y, new_y, new_x);
+            } else {
+                map_make_v_tunnel(map, prev_y, new_y, new_x);
+                map_make_h_tunnel(map, prev_x, new_x, prev_y);
+            }
+        }
+
+        map.rooms.push_back(new_room);
+        map.num_rooms++;
+    }
+}
+
+struct MonsterBlueprint {
+    std::vector<WeightByLevel> weights;
+    std::string name;
+    char visual;
+    TCODColor color;
+    int hp;
+    int defense;
+    int power;
+    int xp;
+};
+std::vector<MonsterBlueprint> monster_data = {  
+    { 
+        { { 80, 1 } },
+        "Orc", 'o', TCOD_desaturated_green, 10, 0, 4, 35 
+    },
+    { 
+        { { 15, 3 }, { 30, 5 }, { 60, 7 } },
+        "Troll", 'T', TCOD_darker_green, 30, 2, 8, 100 
+    }
+};
+// built before main, the floor pregen worker reads it too
+const SpawnLevels monster_spawns = spawn_levels_build(monster_data);
+// A floor gets planned without touching the world: layout and a list
+// of what to spawn where. Only depends on (seed, level) so it can be built
+// ahead of time on another thread and come out the same as building it on the spot.
+enum class SpawnType {
+    Monster,
+    Item,
+    Stairs
+};
+
+struct Spawn {
+    SpawnType type;
+    int blueprint;
+    int x, y;
+};
+
+struct FloorPlan {
+    GameMap map;
+    int start_x, start_y;
+    std::vector<Spawn> spawns;
+    // what world.first_on_tile would say once the player and spawns are placed
+    MapBits occupied;
+};
+
+void map_add_monsters(FloorPlan &plan, Rng &rng) {
+    const GameMap &map = plan.map;
+    static const std::vector<WeightByLevel> weights = { { 2, 1 }, { 3, 4 }, { 5, 6 } };
+    int number_of_monsters = from_dungeon_level(weights, map.level);
+    const SpawnTable &spawns = monster_spawns.at(map.level);
+
+    for(const Rect &room : map.rooms) {
+        // int number_of_monsters = rand_int(0, max_monsters_per_room);
+        for(int i = 0; i < number_of_monsters; i++) {
+            int x = rand_int(rng, room.x + 1, room.x2 - 1); 
+            int y = rand_int(rng, room.y + 1, room.y2 - 1);
+
+            if(plan.occupied.get(x, y)) {
+                continue;
+            }
+
+            int blueprint_index = spawn_table_pick(spawns, rng);
+            if(blueprint_index < 0) {
+                continue;
+            }
+            plan.spawns.push_back({ SpawnType::Monster, blueprint_index, x, y });
+            plan.occupied.set(x, y);
+        }
+    }
+}
+
+void monster_spawn(int blueprint_index, int x, int y) {
+    auto &m = monster_data[blueprint_index];
+    Entity e = entity_spawn(x, y, m.visual, m.color, m.name.c_str(), true, render_priority.ENTITY);
+    world.add(world.fighters, e, Fighter(e, m.hp, m.defense, m.power, m.xp));
+    world.add(world.ais, e, Ai(e, BASIC_MONSTER));
+}
+
+
+// id is the index in item_data, it's what saves keep
+struct ItemBlueprint {
+    std::vector<WeightByLevel> weights;
+    int id;
+    std::string name;
+    char visual;
+    TCODColor color;
+    ItemEffectId effect = EFFECT_NONE;
+    ItemArgs args = {};
+    int slot = -1; // EquipmentSlot if it can be equipped
+    int power_bonus = 0;
+    int defense_bonus = 0;
+};
+std::vector<ItemBlueprint> item_data = {  
+    { 
+        { { 35, 1 } },
+        0, "Health Potion", '!', TCOD_violet, EFFECT_HEAL, { 40 }
+    },
+    { 
+        { { 25, 4 } },
+        1, "Fireball Scroll", '#', TCOD_red, EFFECT_FIREBALL, { 25, 3 }
+    },
+    { 
+        { { 25, 6 } },
+        2, "Confusion Scroll", '#', TCOD_light_pink, EFFECT_CONFUSE
+    },
+    { 
+        { { 10, 2 } },
+        3, "Lightning Scroll", '#', TCOD_violet, EFFECT_LIGHTNING, { 40, 5 }
+    },
+    { 
+        { { 5, 4 } },
+        4, "Sword", '/', TCOD_sky, EFFECT_NONE, {}, MAIN_HAND, 3, 0
+    },
+    { 
+        { { 15, 8 } },
+        5, "Shield", '[', TCOD_darker_orange, EFFECT_NONE, {}, OFF_HAND, 0, 1
+    }
+};
+const SpawnLevels item_spawns = spawn_levels_build(item_data);
+
+void map_add_items(FloorPlan &plan, Rng &rng) {
+    const GameMap &map = plan.map;
+    static const std::vector<WeightByLevel> weights = { {1, 1}, {2, 4} };
+    int number_of_items = from_dungeon_level(weights, map.level);
+    const SpawnTable &spawns = item_spawns.at(map.level);
+
+    for(const Rect &room : map.rooms) {
+        // int number_of_items = rand_int(0, max_items_per_room);
+        for(int i = 0; i < number_of_items; i++) {
+            int x = rand_int(rng, room.x + 1, room.x2 - 1); 
+            int y = rand_int(rng, room.y + 1, room.y2 - 1);
+
+            if(plan.occupied.get(x, y)) {
+                continue;
+            }
+
+            // We probably want some other way of generating the item etc
+            // so this will change in the future anyway
+
+            // Also perhaps split items into different categories
+            // so we can select a random category or a set number from each category
+            int blueprint_index = spawn_table_pick(spawns, rng);
+            if(blueprint_index < 0) {
+                continue;
+            }
+            plan.spawns.push_back({ SpawnType::Item, blueprint_index, x, y });
+            plan.occupied.set(x, y);
+        }
+    }
+}
+
+// What an item with item_data id `id` does when used, shared by spawning and
+// loading a save. false = no such id.
+bool item_setup(Item &it, int id) {
+    if(id < 0 || id >= (int)item_data.size() || item_data[id].id != id) {
+        return false;
+    }
+    it.id = id;
+    it.effect = (uint8_t)item_data[id].effect;
+    it.args = item_data[id].args;
+    return true;
+}
+
+void item_spawn(int blueprint_index, int x, int y) {
+    auto &item = item_data[blueprint_index];
+    Item it;
+    it.name = item.name.c_str();
+    if(!item_setup(it, item.id)) {
+        std::string message = "No item with id; " + std::to_string(item.id);
+        engine_log(LogStatus::Warning, message);
+        return;
+    }
+    Entity e = entity_spawn(x, y, item.visual, item.color, item.name.c_str(), false, render_priority.ITEM);
+    world.add(world.items, e, it);
+    if(item.slot >= 0) {
+        world.add(world.equippables, e, Equippable((EquipmentSlot)item.slot, item.power_bonus, item.defense_bonus, 0));
+    }
+}
+
+void map_add_stairs(FloorPlan &plan) {
+    auto &last_room = plan.map.rooms[plan.map.num_rooms - 1];
+    // auto &last_room = map.rooms[0];
+    int center_x, center_y;
+    rect_center(last_room, center_x, center_y);
+    plan.spawns.push_back({ SpawnType::Stairs, 0, center_x, center_y });
+}
+
+void floor_plan_generate(FloorPlan &plan, uint64_t seed, int level) {
+    GameMap &map = plan.map;
+    map.level = level;
+    map.rooms.clear();
+    map.num_rooms = 0;
+    map.walkable.clear();
+    map.transparent.clear();
+    map.explored.clear();
+    map.visible.clear();
+    plan.occupied.clear();
+    plan.spawns.clear();
+
+    Rng level_rng, spawn_rng;
+    rng_seed(level_rng, rng_stream_seed(seed, RNG_LEVEL, level));
+    rng_seed(spawn_rng, rng_stream_seed(seed, RNG_SPAWN, level));
+
+    map_generate(map, level_rng, Max_rooms, Room_min_size, Room_max_size, Map_Width, Map_Height);
+
+    // player goes in the first room
+    rect_center(map.rooms[0], plan.start_x, plan.start_y);
+    plan.occupied.set(plan.start_x, plan.start_y);
+
+    map_add_monsters(plan, spawn_rng);
+    map_add_items(plan, spawn_rng);
+    map_add_stairs(plan);
+}
+
+// Puts the planned entities in the world, the plan's map is left as is
+void floor_plan_spawn(const FloorPlan &plan) {
+    for(auto &s : plan.spawns) {
+        if(s.type == SpawnType::Monster) {
+            monster_spawn(s.blueprint, s.x, s.y);
+        } else if(s.type == SpawnType::Item) {
+            item_spawn(s.blueprint, s.x, s.y);
+        } else if(s.type == SpawnType::Stairs) {
+            Entity e = entity_spawn(s.x, s.y, '>', TCOD_white, "Stairs", false, render_priority.STAIRS);
+            world.add(world.stairs, e, Stairs(plan.map.level + 1));
+        }
+    }
+}
+
+// Floor N+1 gets planned on a worker thread as soon as floor N starts, taking
+// the stairs only has to wait for it (if it's not done yet) and spawn entities.
+// One long lived worker, starting a thread per floor costs about as much as
+// generating the floor. The worker only touches the plan while `busy` is set and
+// the main thread only touches it while it isn't, the mutex covers the handoff.
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+struct FloorPregen {
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool busy = false;
+    bool quit = false;
+    FloorPlan plan;
+    uint64_t seed = 0;
+    int level = 0; // 0 = nothing planned
+
+    ~FloorPregen() {
+        if(worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                quit = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+    }
+} floor_pregen;
+
+void floor_pregen_worker() {
+    std::unique_lock<std::mutex> lock(floor_pregen.mutex);
+    while(true) {
+        floor_pregen.wake.wait(lock, [] { return floor_pregen.busy || floor_pregen.quit; });
+        if(floor_pregen.quit) {
+            return;
+        }
+        lock.unlock();
+        floor_plan_generate(floor_pregen.plan, floor_pregen.seed, floor_pregen.level);
+        lock.lock();
+        floor_pregen.busy = false;
+        floor_pregen.done.notify_one();
+    }
+}
+
+void floor_pregen_wait() {
+    std::unique_lock<std::mutex> lock(floor_pregen.mutex);
+    floor_pregen.done.wait(lock, [] { return !floor_pregen.busy; });
+}
+
+void floor_pregen_start(uint64_t seed, int level) {
+    floor_pregen_wait();
+    if(!floor_pregen.worker.joinable()) {
+        floor_pregen.worker = std::thread(floor_pregen_worker);
+    }
+    {
+        std::lock_guard<std::mutex> lock(floor_pregen.mutex);
+        floor_pregen.seed = seed;
+        floor_pregen.level = level;
+        floor_pregen.busy = true;
+    }
+    floor_pregen.wake.notify_one();
+}
+
+// Hands over the plan for (seed, level), generated right here if the worker
+// was building something else (new game, different seed)
+FloorPlan &floor_pregen_take(uint64_t seed, int level) {
+    floor_pregen_wait();
+    if(floor_pregen.seed != seed || floor_pregen.level != level) {
+        floor_plan_generate(floor_pregen.plan, seed, level);
+    }
+    floor_pregen.level = 0;
+    return floor_pregen.plan;
+}
+
+void floor_pregen_cancel() {
+    floor_pregen_wait();
+    floor_pregen.level = 0;
+}
+
+bool entity_blocking_at(int x, int y, Entity *found_entity) {
+    Entity entity = world.blocker_at(x, y);
+    if(entity.valid()) {
+        *found_entity = entity;
+        return true;
+    }
+    return false;
+}
+
+bool can_walk(const GameMap &map, int x, int y) {
+    Entity target;
+    return !map_blocked(map, x, y) && !entity_blocking_at(x, y, &target);
+}
+
+// One straight line step, sideways if that's blocked. false = stuck.
+bool step_towards(const GameMap &map, int x, int y, int target_x, int target_y, int &step_x, int &step_y) {
+    int dx, dy;
+    dx = target_x - x;
+    dy = target_y - y;
+    float distance = sqrtf(dx*dx+dy*dy);
+    
+    dx = (int)(round(dx/distance));
+    dy = (int)(round(dy/distance));
+
+    step_x = x, step_y = y;
+    if(can_walk(map, x + dx, y + dy)) {
+        step_x = x + dx, step_y = y + dy;
+    } else if(can_walk(map, x + dx, y)) {
+        step_x = x + dx;
+    } else if(can_walk(map, x, y + dy)) {
+        step_y = y + dy;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void move_towards(const GameMap &map, Entity entity, int target_x, int target_y) {
+    auto position = world.positions.get(entity);
+    int x, y;
+    if(step_towards(map, position->x, position->y, target_x, target_y, x, y)) {
+        world.move(entity, x, y);
+    }
+}
+
+// Downhill on a flow field toward the target, straight line if the field has no
+// way there. Read only, the flow has to be up to date.
+bool step_along(const GameMap &map, const MapFlow &flow, int x, int y, int target_x, int target_y, int &step_x, int &step_y) {
+    if(flow.at(x, y) == Flow_unreachable) {
+        return step_towards(map, x, y, target_x, target_y, step_x, step_y);
+    }
+    auto can_enter = [&map](int cx, int cy) {
+        return can_walk(map, cx, cy);
+    };
+    return flow_next_step(flow, x, y, step_x, step_y, can_enter);
+}
+
+void gui_render_bar(TCODConsole *panel, int x, int y, int total_width, std::string name, 
+                    int value, int maximum, TCOD_color_t bar_color, TCOD_color_t back_color) {
+    int bar_width = int(float(value) / maximum * total_width);
+
+    panel->setDefaultBackground(back_color);
+    panel->rect(x, y, total_width, 1, false, TCOD_BKGND_SCREEN);
+
+    panel->setDefaultBackground(bar_color);
+    if(bar_width > 0) {
+        panel->rect(x, y, bar_width, 1, false, TCOD_BKGND_SCREEN);
+    }
+
+    panel->setDefaultForeground(TCOD_white);
+    panel->printEx(x + total_width / 2, y, TCOD_BKGND_NONE, TCOD_CENTER, "%s: %d/%d", name.c_str(), value, maximum);
+}
+
+//// MESSAGE LOG
+// Ring of the last Log_capacity lines. A line is stored as the message id plus
+// what goes into it, the text is only put together when the line is on screen.
+// Names are captured at push since the entity can be gone by then, they point
+// at blueprint names / literals which outlive the log (corpse names live in the
+// floor arena, don't log those).
+// Messages with a '\n' in the format take one entry per line.
+
+static const int Log_x = Bar_width + 2;
+static const int Log_height = Panel_height - 1;
+static const int Hud_scroll_width = 8; // "-4096-" and some room
+static const unsigned Log_capacity = 4096; // power of two so count can wrap
+
+struct LogEntry {
+    MessageId id;
+    uint8_t line;
+    int value;
+    const char *text;
+    const char *subject;
+    const char *other;
+};
+
+struct MessageLog {
+    LogEntry entries[Log_capacity];
+    unsigned count = 0; // lines ever pushed, line n is at n % Log_capacity
+    int scroll = 0;     // lines back from the newest
+
+    unsigned size() const {
+        return std::min(count, Log_capacity);
+    }
+    
+    // i = 0 is the oldest line still in the ring
+    const LogEntry &line(unsigned i) const {
+        return entries[(count - size() + i) % Log_capacity];
+    }
+
+    int max_scroll() const {
+        return std::max(0, (int)size() - Log_height);
+    }
+
+    void scroll_by(int lines) {
+        scroll = std::max(0, std::min(max_scroll(), scroll + lines));
+    }
+
+    void push(const LogEntry &entry) {
+        entries[count % Log_capacity] = entry;
+        count++;
+        // keep the same lines in view while scrolled back
+        if(scroll > 0) {
+            scroll_by(1);
+        }
+    }
+
+    void clear() {
+        count = 0;
+        scroll = 0;
+    }
+};
+MessageLog message_log;
+
+// Puts line `line` of a message together, see MESSAGES for what %s and %d mean
+void message_format(char *buffer, size_t size, MessageId id, int line, const char *text, const char *subject, const char *other, int value) {
+    const char *strings[3];
+    int string_count = 0;
+    if(text) {
+        strings[string_count++] = text;
+    }
+    strings[string_count++] = subject;
+    strings[string_count++] = other;
+
+    size_t out = 0;
+    int next_string = 0;
+    int current_line = 0;
+    for(const char *f = message_info[id].format; *f && out + 1 < size; f++) {
+        if(f[0] == '%' && f[1] == 's') {
+            const char *s = next_string < string_count ? strings[next_string++] : "";
+            while(*s && out + 1 < size && current_line == line) {
+                buffer[out++] = *s++;
+            }
+            f++;
+        } else if(f[0] == '%' && f[1] == 'd') {
+            if(current_line == line) {
+                char digits[12];
+                int n = 0;
+                unsigned v = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+                do {
+                    digits[n++] = (char)('0' + v % 10);
+                    v /= 10;
+                } while(v);
+                if(value < 0) {
+                    digits[n++] = '-';
+                }
+                while(n > 0 && out + 1 < size) {
+                    buffer[out++] = digits[--n];
+                }
+            }
+            f++;
+        } else if(f[0] == '\n') {
+            if(++current_line > line) {
+                break;
+            }
+        } else if(current_line == line) {
+            buffer[out++] = *f;
+        }
+    }
+    buffer[out] = '\0';
+}
+
+uint8_t message_lines[MSG_COUNT];
+
+void message_log_push(MessageId id, const char *subject, const char *other, int value, const char *text) {
+    // count once per message id
+    static bool counted = false;
+    if(!counted) {
+        for(int m = 0; m < MSG_COUNT; m++) {
+            message_lines[m] = 1;
+            for(const char *f = message_info[m].format; *f; f++) {
+                message_lines[m] += *f == '\n';
+            }
+        }
+        counted = true;
+    }
+    for(int line = 0; line < message_lines[id]; line++) {
+        message_log.push(LogEntry { id, (uint8_t)line, value, text, subject, other });
+    }
+}
+
+void log_message(MessageId id, Entity subject = ENTITY_NONE, Entity other = ENTITY_NONE, int value = 0, const char *text = NULL) {
+    message_log_push(id, entity_name(subject), entity_name(other), value, text);
+}
+
+void gui_render_log(TCODConsole *con) {
+    char buffer[128];
+    int shown = std::min((int)message_log.size(), Log_height);
+    unsigned first = message_log.size() - shown - message_log.scroll;
+    float colorCoef = 0.4f;
+    for(int i = 0; i < shown; i++) {
+        const LogEntry &entry = message_log.line(first + i);
+        message_format(buffer, sizeof(buffer), entry.id, entry.line, entry.text, entry.subject, entry.other, entry.value);
+        con->setDefaultForeground(TCODColor(message_info[entry.id].color) * colorCoef);
+        con->print(Log_x, i + 1, buffer);
+        // could one-line this with a clamp;
+        if (colorCoef < 1.0f ) {
+            colorCoef += 0.3f;
+        }
+    }
+}
+
+void gui_render_log_scroll(TCODConsole *con) {
+    if(message_log.scroll > 0) {
+        con->setDefaultForeground(TCODColor::lightGrey);
+        con->printEx(SCREEN_WIDTH - 1, 0, TCOD_BKGND_NONE, TCOD_RIGHT, "-%d-", message_log.scroll);
+    }
+}
+
+void gui_render_mouse_look(TCODConsole *con, const GameMap &map, int mouse_x, int mouse_y) {
+    if(!map_in_fov(map, mouse_x, mouse_y)) {
+        return;
+    }
+
+    std::string name_list = "";
+    for(Entity e = world.first_on_tile(mouse_x, mouse_y); e.valid(); e = world.next_on_tile(e)) {
+        auto name = entity_name(e);
+        if(name_list == "") {
+            name_list = name;
+        } else {
+            name_list += ", ";
+            name_list += name;
+        }
+    }
+
+    con->setDefaultForeground(TCODColor::lightGrey);
+    // one row, stops short of the log's scroll marker
+    con->printRectEx(1, 0, SCREEN_WIDTH - Hud_scroll_width - 1, 1, TCOD_BKGND_NONE, TCOD_LEFT, "%s", name_list.c_str());
+}
+
+// Bottom panel as retained widgets. `bar` keeps every widget's cells between
+// frames, a widget clears and draws its own box again only when the hash of
+// what it shows changed, and bar only goes to the root console when one did.
+struct HudWidget {
+    int x, y, width, height;
+    uint32_t key;
+    bool valid;
+};
+
+struct Hud {
+    HudWidget look = { 0, 0, SCREEN_WIDTH - Hud_scroll_width, 1, 0, false };
+    HudWidget scroll = { SCREEN_WIDTH - Hud_scroll_width, 0, Hud_scroll_width, 1, 0, false };
+    HudWidget hp = { 0, 1, Log_x, 1, 0, false };
+    HudWidget level = { 0, 3, Log_x, 1, 0, false };
+    HudWidget log = { Log_x, 1, SCREEN_WIDTH - Log_x, Log_height, 0, false };
+    uint64_t widgets_drawn = 0;
+    uint64_t blits = 0;
+
+    // whatever was under the panel on the root console got drawn over
+    void invalidate() {
+        look.valid = scroll.valid = hp.valid = level.valid = log.valid = false;
+    }
+} hud;
+
+uint32_t hud_mix(uint32_t h, uint32_t v) {
+    return (h ^ v) * 16777619u;
+}
+
+// true = key changed, the widget's box is cleared and it has to draw
+bool hud_stale(HudWidget &widget, uint32_t key, TCODConsole *bar) {
+    if(widget.valid && widget.key == key) {
+        return false;
+    }
+    widget.valid = true;
+    widget.key = key;
+    bar->setDefaultBackground(TCODColor::black);
+    bar->rect(widget.x, widget.y, widget.width, widget.height, true, TCOD_BKGND_SET);
+    hud.widgets_drawn++;
+    return true;
+}
+
+void gui_render_hud(TCODConsole *root_console, TCODConsole *bar, const GameMap &map, Entity player, int mouse_x, int mouse_y) {
+    bool changed = false;
+    auto fighter = world.fighters.get(player);
+    if(hud_stale(hud.hp, hud_mix(hud_mix(2166136261u, fighter->hp), fighter->hp_max), bar)) {
+        gui_render_bar(bar, 1, 1, Bar_width, "HP", fighter->hp, fighter->hp_max, TCOD_light_red, TCOD_darker_red);
+        changed = true;
+    }
+
+    // what's on the hovered tile, names too since dying renames
+    uint32_t look = 2166136261u;
+    if(map_in_fov(map, mouse_x, mouse_y)) {
+        look = hud_mix(hud_mix(look, mouse_x), mouse_y);
+        for(Entity e = world.first_on_tile(mouse_x, mouse_y); e.valid(); e = world.next_on_tile(e)) {
+            look = hud_mix(hud_mix(look, e.id), (uint32_t)(uintptr_t)entity_name(e));
+        }
+    }
+    if(hud_stale(hud.look, look, bar)) {
+        gui_render_mouse_look(bar, map, mouse_x, mouse_y);
+        changed = true;
+    }
+
+    if(hud_stale(hud.level, map.level, bar)) {
+        bar->setDefaultForeground(TCOD_white);
+        bar->printEx(1, 3, TCOD_BKGND_NONE, TCOD_LEFT, "Dungeon level: %d", map.level);
+        changed = true;
+    }
+
+    // count only goes up until a clear, which comes with a new game
+    if(hud_stale(hud.log, hud_mix(hud_mix(2166136261u, message_log.count), message_log.scroll), bar)) {
+        gui_render_log(bar);
+        changed = true;
+    }
+    if(hud_stale(hud.scroll, message_log.scroll, bar)) {
+        gui_render_log_scroll(bar);
+        changed = true;
+    }
+
+    if(changed) {
+        TCODConsole::blit(bar, 0, 0, SCREEN_WIDTH, Panel_height, root_console, 0, Panel_y);
+        hud.blits++;
+    }
+}
+
+// Off-screen consoles for menus, one per size, kept for the whole run instead
+// of a new/delete every frame. Comes back cleared.
+struct ConsolePool {
+    struct Slot {
+        int width, height;
+        TCODConsole *console;
+    };
+    std::vector<Slot> slots;
+} console_pool;
+
+TCODConsole *gui_console(int width, int height) {
+    TCODConsole *console = NULL;
+    for(auto &slot : console_pool.slots) {
+        if(slot.width == width && slot.height == height) {
+            console = slot.console;
+            break;
+        }
+    }
+    if(!console) {
+        console = new TCODConsole(width, height);
+        console_pool.slots.push_back({ width, height, console });
+    }
+    console->setDefaultBackground(TCODColor::black);
+    console->clear();
+    return console;
+}
+
+void gui_render_menu(TCODConsole *con, std::string header, const std::vector<std::string> &options, 
+    int width, int screen_width, int screen_height) {
+    if(options.size() > 26) {
+        engine_log(LogStatus::Error, "Cannot have a menu with more than 26 options");
+    }
+    
+    // calculate total height for the header (after auto-wrap) and one line per option
+    int header_height = con->getHeightRect(0, 0, width, screen_height, header.c_str());
+    int height = options.size() + header_height;
+
+    TCODConsole *menu = gui_console(width, height);
+
+    // # print the header, with auto-wrap
+    menu->setDefaultForeground(TCOD_white);
+    menu->printRectEx(0, 0, width, height, TCOD_BKGND_NONE, TCOD_LEFT, header.c_str());
+
+    int y = header_height;
+    char letter_index = 'a';
+    for(auto &o : options) {        
+        menu->printEx(0, y, TCOD_BKGND_NONE, TCOD_LEFT, "(%c) %s", letter_index, o.c_str());
+        y++;
+        letter_index++;
+    }
+
+    int x = int(screen_width / 2 - width / 2);
+    y = int(screen_height / 2 - height / 2);
+    TCODConsole::blit(menu, 0, 0, width, height, con, x, y, 1.0, 0.7);
+}
+
+void gui_render_inventory(TCODConsole *con, const std::string header, Entity player, int inventory_width, int screen_width, int screen_height) {
+    auto inventory = world.inventories.get(player);
+    auto equipment = world.equipments.get(player);
+    std::vector<std::string> options;
+    if(inventory->items.size() == 0) {
+        options.push_back("Inventory is empty.");
+    } else {
+        for(auto item : inventory->items) {
+            std::string name = world.items.get(item)->name;
+            int slot = equipment->slot_of(item);
+            if(slot >= 0) {
+                options.push_back(name + " (in " + Equipment_slot_names[slot] + ")");
+            } else {
+                options.push_back(name);
+            }
+        }
+    } 
+
+    gui_render_menu(con, header, options, inventory_width, screen_width, screen_height);
+}
+
+void gui_render_main_menu(TCODConsole *con, int screen_width, int screen_height) {
+    // static so only executed once
+    static TCODImage img("data/menu_background.png");
+    img.blit2x(con, 0, 0);
+    
+    con->setDefaultForeground(TCOD_light_yellow);
+    con->printEx(screen_width / 2, (screen_height / 2) - 4, TCOD_BKGND_NONE, TCOD_CENTER, 
+        "CASTLE OF THE DRAGON");
+    con->printEx(screen_width / 2, (screen_height / 2) - 3, TCOD_BKGND_NONE, TCOD_CENTER, 
+        "By Henke.");
+
+    static std::vector<std::string> options = { "New Game", "Continue", "Quit" }; 
+    gui_render_menu(con, "", options, 24, screen_width, screen_height);
+}
+
+void gui_render_level_up_menu(TCODConsole *con, std::string header, Entity player, int menu_width, int screen_width, int screen_height) {
+    auto fighter = world.fighters.get(player);
+    std::vector<std::string> options = {
+        "Constitution | +20 HP, current: " + std::to_string(fighter->hp_max),
+        "Strength | +1 attack, current: " + std::to_string(fighter->power_max),
+        "Agility | +1 defense, current: " + std::to_string(fighter->defense_max)
+    };
+
+    gui_render_menu(con, header, options, menu_width, screen_width, screen_height);
+}
+
+void gui_render_character_screen(TCODConsole *con, Entity player, int character_screen_width, int character_screen_height,  
+    int screen_width, int screen_height) {
+    auto level = world.levels.get(player);
+    auto fighter = world.fighters.get(player);
+    TCODConsole *character_screen = gui_console(character_screen_width, character_screen_height);
+
+    character_screen->setDefaultForeground(TCOD_white);
+    character_screen->printRectEx(0, 1, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
+        "Character Information");
+    character_screen->printRectEx(0, 2, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
+        "Level: %d", level->current_level);
+    character_screen->printRectEx(0, 3, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
+        "Experience: %d", level->current_xp);
+    character_screen->printRectEx(0, 4, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
+        "Experience to level: %d", level->experience_to_next_level());
+    character_screen->printRectEx(0, 6, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
+        "Maximum HP: %d", fighter->hp_max);
+    character_screen->printRectEx(0, 7, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
+        "Attack: %d", fighter->power());
+    character_screen->printRectEx(0, 8, character_screen_width, character_screen_height, TCOD_BKGND_NONE, TCOD_LEFT,
+        "Defense: %d", fighter->defense());
+
+    int x = screen_width / 2 - character_screen_width / 2;
+    int y = screen_height / 2 - character_screen_height / 2;
+    
     TCODConsole::blit(character_screen, 0, 0, character_screen_width, character_screen_height, 
                         con, x, y, 1.0, 0.7);
 }
 
-GameMap game_map;
+GameMap game_map;
+
+Entity player;
+GameState game_state = MAIN_MENU;
+GameState previous_game_state = MAIN_MENU;
+Entity targeting_item;
+int game_turn = 0;
+uint64_t game_seed = 0;
+Context game_context = Context(world, game_map);
+
+// Swaps the planned floor in for the current one and starts planning the next
+void floor_enter(GameMap &map, int level) {
+    FloorPlan &plan = floor_pregen_take(rng.seed, level);
+    std::swap(map, plan.map);
+
+    world.move(player, plan.start_x, plan.start_y);
+    // Setup fov from players position
+    map.fov_x = map.fov_y = -1;
+    map_compute_fov(map, plan.start_x, plan.start_y);
+    dirty_tiles.mark_all();
+
+    // add entities to map
+    floor_plan_spawn(plan);
+
+    player_flow.dirty = true;
+
+    floor_pregen_start(rng.seed, level + 1);
+}
+
+void new_game(uint64_t seed) {
+    rng_seed_game(seed);
+    // indices are only recycled once more than MINIMUM_FREE_INDICES are free
+    world.reserve(256, 2 * MINIMUM_FREE_INDICES);
+
+    player = entity_spawn(SCREEN_WIDTH/2, SCREEN_HEIGHT/2, '@', TCODColor::white, "Player", true, render_priority.ENTITY);
+    world.add(world.fighters, player, Fighter(player, 100, 1, 2));
+    world.add(world.inventories, player, Inventory(player, 26));
+    world.add(world.levels, player, Level());
+    world.add(world.equipments, player, Equipment(player));
+
+    // not on the map so no position
+    Entity e = entity_create('-', TCOD_sky, "Dagger", false, render_priority.ITEM);
+    Item dagger;
+    dagger.name = "Dagger";
+    world.add(world.items, e, dagger);
+    world.add(world.equippables, e, Equippable(MAIN_HAND, 2, 0, 0));
+    
+    world.inventories.get(player)->add_item(e);
+    world.equipments.get(player)->toggle_equipment(e);
+
+    floor_enter(game_map, game_map.level);
+    
+    game_state = PLAYER_TURN;    
+
+    log_message(MSG_WELCOME, player);
+}
+
+void next_floor(GameMap &map) {
+    // everything on the map except the player goes, inventory items have no position so they stay
+    world.destroy_floor(player);
+    floor_arena.reset();
+
+    targeting_item = ENTITY_NONE;
+
+    floor_enter(map, map.level + 1);
+    
+    game_state = PLAYER_TURN;
+
+    auto fighter = world.fighters.get(player);
+    fighter->heal(fighter->hp_max / 2);
+
+    events_message(MSG_REST);
+}
+
+//// SAVE
+// Versioned binary save: a header, then sections of (tag, size, data) so a
+// loader can tell what it's looking at and skip what it doesn't know.
+// The world is plain data except for names and items (name pointers), so
+// almost everything goes out and comes back as one memcpy per array, arrays
+// padded to 8 bytes so they can be copied straight out of the file. Strings
+// go in a table and are referenced by index, items are set up again from
+// their item_data id. Entity handles are saved as they are, the manager's
+// generations come along so they resolve to the same entities after loading.
+// Loading maps the file and copies the sections into the live arrays, which
+// keep their capacity so a load mostly doesn't touch the heap.
+// Little endian, same as everything this runs on.
+#include <type_traits>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+void game_reset();
+
+static const char *Save_path = "savegame.dat";
+static const uint32_t Save_magic = 0x56534c52; // "RLSV"
+static const uint32_t Save_version = 2;
+static const uint32_t SAVE_NO_STRING = 0xffffffff;
+
+enum SaveSection : uint32_t {
+    SAVE_GAME = 1,
+    SAVE_MAP,
+    SAVE_ENTITIES,
+    SAVE_COMPONENTS,
+    SAVE_LOG,
+    SAVE_STRINGS,
+    SAVE_SECTION_END
+};
+
+struct SaveHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t map_width, map_height;
+    uint32_t bytes; // whole file
+    uint32_t sections;
+};
+
+struct SaveItem {
+    int32_t id;
+    uint32_t name;
+    ItemArgs args;
+};
+
+struct SaveLogEntry {
+    uint8_t id;
+    uint8_t line;
+    uint16_t unused;
+    int32_t value;
+    uint32_t text, subject, other;
+};
+
+struct SaveWriter {
+    std::vector<char> data;
+    size_t section = 0;
+    uint32_t sections = 0;
+    std::unordered_map<const char *, uint32_t> string_index;
+    std::vector<const char *> strings;
+
+    void reset() {
+        data.clear();
+        sections = 0;
+        string_index.clear();
+        strings.clear();
+    }
+
+    void bytes(const void *p, size_t size) {
+        if(!size) {
+            return;
+        }
+        size_t at = data.size();
+        data.resize(at + size);
+        memcpy(data.data() + at, p, size);
+    }
+
+    template<typename T>
+    void value(const T &v) {
+        static_assert(std::is_trivially_copyable<T>::value, "saved as raw bytes");
+        bytes(&v, sizeof(T));
+    }
+
+    void align() {
+        data.resize((data.size() + 7) & ~(size_t)7, 0);
+    }
+
+    template<typename T>
+    void array(const T *items, size_t count) {
+        static_assert(std::is_trivially_copyable<T>::value, "saved as raw bytes");
+        value((uint32_t)count);
+        align();
+        bytes(items, count * sizeof(T));
+        align();
+    }
+
+    template<typename T>
+    void array(const std::vector<T> &v) {
+        array(v.data(), v.size());
+    }
+
+    void begin(SaveSection tag) {
+        align();
+        section = data.size();
+        value((uint32_t)tag);
+        value((uint32_t)0);
+        sections++;
+    }
+
+    void end() {
+        uint32_t size = (uint32_t)(data.size() - section - 8);
+        memcpy(data.data() + section + 4, &size, 4);
+    }
+
+    uint32_t string(const char *s) {
+        if(!s) {
+            return SAVE_NO_STRING;
+        }
+        auto found = string_index.find(s);
+        if(found != string_index.end()) {
+            return found->second;
+        }
+        // same text at another address (a loaded name next to the blueprint's)
+        uint32_t index = 0;
+        while(index < strings.size() && strcmp(strings[index], s) != 0) {
+            index++;
+        }
+        if(index == strings.size()) {
+            strings.push_back(s);
+        }
+        string_index[s] = index;
+        return index;
+    }
+};
+
+// Bounds checked reads, a read past the end returns nothing and clears ok
+struct SaveReader {
+    const char *base, *p, *end;
+    bool ok = true;
+
+    SaveReader(const char *base = NULL, const char *p = NULL, const char *end = NULL) : base(base), p(p), end(end) {}
+
+    const char *take(size_t size) {
+        if(!ok || (size_t)(end - p) < size) {
+            ok = false;
+            return NULL;
+        }
+        const char *at = p;
+        p += size;
+        return at;
+    }
+
+    template<typename T>
+    T value() {
+        T v = T();
+        if(auto at = take(sizeof(T))) {
+            memcpy(&v, at, sizeof(T));
+        }
+        return v;
+    }
+
+    // a count of things at least `each` bytes big that still fit in what's left
+    uint32_t count(size_t each) {
+        uint32_t n = value<uint32_t>();
+        if(!ok || n > (size_t)(end - p) / each) {
+            ok = false;
+            return 0;
+        }
+        return n;
+    }
+
+    void align() {
+        size_t offset = p - base;
+        take(((offset + 7) & ~(size_t)7) - offset);
+    }
+
+    template<typename T>
+    const T *array(uint32_t &count) {
+        count = value<uint32_t>();
+        align();
+        const T *items = (const T *)take((size_t)count * sizeof(T));
+        align();
+        if(!ok) {
+            count = 0;
+        }
+        return items;
+    }
+
+    template<typename T>
+    void array(std::vector<T> &v) {
+        uint32_t count;
+        const T *items = array<T>(count);
+        v.assign(items, items + count);
+    }
+
+    // into a fixed size array, the count has to match
+    template<typename T>
+    void array(T *out, uint32_t expected) {
+        uint32_t count;
+        const T *items = array<T>(count);
+        if(count != expected) {
+            ok = false;
+            return;
+        }
+        memcpy(out, items, count * sizeof(T));
+    }
+};
+
+template<typename T>
+void save_components(SaveWriter &w, const ComponentArray<T> &array) {
+    w.array(array.dense);
+    w.array(array.owners);
+    w.array(array.sparse);
+}
+
+Item save_item_restore(const SaveItem &saved, const char *name) {
+    Item item;
+    if(saved.id >= 0) {
+        item_setup(item, saved.id);
+    }
+    item.name = name;
+    item.args = saved.args;
+    return item;
+}
+
+// get() trusts sparse, so a bad slot in there has to be caught here
+template<typename T>
+bool check_components(const ComponentArray<T> &array) {
+    if(array.dense.size() != array.owners.size()) {
+        return false;
+    }
+    for(unsigned slot : array.sparse) {
+        if(slot != COMPONENT_INVALID_SLOT && slot >= array.dense.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename T>
+void load_components(SaveReader &r, ComponentArray<T> &array) {
+    r.array(array.dense);
+    r.array(array.owners);
+    r.array(array.sparse);
+}
+
+// modifiers_fold indexes Fighter::bonus with these
+bool check_modifiers() {
+    for(auto &modifiers : world.modifiers.dense) {
+        if(modifiers.count < 0 || modifiers.count > Modifier_capacity) {
+            return false;
+        }
+        for(int i = 0; i < modifiers.count; i++) {
+            if(modifiers.list[i].stat >= STAT_COUNT) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// enough to not crash on whatever a file put in the world
+bool save_world_valid() {
+    return check_components(world.positions) && check_components(world.renderables) && check_components(world.names)
+        && check_components(world.fighters) && check_components(world.ais) && check_components(world.inventories)
+        && check_components(world.items) && check_components(world.stairs) && check_components(world.levels)
+        && check_components(world.equipments) && check_components(world.equippables)
+        && check_components(world.modifiers) && check_modifiers()
+        && world.alive(player) && world.positions.get(player) && world.fighters.get(player);
+}
+
+// what a loaded world needs on top of what's in the file
+void save_loaded() {
+    events_clear();
+    dirty_tiles.mark_all();
+    restacked_tiles.mark_all();
+    player_flow.dirty = true;
+    floor_pregen_start(rng.seed, game_map.level + 1);
+}
+
+// Strings from the last load, names and log lines point in here
+Arena save_arena;
+
+// The globals a save has besides the world, the map and the log
+struct SaveGame {
+    RngStreams rng;
+    int32_t turn;
+    int32_t state, previous_state;
+    Entity player, targeting_item;
+};
+
+SaveGame save_game_globals() {
+    return SaveGame { rng, game_turn, (int32_t)game_state, (int32_t)previous_game_state, player, targeting_item };
+}
+
+// From any world, the game's own or the copy the journal writes snapshots from
+void save_serialize(SaveWriter &w, const SaveGame &game, const World &world, const GameMap &map, const MessageLog &log) {
+    w.reset();
+    SaveHeader header = { Save_magic, Save_version, Map_Width, Map_Height, 0, 0 };
+    w.value(header);
+
+    w.begin(SAVE_GAME);
+    w.value(game.rng.seed);
+    w.value(game.rng.ai);
+    w.value(game.rng.combat);
+    w.value(game.turn);
+    w.value(game.state);
+    w.value(game.previous_state);
+    w.value(game.player);
+    w.value(game.targeting_item);
+    w.end();
+
+    w.begin(SAVE_MAP);
+    w.value((int32_t)map.level);
+    w.value((int32_t)map.fov_x);
+    w.value((int32_t)map.fov_y);
+    w.array(map.rooms);
+    w.array(map.walkable.words, MapBits::Words);
+    w.array(map.transparent.words, MapBits::Words);
+    w.array(map.explored.words, MapBits::Words);
+    w.array(map.visible.words, MapBits::Words);
+    w.end();
+
+    w.begin(SAVE_ENTITIES);
+    w.array(world.manager._generation);
+    w.array(world.manager._free_indices);
+    w.value((uint32_t)world.manager._free_head);
+    w.array(world.masks);
+    // saved as is rather than rebuilt, the order on a tile is what pickup sees
+    w.array(world.occupancy.blocker, Map_Width * Map_Height);
+    w.array(world.occupancy.head, Map_Width * Map_Height);
+    w.array(world.occupancy.next);
+    w.array(world.occupancy.handles);
+    w.end();
+
+    w.begin(SAVE_COMPONENTS);
+    save_components(w, world.positions);
+    save_components(w, world.renderables);
+    save_components(w, world.fighters);
+    save_components(w, world.ais);
+    save_components(w, world.stairs);
+    save_components(w, world.levels);
+    save_components(w, world.equipments);
+    save_components(w, world.equippables);
+    save_components(w, world.modifiers);
+
+    w.array(world.names.owners);
+    w.array(world.names.sparse);
+    w.value((uint32_t)world.names.size());
+    for(auto &name : world.names.dense) {
+        w.value(w.string(name.name));
+    }
+
+    w.array(world.items.owners);
+    w.array(world.items.sparse);
+    w.value((uint32_t)world.items.size());
+    for(auto &item : world.items.dense) {
+        w.value(SaveItem { item.id, w.string(item.name), item.args });
+    }
+
+    w.array(world.inventories.owners);
+    w.array(world.inventories.sparse);
+    w.value((uint32_t)world.inventories.size());
+    for(auto &inventory : world.inventories.dense) {
+        w.value((int32_t)inventory.capacity);
+        w.value((int32_t)inventory._dirty_shit);
+        w.array(inventory.items);
+    }
+    w.end();
+
+    w.begin(SAVE_LOG);
+    w.value((int32_t)log.scroll);
+    w.value((uint32_t)log.size());
+    w.align();
+    for(unsigned i = 0; i < log.size(); i++) {
+        const LogEntry &entry = log.line(i);
+        w.value(SaveLogEntry { entry.id, entry.line, 0, entry.value, w.string(entry.text), w.string(entry.subject), w.string(entry.other) });
+    }
+    w.end();
+
+    // last, everything above has put its strings in by now
+    w.begin(SAVE_STRINGS);
+    w.value((uint32_t)w.strings.size());
+    for(const char *s : w.strings) {
+        uint32_t length = (uint32_t)strlen(s);
+        w.value(length);
+        w.bytes(s, length);
+    }
+    w.end();
+
+    header.bytes = (uint32_t)w.data.size();
+    header.sections = w.sections;
+    memcpy(w.data.data(), &header, sizeof(header));
+}
+
+void save_serialize(SaveWriter &w) {
+    save_serialize(w, save_game_globals(), world, game_map, message_log);
+}
+
+// Puts the state from a save in place of the current one. On a bad file the
+// game is reset, the world could be half overwritten by then.
+bool save_deserialize(const char *data, size_t size) {
+    SaveHeader header;
+    if(size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if(header.magic != Save_magic || header.version != Save_version || header.bytes != size
+        || header.map_width != Map_Width || header.map_height != Map_Height) {
+        engine_log(LogStatus::Warning, "Save is from another version of the game");
+        return false;
+    }
+
+    // find the sections first, strings have to be loaded before what uses them
+    SaveReader sections[SAVE_SECTION_END];
+    SaveReader file(data, data + sizeof(header), data + size);
+    for(uint32_t i = 0; i < header.sections && file.ok; i++) {
+        file.align();
+        uint32_t tag = file.value<uint32_t>();
+        uint32_t bytes = file.value<uint32_t>();
+        const char *start = file.take(bytes);
+        if(start && tag < SAVE_SECTION_END) {
+            sections[tag] = SaveReader(data, start, start + bytes);
+        }
+    }
+    for(uint32_t tag = SAVE_GAME; tag < SAVE_SECTION_END; tag++) {
+        if(!file.ok || !sections[tag].p) {
+            engine_log(LogStatus::Warning, "Save is damaged");
+            return false;
+        }
+    }
+
+    floor_pregen_cancel();
+    save_arena.reset();
+    floor_arena.reset();
+
+    static std::vector<const char *> strings;
+    SaveReader &s = sections[SAVE_STRINGS];
+    strings.resize(s.count(sizeof(uint32_t)));
+    for(auto &string : strings) {
+        uint32_t length = s.value<uint32_t>();
+        const char *text = s.take(length);
+        char *copy = (char *)save_arena.alloc(length + 1);
+        if(!text || !copy) {
+            s.ok = false;
+            string = "";
+            continue;
+        }
+        memcpy(copy, text, length);
+        copy[length] = '\0';
+        string = copy;
+    }
+    auto string_at = [&s](uint32_t index) -> const char * {
+        if(index == SAVE_NO_STRING) {
+            return NULL;
+        }
+        if(index >= strings.size()) {
+            s.ok = false;
+            return "";
+        }
+        return strings[index];
+    };
+
+    SaveReader &g = sections[SAVE_GAME];
+    rng.seed = g.value<uint64_t>();
+    rng.ai = g.value<Rng>();
+    rng.combat = g.value<Rng>();
+    game_turn = g.value<int32_t>();
+    game_state = (GameState)g.value<int32_t>();
+    previous_game_state = (GameState)g.value<int32_t>();
+    player = g.value<Entity>();
+    targeting_item = g.value<Entity>();
+
+    SaveReader &m = sections[SAVE_MAP];
+    game_map.level = m.value<int32_t>();
+    game_map.fov_x = m.value<int32_t>();
+    game_map.fov_y = m.value<int32_t>();
+    m.array(game_map.rooms);
+    game_map.num_rooms = (int)game_map.rooms.size();
+    m.array(game_map.walkable.words, MapBits::Words);
+    m.array(game_map.transparent.words, MapBits::Words);
+    m.array(game_map.explored.words, MapBits::Words);
+    m.array(game_map.visible.words, MapBits::Words);
+
+    SaveReader &e = sections[SAVE_ENTITIES];
+    e.array(world.manager._generation);
+    e.array(world.manager._free_indices);
+    world.manager._free_head = e.value<uint32_t>();
+    e.array(world.masks);
+    e.array(world.occupancy.blocker, Map_Width * Map_Height);
+    e.array(world.occupancy.head, Map_Width * Map_Height);
+    e.array(world.occupancy.next);
+    e.array(world.occupancy.handles);
+
+    SaveReader &c = sections[SAVE_COMPONENTS];
+    load_components(c, world.positions);
+    load_components(c, world.renderables);
+    load_components(c, world.fighters);
+    load_components(c, world.ais);
+    load_components(c, world.stairs);
+    load_components(c, world.levels);
+    load_components(c, world.equipments);
+    load_components(c, world.equippables);
+    load_components(c, world.modifiers);
+
+    c.array(world.names.owners);
+    c.array(world.names.sparse);
+    world.names.dense.resize(c.count(sizeof(uint32_t)));
+    for(auto &name : world.names.dense) {
+        name.name = string_at(c.value<uint32_t>());
+    }
+
+    c.array(world.items.owners);
+    c.array(world.items.sparse);
+    world.items.dense.resize(c.count(sizeof(SaveItem)));
+    for(auto &item : world.items.dense) {
+        SaveItem saved = c.value<SaveItem>();
+        item = save_item_restore(saved, string_at(saved.name));
+    }
+
+    c.array(world.inventories.owners);
+    c.array(world.inventories.sparse);
+    world.inventories.dense.clear();
+    uint32_t inventory_count = c.count(2 * sizeof(int32_t));
+    for(uint32_t i = 0; i < inventory_count && c.ok && i < world.inventories.owners.size(); i++) {
+        world.inventories.dense.push_back(Inventory(world.inventories.owners[i], c.value<int32_t>()));
+        world.inventories.dense.back()._dirty_shit = c.value<int32_t>();
+        c.array(world.inventories.dense.back().items);
+    }
+
+    SaveReader &l = sections[SAVE_LOG];
+    int scroll = l.value<int32_t>();
+    uint32_t lines = l.count(sizeof(SaveLogEntry));
+    l.align();
+    message_log.clear();
+    for(uint32_t i = 0; i < lines && i < Log_capacity && l.ok; i++) {
+        SaveLogEntry entry = l.value<SaveLogEntry>();
+        if(entry.id >= MSG_COUNT) {
+            l.ok = false;
+            break;
+        }
+        message_log.entries[i] = LogEntry { (MessageId)entry.id, entry.line, entry.value,
+            string_at(entry.text), string_at(entry.subject), string_at(entry.other) };
+        message_log.count++;
+    }
+    message_log.scroll = std::max(0, std::min(message_log.max_scroll(), scroll));
+
+    if(!(s.ok && g.ok && m.ok && e.ok && c.ok && l.ok && save_world_valid())) {
+        engine_log(LogStatus::Warning, "Save is damaged");
+        game_reset();
+        return false;
+    }
+    save_loaded();
+    return true;
+}
+
+// The bytes of a file for as long as this is around, mapped where we can
+struct SaveFile {
+    const char *data = NULL;
+    size_t size = 0;
+#ifdef _WIN32
+    std::vector<char> buffer;
+#else
+    void *mapping = MAP_FAILED;
+#endif
+
+    bool open(const char *path) {
+#ifdef _WIN32
+        FILE *f = fopen(path, "rb");
+        if(!f) {
+            return false;
+        }
+        fseek(f, 0, SEEK_END);
+        long length = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        buffer.resize(length > 0 ? length : 0);
+        size = fread(buffer.data(), 1, buffer.size(), f);
+        fclose(f);
+        data = buffer.data();
+        return size == buffer.size();
+#else
+        int fd = ::open(path, O_RDONLY);
+        if(fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        size = (size_t)st.st_size;
+        mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(mapping == MAP_FAILED) {
+            return false;
+        }
+        data = (const char *)mapping;
+        return true;
+#endif
+    }
+
+    ~SaveFile() {
+#ifndef _WIN32
+        if(mapping != MAP_FAILED) {
+            munmap(mapping, size);
+        }
+#endif
+    }
+};
+
+SaveWriter save_writer;
+
+// Written next to the old file and renamed over it, so a crash while saving
+// leaves the old one
+bool save_write_file(const char *path, const std::vector<char> &data) {
+    std::string temp = std::string(path) + ".tmp";
+    FILE *f = fopen(temp.c_str(), "wb");
+    if(!f) {
+        engine_log(LogStatus::Error, "Could not write " + temp);
+        return false;
+    }
+    bool written = fwrite(data.data(), 1, data.size(), f) == data.size();
+    written = fclose(f) == 0 && written;
+#ifdef _WIN32
+    // rename doesn't replace on windows
+    remove(path);
+#endif
+    if(!written || rename(temp.c_str(), path) != 0) {
+        engine_log(LogStatus::Error, std::string("Could not save to ") + path);
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool save_game(const char *path) {
+    save_serialize(save_writer);
+    return save_write_file(path, save_writer.data);
+}
+
+//// JOURNAL
+// Autosave that never holds up the game. The save above is the snapshot, and
+// every finished turn appends what changed since the last one to a journal
+// file next to it. Loading replays the journal onto the snapshot, so after a
+// crash the game comes back at the last turn that made it to disk. Every
+// Journal_compact_turns turns (or once the journal gets big) a new snapshot
+// is written and the journal starts over, so the file and the replay stay short.
+// What changed is what the turn touched: World marks every entity it adds,
+// removes, moves or retags and every tile whose stack changed, events mark
+// what they name, and the few in place changes nothing names (modifier
+// countdowns, a confused monster's turns) use World::changed. Only those
+// elements of each array get compared against a copy from the last record
+// and written if they differ, so a move comes out as a few positions and
+// occupancy links and a floor change as all of it. The map's bit planes, the
+// rooms and the inventories are small, those get compared whole in
+// Journal_block byte blocks.
+// The main thread builds the record and hands it over. A worker thread (same
+// setup as the floor pregen) keeps its own copy of the game up to date from
+// the records, writes them out, and writes the snapshots from that copy.
+
+static const char *Journal_path = "savegame.journal";
+static const uint32_t Journal_magic = 0x4c4e524a; // "JRNL"
+static const uint32_t Journal_record_magic = 0x4e52544a; // "JTRN"
+static const uint32_t Journal_version = 2;
+static const int Journal_compact_turns = 500;
+static const size_t Journal_compact_bytes = 1 << 20;
+static const size_t Journal_block = 32;
+// magic, payload bytes and payload checksum in front of every record
+static const size_t Journal_record_header = 16;
+
+// The snapshot it belongs to, then the string table the records' string ids
+// start from (count, then length and bytes of each)
+struct JournalHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t snapshot_bytes;
+    uint64_t snapshot_checksum;
+    uint64_t strings_bytes;
+    uint64_t strings_checksum;
+};
+
+// Everything that isn't in an array, written every turn
+struct JournalScalars {
+    SaveGame game;
+    int32_t level, fov_x, fov_y;
+    uint32_t free_head;
+    int32_t log_scroll;
+};
+
+// What an array is indexed by, which says what of it a turn could have changed
+enum JournalIndex {
+    JOURNAL_WHOLE,  // small, compared whole
+    JOURNAL_ENTITY, // by entity index
+    JOURNAL_SLOT,   // by component slot, `sparse` maps entity indices to those
+    JOURNAL_TILE,   // by tile
+    JOURNAL_TAIL    // only gets appended to between floor changes
+};
+
+struct JournalKey {
+    JournalIndex by;
+    const std::vector<unsigned> *sparse;
+};
+
+// Names, items and inventories the way the journal has them, string ids
+// instead of pointers
+struct JournalGathered {
+    std::vector<uint32_t> name_ids;
+    std::vector<SaveItem> items;
+    std::vector<uint32_t> inventories;
+};
+
+// In front of each record handed to the worker, not part of the file
+enum JournalFlags : uint32_t {
+    JOURNAL_START = 1,   // the whole game, the worker's copy starts over from it
+    JOURNAL_SNAPSHOT = 2 // time for a new snapshot once it's applied
+};
+
+struct JournalQueued {
+    uint32_t flags;
+    uint32_t bytes;
+};
+
+uint64_t checksum64(const char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for(; i < size; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * 1099511628211ull;
+    }
+    return hash ^ size;
+}
+
+// Strings by content, each gets the next id the first time it shows up. Keeps
+// its own copies in `arena`, what the game points at can change under it
+// (corpse names when the floor arena is reset).
+struct StringIds {
+    Arena *arena = NULL;
+    std::vector<const char *> strings;
+    std::vector<uint32_t> slots; // id + 1, 0 = free
+
+    static uint32_t hash(const char *s, size_t length) {
+        uint32_t h = 2166136261u;
+        for(size_t i = 0; i < length; i++) {
+            h = (h ^ (uint8_t)s[i]) * 16777619u;
+        }
+        return h;
+    }
+
+    void clear() {
+        strings.clear();
+        std::fill(slots.begin(), slots.end(), 0);
+    }
+
+    void insert(uint32_t id) {
+        size_t mask = slots.size() - 1;
+        size_t i = hash(strings[id], strlen(strings[id])) & mask;
+        while(slots[i]) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = id + 1;
+    }
+
+    uint32_t add(const char *s, size_t length) {
+        char *copy = (char *)arena->alloc(length + 1);
+        if(copy) {
+            memcpy(copy, s, length);
+            copy[length] = '\0';
+        }
+        strings.push_back(copy ? copy : "");
+        if(strings.size() * 2 > slots.size()) {
+            slots.assign(std::max<size_t>(64, slots.size() * 2), 0);
+            for(uint32_t id = 0; id < strings.size(); id++) {
+                insert(id);
+            }
+        } else {
+            insert((uint32_t)strings.size() - 1);
+        }
+        return (uint32_t)strings.size() - 1;
+    }
+
+    uint32_t id(const char *s, bool &added) {
+        added = false;
+        if(!s) {
+            return SAVE_NO_STRING;
+        }
+        size_t length = strlen(s);
+        if(!slots.empty()) {
+            size_t mask = slots.size() - 1;
+            for(size_t i = hash(s, length) & mask; slots[i]; i = (i + 1) & mask) {
+                if(strcmp(strings[slots[i] - 1], s) == 0) {
+                    return slots[i] - 1;
+                }
+            }
+        }
+        added = true;
+        return add(s, length);
+    }
+};
+
+// The game as the records describe it, raw bytes of every journal_arrays
+// array. The worker keeps one to write snapshots from, loading builds one on
+// top of the snapshot and replays the journal onto it.
+struct JournalMirror {
+    std::vector<std::vector<char>> arrays;
+    StringIds strings;
+    MessageLog log;
+    JournalScalars scalars;
+};
+
+struct Journal {
+    // main thread
+    bool enabled = false;
+    bool active = false; // the worker has the whole game, records build on that
+    const char *save_path = Save_path;
+    const char *path = Journal_path;
+    int turn = 0;
+    unsigned log_count = 0;
+    int turns_since_snapshot = 0;
+    size_t bytes_since_snapshot = 0;
+    Arena strings_arena;
+    StringIds strings;
+    uint32_t strings_written = 0;
+    JournalGathered gathered;
+    std::vector<std::vector<char>> shadows; // every array as of the last record
+    // this record's entities and tiles, sorted, and the slots they have in `slots_of`
+    std::vector<unsigned> entities, tiles, slots;
+    const std::vector<unsigned> *slots_of = NULL;
+    SaveWriter record;
+
+    // stats for `main journalbench`, records that had to write the whole game
+    // (a new game, a floor change) apart from the rest
+    int records = 0, snapshots = 0, whole_records = 0;
+    size_t record_bytes = 0, record_bytes_worst = 0;
+    double main_us = 0, main_us_worst = 0, whole_us = 0;
+
+    // worker, owns these while busy
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::vector<char> pending; // records not taken yet, each after its JournalQueued
+    bool busy = false;
+    bool quit = false;
+    std::vector<char> writing, out;
+    FILE *file = NULL;
+    double worker_us = 0;
+    uint64_t bytes_written = 0;
+    // only the worker touches these
+    JournalMirror mirror;
+    Arena mirror_arena;
+    World snapshot_world;
+    GameMap snapshot_map;
+    JournalGathered snapshot_gathered;
+    MessageLog snapshot_log;
+    SaveWriter snapshot;
+
+    ~Journal() {
+        if(worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                quit = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+        if(file) {
+            fclose(file);
+        }
+    }
+} journal;
+
+template<typename T>
+char *journal_data(std::vector<T> &v) {
+    return (char *)v.data();
+}
+template<typename T>
+size_t journal_size(const std::vector<T> &v) {
+    return v.size() * sizeof(T);
+}
+template<typename T>
+bool journal_assign(std::vector<T> &v, const std::vector<char> &bytes) {
+    if(bytes.size() % sizeof(T)) {
+        return false;
+    }
+    v.assign((const T *)bytes.data(), (const T *)(bytes.data() + bytes.size()));
+    return true;
+}
+template<typename T, size_t N>
+char *journal_data(T (&a)[N]) {
+    return (char *)a;
+}
+template<typename T, size_t N>
+size_t journal_size(T (&a)[N]) {
+    return sizeof(a);
+}
+template<typename T, size_t N>
+bool journal_assign(T (&a)[N], const std::vector<char> &bytes) {
+    if(bytes.size() != sizeof(a)) {
+        return false;
+    }
+    memcpy(a, bytes.data(), sizeof(a));
+    return true;
+}
+
+static const JournalKey Journal_whole = { JOURNAL_WHOLE, NULL };
+static const JournalKey Journal_entity = { JOURNAL_ENTITY, NULL };
+static const JournalKey Journal_tile = { JOURNAL_TILE, NULL };
+static const JournalKey Journal_tail = { JOURNAL_TAIL, NULL };
+
+template<typename T, typename F>
+void journal_components(F &f, ComponentArray<T> &array) {
+    f(array.dense, JournalKey { JOURNAL_SLOT, &array.sparse });
+    f(array.owners, JournalKey { JOURNAL_SLOT, &array.sparse });
+    f(array.sparse, Journal_entity);
+}
+
+// Every array the journal keeps track of, always in this order, an array's
+// place in here is its id in the file. Same arrays as SAVE.
+template<typename F>
+void journal_arrays(World &world, GameMap &map, JournalGathered &gathered, F f) {
+    f(map.rooms, Journal_whole);
+    f(map.walkable.words, Journal_whole);
+    f(map.transparent.words, Journal_whole);
+    f(map.explored.words, Journal_whole);
+    f(map.visible.words, Journal_whole);
+    f(world.manager._generation, Journal_entity);
+    f(world.manager._free_indices, Journal_tail);
+    f(world.masks, Journal_entity);
+    f(world.occupancy.blocker, Journal_tile);
+    f(world.occupancy.head, Journal_tile);
+    f(world.occupancy.next, Journal_entity);
+    f(world.occupancy.handles, Journal_entity);
+    journal_components(f, world.positions);
+    journal_components(f, world.renderables);
+    journal_components(f, world.fighters);
+    journal_components(f, world.ais);
+    journal_components(f, world.stairs);
+    journal_components(f, world.levels);
+    journal_components(f, world.equipments);
+    journal_components(f, world.equippables);
+    journal_components(f, world.modifiers);
+    f(world.names.owners, JournalKey { JOURNAL_SLOT, &world.names.sparse });
+    f(world.names.sparse, Journal_entity);
+    f(world.items.owners, JournalKey { JOURNAL_SLOT, &world.items.sparse });
+    f(world.items.sparse, Journal_entity);
+    f(world.inventories.owners, JournalKey { JOURNAL_SLOT, &world.inventories.sparse });
+    f(world.inventories.sparse, Journal_entity);
+    f(gathered.name_ids, JournalKey { JOURNAL_SLOT, &world.names.sparse });
+    f(gathered.items, JournalKey { JOURNAL_SLOT, &world.items.sparse });
+    f(gathered.inventories, Journal_whole);
+}
+
+SaveItem journal_item(const Item &item, StringIds &ids) {
+    bool added;
+    return SaveItem { item.id, ids.id(item.name, added), item.args };
+}
+
+// count, then capacity, _dirty_shit, item count and items for each
+void journal_gather_inventories(const World &world, JournalGathered &gathered) {
+    auto &words = gathered.inventories;
+    words.clear();
+    words.push_back((uint32_t)world.inventories.size());
+    for(auto &inventory : world.inventories.dense) {
+        words.push_back((uint32_t)inventory.capacity);
+        words.push_back((uint32_t)inventory._dirty_shit);
+        words.push_back((uint32_t)inventory.items.size());
+        for(Entity item : inventory.items) {
+            words.push_back(item.id);
+        }
+    }
+}
+
+// names, items and inventories into their file form
+void journal_gather(const World &world, JournalGathered &gathered, StringIds &ids) {
+    bool added;
+    gathered.name_ids.resize(world.names.size());
+    for(size_t i = 0; i < world.names.size(); i++) {
+        gathered.name_ids[i] = ids.id(world.names.dense[i].name, added);
+    }
+    gathered.items.resize(world.items.size());
+    for(size_t i = 0; i < world.items.size(); i++) {
+        gathered.items[i] = journal_item(world.items.dense[i], ids);
+    }
+    journal_gather_inventories(world, gathered);
+}
+
+// The same for just the entities in `entities`, the rest is as it was. There
+// is only ever an inventory or two, those are always redone.
+void journal_gather_entities(const World &world, JournalGathered &gathered, StringIds &ids, const std::vector<unsigned> &entities) {
+    bool added;
+    gathered.name_ids.resize(world.names.size());
+    gathered.items.resize(world.items.size());
+    for(unsigned idx : entities) {
+        if(idx < world.names.sparse.size() && world.names.sparse[idx] != COMPONENT_INVALID_SLOT) {
+            unsigned slot = world.names.sparse[idx];
+            gathered.name_ids[slot] = ids.id(world.names.dense[slot].name, added);
+        }
+        if(idx < world.items.sparse.size() && world.items.sparse[idx] != COMPONENT_INVALID_SLOT) {
+            unsigned slot = world.items.sparse[idx];
+            gathered.items[slot] = journal_item(world.items.dense[slot], ids);
+        }
+    }
+    journal_gather_inventories(world, gathered);
+}
+
+// The way back from journal_gather, false if the words don't add up
+bool journal_scatter_gathered(World &world, const JournalGathered &gathered, const StringIds &ids) {
+    auto &names = world.names.dense;
+    names.resize(gathered.name_ids.size());
+    for(size_t i = 0; i < names.size(); i++) {
+        uint32_t id = gathered.name_ids[i];
+        if(id >= ids.strings.size()) {
+            return false;
+        }
+        names[i].name = ids.strings[id];
+    }
+    world.items.dense.resize(gathered.items.size());
+    for(size_t i = 0; i < gathered.items.size(); i++) {
+        uint32_t id = gathered.items[i].name;
+        if(id >= ids.strings.size()) {
+            return false;
+        }
+        world.items.dense[i] = save_item_restore(gathered.items[i], ids.strings[id]);
+    }
+    auto &words = gathered.inventories;
+    size_t at = 0;
+    auto next = [&words, &at](uint32_t &value) {
+        if(at >= words.size()) {
+            return false;
+        }
+        value = words[at++];
+        return true;
+    };
+    uint32_t count, capacity, dirty, items;
+    if(!next(count) || count != world.inventories.owners.size()) {
+        return false;
+    }
+    world.inventories.dense.clear();
+    for(uint32_t i = 0; i < count; i++) {
+        if(!next(capacity) || !next(dirty) || !next(items) || items > words.size() - at) {
+            return false;
+        }
+        world.inventories.dense.push_back(Inventory(world.inventories.owners[i], (int)capacity));
+        auto &inventory = world.inventories.dense.back();
+        inventory._dirty_shit = (int)dirty;
+        for(uint32_t n = 0; n < items; n++) {
+            Entity item;
+            item.id = words[at++];
+            inventory.items.push_back(item);
+        }
+    }
+    return true;
+}
+
+JournalScalars journal_scalars() {
+    return JournalScalars { save_game_globals(), game_map.level, game_map.fov_x, game_map.fov_y,
+        (uint32_t)world.manager._free_head, message_log.scroll };
+}
+
+// Writes array `id` as runs of blocks that differ from its shadow, then
+// brings the shadow up to date
+void journal_patch(SaveWriter &w, uint32_t id, const char *data, size_t size, std::vector<char> &shadow) {
+    w.value(id);
+    w.value((uint32_t)size);
+    size_t runs_at = w.data.size();
+    w.value((uint32_t)0);
+    uint32_t runs = 0;
+    auto same = [&](size_t offset) {
+        size_t n = std::min(Journal_block, size - offset);
+        return offset + n <= shadow.size() && memcmp(data + offset, shadow.data() + offset, n) == 0;
+    };
+    size_t offset = 0;
+    while(offset < size) {
+        if(same(offset)) {
+            offset += Journal_block;
+            continue;
+        }
+        size_t start = offset;
+        while(offset < size && !same(offset)) {
+            offset += Journal_block;
+        }
+        offset = std::min(offset, size);
+        w.value((uint32_t)start);
+        w.value((uint32_t)(offset - start));
+        w.bytes(data + start, offset - start);
+        runs++;
+    }
+    memcpy(w.data.data() + runs_at, &runs, 4);
+    shadow.assign(data, data + size);
+}
+
+// Writes array `id` as runs of the elements in `elements` (sorted, `each`
+// bytes apiece) that differ from its shadow, and everything from byte `tail`
+// on, then brings the shadow up to date. Only what's in there gets looked at.
+// Writes nothing if nothing changed, true if it wrote the array.
+bool journal_runs(SaveWriter &w, uint32_t id, const char *data, size_t size, size_t each, const std::vector<unsigned> &elements,
+    size_t tail, std::vector<char> &shadow) {
+    size_t at = w.data.size();
+    w.value(id);
+    w.value((uint32_t)size);
+    size_t runs_at = w.data.size();
+    w.value((uint32_t)0);
+    uint32_t runs = 0;
+    auto run = [&](size_t offset, size_t length) {
+        w.value((uint32_t)offset);
+        w.value((uint32_t)length);
+        w.bytes(data + offset, length);
+        runs++;
+    };
+    size_t before = std::min(std::min(size, tail), shadow.size()) / each;
+    auto differs = [&](size_t element) {
+        return memcmp(data + element * each, shadow.data() + element * each, each) != 0;
+    };
+    for(size_t i = 0; i < elements.size() && elements[i] < before;) {
+        size_t first = elements[i++];
+        if(!differs(first)) {
+            continue;
+        }
+        size_t last = first + 1;
+        while(i < elements.size() && elements[i] == last && last < before && differs(last)) {
+            last++;
+            i++;
+        }
+        run(first * each, (last - first) * each);
+        memcpy(shadow.data() + first * each, data + first * each, (last - first) * each);
+    }
+    bool resized = size != shadow.size();
+    tail = std::min(tail, shadow.size());
+    shadow.resize(size);
+    if(size > tail) {
+        run(tail, size - tail);
+        memcpy(shadow.data() + tail, data + tail, size - tail);
+    }
+    if(runs == 0 && !resized) {
+        w.data.resize(at);
+        return false;
+    }
+    memcpy(w.data.data() + runs_at, &runs, 4);
+    return true;
+}
+
+// The slots this record's entities have in the component `sparse` belongs to, sorted
+const std::vector<unsigned> &journal_slots(const std::vector<unsigned> &sparse) {
+    if(journal.slots_of != &sparse) {
+        journal.slots_of = &sparse;
+        journal.slots.clear();
+        for(unsigned idx : journal.entities) {
+            if(idx < sparse.size() && sparse[idx] != COMPONENT_INVALID_SLOT) {
+                journal.slots.push_back(sparse[idx]);
+            }
+        }
+        std::sort(journal.slots.begin(), journal.slots.end());
+    }
+    return journal.slots;
+}
+
+void journal_worker();
+
+// What the turn changed, handed to the worker with `flags`
+void journal_record(uint32_t flags) {
+    bool all = unsaved_entities.all || unsaved_tiles.all;
+    auto &entities = journal.entities;
+    auto &tiles = journal.tiles;
+    entities.assign(unsaved_entities.list.begin(), unsaved_entities.list.end());
+    // whatever the player did to themselves (healed, levelled up) and the
+    // item being aimed, neither always has an event naming it
+    if(player.valid()) {
+        entities.push_back(player.index());
+    }
+    if(targeting_item.valid()) {
+        entities.push_back(targeting_item.index());
+    }
+    std::sort(entities.begin(), entities.end());
+    entities.erase(std::unique(entities.begin(), entities.end()), entities.end());
+    tiles.assign(unsaved_tiles.list.begin(), unsaved_tiles.list.end());
+    std::sort(tiles.begin(), tiles.end());
+    journal.slots_of = NULL;
+
+    SaveWriter &w = journal.record;
+    w.reset();
+    w.value(Journal_record_magic);
+    w.value((uint32_t)0);  // payload bytes
+    w.value((uint64_t)0);  // payload checksum
+    const size_t payload = w.data.size();
+
+    if(all) {
+        journal_gather(world, journal.gathered, journal.strings);
+    } else {
+        journal_gather_entities(world, journal.gathered, journal.strings, entities);
+    }
+    w.value(journal_scalars());
+
+    unsigned lines = std::min(message_log.count - journal.log_count, message_log.size());
+    size_t lines_at = w.data.size();
+    w.value(lines);
+    for(unsigned i = message_log.size() - lines; i < message_log.size(); i++) {
+        const LogEntry &entry = message_log.line(i);
+        bool added;
+        StringIds &ids = journal.strings;
+        w.value(SaveLogEntry { entry.id, entry.line, 0, entry.value, ids.id(entry.text, added), ids.id(entry.subject, added), ids.id(entry.other, added) });
+    }
+
+    // the log went first so its strings are in here too
+    std::vector<char> log_entries(w.data.begin() + lines_at, w.data.end());
+    w.data.resize(lines_at);
+    uint32_t strings = (uint32_t)journal.strings.strings.size();
+    w.value(strings - journal.strings_written);
+    for(uint32_t id = journal.strings_written; id < strings; id++) {
+        const char *s = journal.strings.strings[id];
+        uint32_t length = (uint32_t)strlen(s);
+        w.value(length);
+        w.bytes(s, length);
+    }
+    journal.strings_written = strings;
+    w.bytes(log_entries.data(), log_entries.size());
+
+    size_t count_at = w.data.size();
+    w.value((uint32_t)0);
+    static const std::vector<unsigned> none;
+    uint32_t index = 0, patched = 0;
+    journal_arrays(world, game_map, journal.gathered, [&](auto &array, JournalKey key) {
+        if(index == journal.shadows.size()) {
+            journal.shadows.emplace_back();
+        }
+        const char *data = journal_data(array);
+        size_t size = journal_size(array);
+        auto &shadow = journal.shadows[index];
+        if(key.by == JOURNAL_WHOLE) {
+            if(size != shadow.size() || (size && memcmp(data, shadow.data(), size) != 0)) {
+                journal_patch(w, index, data, size, shadow);
+                patched++;
+            }
+        } else {
+            const std::vector<unsigned> *elements = &none;
+            if(!all && key.by == JOURNAL_ENTITY) {
+                elements = &entities;
+            } else if(!all && key.by == JOURNAL_TILE) {
+                elements = &tiles;
+            } else if(!all && key.by == JOURNAL_SLOT) {
+                elements = &journal_slots(*key.sparse);
+            }
+            if(journal_runs(w, index, data, size, sizeof(array[0]), *elements, all ? 0 : shadow.size(), shadow)) {
+                patched++;
+            }
+        }
+        index++;
+    });
+    memcpy(w.data.data() + count_at, &patched, 4);
+    unsaved_entities.clear();
+    unsaved_tiles.clear();
+
+    uint32_t bytes = (uint32_t)(w.data.size() - payload);
+    uint64_t checksum = checksum64(w.data.data() + payload, bytes);
+    memcpy(w.data.data() + 4, &bytes, 4);
+    memcpy(w.data.data() + 8, &checksum, 8);
+    if(!journal.worker.joinable()) {
+        journal.worker = std::thread(journal_worker);
+    }
+    {
+        std::lock_guard<std::mutex> lock(journal.mutex);
+        JournalQueued queued = { flags, (uint32_t)w.data.size() };
+        const char *q = (const char *)&queued;
+        journal.pending.insert(journal.pending.end(), q, q + sizeof(queued));
+        journal.pending.insert(journal.pending.end(), w.data.begin(), w.data.end());
+    }
+    journal.wake.notify_one();
+
+    journal.turn = game_turn;
+    journal.log_count = message_log.count;
+    journal.turns_since_snapshot++;
+    journal.bytes_since_snapshot += w.data.size();
+    journal.records++;
+    journal.whole_records += all;
+    journal.record_bytes += w.data.size();
+    journal.record_bytes_worst = std::max(journal.record_bytes_worst, w.data.size());
+}
+
+// The whole game as one record, for a game that just started or was loaded.
+// The worker starts its copy over from it and writes a snapshot.
+void journal_start() {
+    journal.strings_arena.reset();
+    journal.strings.arena = &journal.strings_arena;
+    journal.strings.clear();
+    journal.strings_written = 0;
+    for(auto &shadow : journal.shadows) {
+        shadow.clear();
+    }
+    journal.log_count = message_log.count - message_log.size();
+    unsaved_entities.mark_all();
+    unsaved_tiles.mark_all();
+    journal_record(JOURNAL_START);
+    journal.active = true;
+    journal.turns_since_snapshot = 0;
+    journal.bytes_since_snapshot = 0;
+    journal.snapshots++;
+}
+
+// CPU time the calling thread has had, in us. With fewer cores than threads
+// the worker can get the core in the middle of a record, that isn't time the
+// record took. Wall time where there's no such clock.
+double journal_thread_us() {
+#ifdef __linux__
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+#else
+    return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Once per frame after the events. A turn that finished gets its record, a
+// game that just started (or was loaded) gets recorded whole. Every so often
+// a record asks the worker for a new snapshot too.
+void journal_update() {
+    if(!journal.enabled || game_state == MAIN_MENU || (journal.active && game_turn == journal.turn)) {
+        return;
+    }
+    double start = journal_thread_us();
+    bool all = !journal.active || unsaved_entities.all || unsaved_tiles.all;
+    if(!journal.active) {
+        journal_start();
+    } else if(journal.turns_since_snapshot >= Journal_compact_turns || journal.bytes_since_snapshot >= Journal_compact_bytes) {
+        journal_record(JOURNAL_SNAPSHOT);
+        journal.turns_since_snapshot = 0;
+        journal.bytes_since_snapshot = 0;
+        journal.snapshots++;
+    } else {
+        journal_record(0);
+    }
+    double us = journal_thread_us() - start;
+    if(all) {
+        journal.whole_us += us;
+    } else {
+        journal.main_us += us;
+        journal.main_us_worst = std::max(journal.main_us_worst, us);
+    }
+}
+
+// One record onto `mirror`, false if it doesn't make sense
+bool journal_apply(SaveReader &r, JournalMirror &mirror) {
+    mirror.scalars = r.value<JournalScalars>();
+    uint32_t strings = r.count(sizeof(uint32_t));
+    for(uint32_t i = 0; i < strings && r.ok; i++) {
+        uint32_t length = r.value<uint32_t>();
+        const char *text = r.take(length);
+        if(text) {
+            mirror.strings.add(text, length);
+        }
+    }
+    auto string_at = [&r, &mirror](uint32_t id) -> const char * {
+        if(id == SAVE_NO_STRING) {
+            return NULL;
+        }
+        if(id >= mirror.strings.strings.size()) {
+            r.ok = false;
+            return "";
+        }
+        return mirror.strings.strings[id];
+    };
+    uint32_t lines = r.count(sizeof(SaveLogEntry));
+    for(uint32_t i = 0; i < lines && r.ok; i++) {
+        SaveLogEntry entry = r.value<SaveLogEntry>();
+        if(entry.id >= MSG_COUNT) {
+            return false;
+        }
+        mirror.log.push(LogEntry { (MessageId)entry.id, entry.line, entry.value,
+            string_at(entry.text), string_at(entry.subject), string_at(entry.other) });
+    }
+    uint32_t patched = r.count(3 * sizeof(uint32_t));
+    for(uint32_t i = 0; i < patched && r.ok; i++) {
+        uint32_t id = r.value<uint32_t>();
+        uint32_t size = r.value<uint32_t>();
+        uint32_t runs = r.value<uint32_t>();
+        // anything past the old size was written out in the runs
+        if(id >= mirror.arrays.size() || size > mirror.arrays[id].size() + (size_t)(r.end - r.p)) {
+            return false;
+        }
+        auto &array = mirror.arrays[id];
+        array.resize(size);
+        for(uint32_t run = 0; run < runs && r.ok; run++) {
+            uint32_t offset = r.value<uint32_t>();
+            uint32_t length = r.value<uint32_t>();
+            const char *data = r.take(length);
+            if(!data || offset > size || length > size - offset) {
+                return false;
+            }
+            memcpy(array.data() + offset, data, length);
+        }
+    }
+    return r.ok;
+}
+
+// `mirror` into a world, map and log, false if it doesn't add up
+bool journal_mirror_assign(JournalMirror &mirror, World &world, GameMap &map, JournalGathered &gathered, MessageLog &log) {
+    bool ok = true;
+    size_t index = 0;
+    journal_arrays(world, map, gathered, [&](auto &array, JournalKey) {
+        ok = journal_assign(array, mirror.arrays[index++]) && ok;
+    });
+    if(!ok || !journal_scatter_gathered(world, gathered, mirror.strings)) {
+        return false;
+    }
+    const JournalScalars &scalars = mirror.scalars;
+    map.num_rooms = (int)map.rooms.size();
+    map.level = scalars.level;
+    map.fov_x = scalars.fov_x;
+    map.fov_y = scalars.fov_y;
+    world.manager._free_head = scalars.free_head;
+    log = mirror.log;
+    log.scroll = std::max(0, std::min(log.max_scroll(), (int)scalars.log_scroll));
+    return true;
+}
+
+void journal_worker_flush() {
+    if(journal.file && journal.out.size()) {
+        fwrite(journal.out.data(), 1, journal.out.size(), journal.file);
+        // out of the process, a crash of the game can't lose it any more
+        fflush(journal.file);
+        journal.bytes_written += journal.out.size();
+    }
+    journal.out.clear();
+}
+
+// A snapshot of the worker's copy, then a journal that starts over on top of
+// it with the string ids the records go on from
+bool journal_worker_write_snapshot() {
+    JournalMirror &mirror = journal.mirror;
+    if(!journal_mirror_assign(mirror, journal.snapshot_world, journal.snapshot_map, journal.snapshot_gathered, journal.snapshot_log)) {
+        engine_log(LogStatus::Error, "Journal lost track of the game, no snapshot written");
+        return false;
+    }
+    SaveWriter &w = journal.snapshot;
+    save_serialize(w, mirror.scalars.game, journal.snapshot_world, journal.snapshot_map, journal.snapshot_log);
+    if(!save_write_file(journal.save_path, w.data)) {
+        return false;
+    }
+    if(journal.file) {
+        fclose(journal.file);
+    }
+    journal.file = fopen(journal.path, "wb");
+    if(!journal.file) {
+        engine_log(LogStatus::Error, std::string("Could not write ") + journal.path);
+        return true;
+    }
+    size_t snapshot_bytes = w.data.size();
+    uint64_t snapshot_checksum = checksum64(w.data.data(), snapshot_bytes);
+    w.data.clear();
+    w.value((uint32_t)mirror.strings.strings.size());
+    for(const char *s : mirror.strings.strings) {
+        uint32_t length = (uint32_t)strlen(s);
+        w.value(length);
+        w.bytes(s, length);
+    }
+    JournalHeader header = { Journal_magic, Journal_version, snapshot_bytes, snapshot_checksum,
+        w.data.size(), checksum64(w.data.data(), w.data.size()) };
+    fwrite(&header, sizeof(header), 1, journal.file);
+    fwrite(w.data.data(), 1, w.data.size(), journal.file);
+    fflush(journal.file);
+    journal.bytes_written += snapshot_bytes + sizeof(header) + w.data.size();
+    return true;
+}
+
+// One record from the main thread: onto the copy, then into the file or, when
+// it asks for one, into a new snapshot
+void journal_worker_take(uint32_t flags, const char *record, size_t bytes) {
+    JournalMirror &mirror = journal.mirror;
+    if(flags & JOURNAL_START) {
+        size_t arrays = 0;
+        journal_arrays(journal.snapshot_world, journal.snapshot_map, journal.snapshot_gathered, [&arrays](auto &, JournalKey) { arrays++; });
+        mirror.arrays.resize(arrays);
+        for(auto &array : mirror.arrays) {
+            array.clear();
+        }
+        journal.mirror_arena.reset();
+        mirror.strings.arena = &journal.mirror_arena;
+        mirror.strings.clear();
+        mirror.log.clear();
+    }
+    SaveReader r(record, record + Journal_record_header, record + bytes);
+    if(!journal_apply(r, mirror)) {
+        engine_log(LogStatus::Error, "Journal record doesn't apply");
+    }
+    if(flags & (JOURNAL_START | JOURNAL_SNAPSHOT)) {
+        // the ones before it go to the old journal, in case this one fails
+        journal_worker_flush();
+        if(journal_worker_write_snapshot()) {
+            return;
+        }
+        if(flags & JOURNAL_START) {
+            // nothing on disk this could go on top of
+            if(journal.file) {
+                fclose(journal.file);
+                journal.file = NULL;
+            }
+            return;
+        }
+    }
+    journal.out.insert(journal.out.end(), record, record + bytes);
+}
+
+void journal_worker() {
+    std::unique_lock<std::mutex> lock(journal.mutex);
+    while(true) {
+        journal.wake.wait(lock, [] { return !journal.pending.empty() || journal.quit; });
+        if(journal.pending.empty()) {
+            return;
+        }
+        std::swap(journal.writing, journal.pending);
+        journal.busy = true;
+        lock.unlock();
+
+        auto start = std::chrono::high_resolution_clock::now();
+        size_t at = 0;
+        while(at + sizeof(JournalQueued) <= journal.writing.size()) {
+            JournalQueued queued;
+            memcpy(&queued, journal.writing.data() + at, sizeof(queued));
+            at += sizeof(queued);
+            journal_worker_take(queued.flags, journal.writing.data() + at, queued.bytes);
+            at += queued.bytes;
+        }
+        journal_worker_flush();
+        journal.writing.clear();
+        journal.worker_us += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+
+        lock.lock();
+        journal.busy = false;
+        journal.done.notify_all();
+    }
+}
+
+// Until everything handed over is on disk
+void journal_wait() {
+    std::unique_lock<std::mutex> lock(journal.mutex);
+    journal.done.wait(lock, [] { return !journal.busy && journal.pending.empty(); });
+}
+
+void journal_stop() {
+    if(journal.worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(journal.mutex);
+            journal.quit = true;
+        }
+        journal.wake.notify_one();
+        journal.worker.join();
+        journal.quit = false;
+    }
+    if(journal.file) {
+        fclose(journal.file);
+        journal.file = NULL;
+    }
+    journal.active = false;
+}
+
+// After the snapshot it belongs to was loaded: replays the journal's turns onto
+// it. 0 = no journal for this snapshot, -1 = the world didn't survive it (load
+// the snapshot again), otherwise the number of turns replayed.
+int journal_replay(const char *path, const char *snapshot, size_t snapshot_size) {
+    SaveFile file;
+    if(!file.open(path)) {
+        return 0;
+    }
+    SaveReader r(file.data, file.data, file.data + file.size);
+    JournalHeader header = r.value<JournalHeader>();
+    if(!r.ok || header.magic != Journal_magic || header.version != Journal_version || header.snapshot_bytes != snapshot_size
+        || header.snapshot_checksum != checksum64(snapshot, snapshot_size)) {
+        return 0;
+    }
+    const char *strings = r.take(header.strings_bytes);
+    if(!strings || checksum64(strings, header.strings_bytes) != header.strings_checksum) {
+        return 0;
+    }
+
+    // the copy the worker wrote the snapshot from, strings end up next to the snapshot's
+    static JournalMirror mirror;
+    mirror.strings.arena = &save_arena;
+    mirror.strings.clear();
+    SaveReader s(file.data, strings, strings + header.strings_bytes);
+    uint32_t count = s.count(sizeof(uint32_t));
+    for(uint32_t i = 0; i < count && s.ok; i++) {
+        uint32_t length = s.value<uint32_t>();
+        if(const char *text = s.take(length)) {
+            mirror.strings.add(text, length);
+        }
+    }
+    if(!s.ok) {
+        return 0;
+    }
+    journal_gather(world, journal.gathered, mirror.strings);
+    size_t index = 0;
+    journal_arrays(world, game_map, journal.gathered, [&index](auto &array, JournalKey) {
+        if(index == mirror.arrays.size()) {
+            mirror.arrays.emplace_back();
+        }
+        mirror.arrays[index++].assign(journal_data(array), journal_data(array) + journal_size(array));
+    });
+    mirror.log = message_log;
+
+    int turns = 0;
+    while(r.p < r.end) {
+        uint32_t magic = r.value<uint32_t>();
+        uint32_t bytes = r.value<uint32_t>();
+        uint64_t checksum = r.value<uint64_t>();
+        const char *payload = r.take(bytes);
+        // a record the crash cut off ends the journal
+        if(!r.ok || magic != Journal_record_magic || checksum64(payload, bytes) != checksum) {
+            break;
+        }
+        SaveReader record(file.data, payload, payload + bytes);
+        if(!journal_apply(record, mirror)) {
+            return -1;
+        }
+        turns++;
+    }
+    if(turns == 0) {
+        return 0;
+    }
+
+    if(!journal_mirror_assign(mirror, world, game_map, journal.gathered, message_log)) {
+        return -1;
+    }
+    const SaveGame &game = mirror.scalars.game;
+    rng = game.rng;
+    game_turn = game.turn;
+    game_state = (GameState)game.state;
+    previous_game_state = (GameState)game.previous_state;
+    player = game.player;
+    targeting_item = game.targeting_item;
+    if(!save_world_valid()) {
+        return -1;
+    }
+    save_loaded();
+    return turns;
+}
+
+// The snapshot at `path`, and if a journal is given whatever turns it has on
+// top of that
+bool load_game(const char *path, const char *journal_path = NULL) {
+    SaveFile file;
+    if(!file.open(path)) {
+        return false;
+    }
+    if(!save_deserialize(file.data, file.size)) {
+        return false;
+    }
+    // a new snapshot of whatever this ends up being gets written on the next frame
+    journal.active = false;
+    if(journal_path && journal_replay(journal_path, file.data, file.size) < 0) {
+        engine_log(LogStatus::Warning, "Journal is damaged, continuing from the last snapshot");
+        return save_deserialize(file.data, file.size);
+    }
+    return true;
+}
+
+//// RECORDING
+// A game is its seed (or the save it was continued from) plus the inputs that
+// reached game_input, so that is all a recording keeps. `main replay` plays
+// one back headless and as fast as it goes, to chase a bug from a real game
+// or to time the turn pipeline on one.
+// Only frames that do something are kept: an input, together with how many
+// frames with work to do (enemy turn, events) and no input ran before it.
+// A frame with neither changes nothing. Every Replay_hash_turns turns there
+// is a keyframe with the state hash so a replay that goes its own way gets
+// caught, every Replay_snapshot_turns turns that keyframe has a snapshot of
+// the whole game to seek to.
+// The windowed game records every game to Replay_path, `main record` does it
+// with the bot.
+
+static const char *Replay_path = "lastgame.rec";
+static const uint32_t Replay_magic = 0x594c5052; // "RPLY"
+static const uint32_t Replay_version = 1;
+static const int Replay_hash_turns = 100;
+static const int Replay_snapshot_turns = 1000;
+
+uint32_t game_state_hash();
+
+enum ReplayChunk {
+    REPLAY_NEW_GAME = 1,
+    REPLAY_LOADED_GAME,
+    REPLAY_INPUT,
+    REPLAY_KEYFRAME
+};
+
+// The keys game_input looks at, by their index in here. libtcod and
+// headless.h don't number TCOD_keycode_t the same.
+static const TCOD_keycode_t Replay_keys[] = { TCODK_NONE, TCODK_ESCAPE, TCODK_ENTER, TCODK_UP, TCODK_DOWN, TCODK_LEFT,
+    TCODK_RIGHT, TCODK_PAGEUP, TCODK_PAGEDOWN, TCODK_END, TCODK_CHAR };
+static const int Replay_key_count = sizeof(Replay_keys) / sizeof(Replay_keys[0]);
+
+enum ReplayButtons {
+    REPLAY_LBUTTON = 1,
+    REPLAY_RBUTTON = 2,
+    REPLAY_WHEEL_UP = 4,
+    REPLAY_WHEEL_DOWN = 8,
+    REPLAY_LALT = 16
+};
+
+struct ReplayHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t map_width;
+    int32_t map_height;
+};
+
+struct ReplayNewGame {
+    uint64_t seed;
+    int32_t turn;
+    int32_t unused;
+};
+
+struct ReplayInput {
+    uint16_t work_frames;
+    uint8_t key;
+    char c;
+    uint8_t buttons;
+    uint8_t unused;
+    int16_t cx, cy;
+};
+
+struct ReplayKeyframe {
+    int32_t turn;
+    uint32_t input; // taken right before this input, after its work frames
+    uint32_t hash;
+    uint32_t snapshot_bytes; // 0 = hash only
+};
+
+// false if there is nothing in there game_input would notice
+bool replay_input_pack(const TCOD_key_t &key, const TCOD_mouse_t &mouse, ReplayInput &in) {
+    in = ReplayInput();
+    for(int i = 1; i < Replay_key_count; i++) {
+        if(key.vk == Replay_keys[i]) {
+            in.key = (uint8_t)i;
+        }
+    }
+    in.c = key.c;
+    in.buttons = (mouse.lbutton_pressed ? REPLAY_LBUTTON : 0) | (mouse.rbutton_pressed ? REPLAY_RBUTTON : 0)
+        | (mouse.wheel_up ? REPLAY_WHEEL_UP : 0) | (mouse.wheel_down ? REPLAY_WHEEL_DOWN : 0) | (key.lalt ? REPLAY_LALT : 0);
+    in.cx = (int16_t)mouse.cx;
+    in.cy = (int16_t)mouse.cy;
+    return in.key || in.c || (in.buttons & ~REPLAY_LALT);
+}
+
+void replay_input_unpack(const ReplayInput &in, TCOD_key_t &key, TCOD_mouse_t &mouse) {
+    key = TCOD_key_t();
+    mouse = TCOD_mouse_t();
+    key.vk = Replay_keys[in.key < Replay_key_count ? in.key : 0];
+    key.c = in.c;
+    key.pressed = true;
+    key.lalt = (in.buttons & REPLAY_LALT) != 0;
+    mouse.lbutton_pressed = (in.buttons & REPLAY_LBUTTON) != 0;
+    mouse.rbutton_pressed = (in.buttons & REPLAY_RBUTTON) != 0;
+    mouse.wheel_up = (in.buttons & REPLAY_WHEEL_UP) != 0;
+    mouse.wheel_down = (in.buttons & REPLAY_WHEEL_DOWN) != 0;
+    mouse.cx = in.cx;
+    mouse.cy = in.cy;
+}
+
+struct Recorder {
+    FILE *file = NULL;
+    size_t bytes = 0;
+    uint32_t inputs = 0;
+    int work_frames = 0;
+    int next_hash_turn = 0;
+    int next_snapshot_turn = 0;
+    SaveWriter snapshot;
+} recorder;
+
+void recorder_write(const void *data, size_t size) {
+    fwrite(data, 1, size, recorder.file);
+    recorder.bytes += size;
+}
+
+void recorder_chunk(uint8_t tag, const void *data, size_t size) {
+    recorder_write(&tag, 1);
+    recorder_write(data, size);
+}
+
+// Saves go in at 8 byte offsets, the load reads them in place
+void recorder_snapshot(uint32_t bytes) {
+    static const char zeros[8] = {};
+    recorder_write(zeros, ((recorder.bytes + 7) & ~(size_t)7) - recorder.bytes);
+    recorder_write(recorder.snapshot.data.data(), bytes);
+}
+
+bool recorder_start(const char *path) {
+    recorder.file = fopen(path, "wb");
+    if(!recorder.file) {
+        engine_log(LogStatus::Error, std::string("Could not record to ") + path);
+        return false;
+    }
+    ReplayHeader header = { Replay_magic, Replay_version, Map_Width, Map_Height };
+    recorder.bytes = 0;
+    recorder_write(&header, sizeof(header));
+    recorder.inputs = 0;
+    return true;
+}
+
+void recorder_stop() {
+    if(recorder.file) {
+        fclose(recorder.file);
+        recorder.file = NULL;
+    }
+}
+
+void recorder_game_started() {
+    recorder.work_frames = 0;
+    recorder.next_hash_turn = game_turn + Replay_hash_turns;
+    recorder.next_snapshot_turn = game_turn + Replay_snapshot_turns;
+}
+
+// Right after new_game(seed)
+void recorder_new_game(uint64_t seed) {
+    if(!recorder.file) {
+        return;
+    }
+    ReplayNewGame chunk = { seed, game_turn, 0 };
+    recorder_chunk(REPLAY_NEW_GAME, &chunk, sizeof(chunk));
+    recorder_game_started();
+}
+
+// Right after a load, the game it came from is in the recording as a whole
+void recorder_loaded_game() {
+    if(!recorder.file) {
+        return;
+    }
+    save_serialize(recorder.snapshot);
+    uint32_t bytes = (uint32_t)recorder.snapshot.data.size();
+    recorder_chunk(REPLAY_LOADED_GAME, &bytes, sizeof(bytes));
+    recorder_snapshot(bytes);
+    recorder_game_started();
+}
+
+// Every frame with whatever input it got, before game_input sees it. `work` is
+// game_has_work() at the start of the frame.
+void recorder_frame(const TCOD_key_t &key, const TCOD_mouse_t &mouse, bool work) {
+    if(!recorder.file || game_state == MAIN_MENU) {
+        return;
+    }
+    ReplayInput in;
+    if(!replay_input_pack(key, mouse, in)) {
+        // an empty input is a work frame on replay, so one of those keeps the count in range
+        if(work && ++recorder.work_frames == 0xffff) {
+            in.work_frames = 0xfffe;
+            recorder_chunk(REPLAY_INPUT, &in, sizeof(in));
+            recorder.inputs++;
+            recorder.work_frames = 0;
+        }
+        return;
+    }
+    if(game_turn >= recorder.next_hash_turn) {
+        ReplayKeyframe keyframe = { game_turn, recorder.inputs, game_state_hash(), 0 };
+        bool snapshot = game_turn >= recorder.next_snapshot_turn;
+        if(snapshot) {
+            save_serialize(recorder.snapshot);
+            keyframe.snapshot_bytes = (uint32_t)recorder.snapshot.data.size();
+            recorder.next_snapshot_turn = game_turn + Replay_snapshot_turns;
+        }
+        recorder_chunk(REPLAY_KEYFRAME, &keyframe, sizeof(keyframe));
+        if(snapshot) {
+            recorder_snapshot(keyframe.snapshot_bytes);
+        }
+        recorder.next_hash_turn = game_turn + Replay_hash_turns;
+    }
+    in.work_frames = (uint16_t)recorder.work_frames;
+    recorder_chunk(REPLAY_INPUT, &in, sizeof(in));
+    recorder.inputs++;
+    recorder.work_frames = 0;
+    // people press keys a few times a second, the game crashing shouldn't lose them
+    fflush(recorder.file);
+}
+
+//// AI POOL
+// The enemy turn is split in two. Deciding (Ai::decide) is read only so with
+// enough ais it's spread over worker threads in chunks. Acting stays on the
+// main thread in dense array order, so with the same seed the outcome is the
+// same as running the ais one after the other, whatever the thread count.
+// Same long lived worker setup as the floor pregen.
+#include <atomic>
+
+static const size_t Ai_parallel_min = 256; // below that waking workers costs more than it saves
+static const size_t Ai_chunk = 64;
+
+std::vector<AiIntent> ai_intents;
+int ai_threads = 0; // 0 = one per core
+
+struct AiPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    unsigned job = 0;
+    int busy = 0;
+    bool quit = false;
+    bool started = false;
+    std::atomic<size_t> next_chunk { 0 };
+    Entity target;
+    const GameMap *map = NULL;
+
+    ~AiPool() {
+        stop();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for(auto &w : workers) {
+            w.join();
+        }
+        workers.clear();
+        quit = false;
+        started = false;
+    }
+} ai_pool;
+
+void ai_decide_chunks() {
+    size_t count = world.ais.size();
+    while(true) {
+        size_t begin = ai_pool.next_chunk.fetch_add(Ai_chunk);
+        if(begin >= count) {
+            return;
+        }
+        size_t end = std::min(count, begin + Ai_chunk);
+        for(size_t i = begin; i < end; i++) {
+            auto &ai = world.ais.dense[i];
+            ai_intents[i] = world.has(ai._owner, TAG_MARKED_FOR_DELETION) ? AiIntent() : ai.decide(ai_pool.target, *ai_pool.map);
+        }
+    }
+}
+
+// seen = the last job before this worker existed
+void ai_pool_worker(unsigned seen) {
+    std::unique_lock<std::mutex> lock(ai_pool.mutex);
+    while(true) {
+        ai_pool.wake.wait(lock, [&seen] { return ai_pool.job != seen || ai_pool.quit; });
+        if(ai_pool.quit) {
+            return;
+        }
+        seen = ai_pool.job;
+        lock.unlock();
+        ai_decide_chunks();
+        lock.lock();
+        if(--ai_pool.busy == 0) {
+            ai_pool.done.notify_one();
+        }
+    }
+}
+
+// ai_threads threads including the main one
+void ai_pool_start() {
+    int threads = ai_threads > 0 ? ai_threads : (int)std::thread::hardware_concurrency();
+    for(int i = 1; i < threads; i++) {
+        ai_pool.workers.push_back(std::thread(ai_pool_worker, ai_pool.job));
+    }
+    ai_pool.started = true;
+}
+
+// Fills ai_intents, one per ai in the dense array
+void ai_decide_all(Entity target, const GameMap &map) {
+    ai_intents.resize(world.ais.size());
+    if(!ai_pool.started) {
+        ai_pool_start();
+    }
+    ai_pool.target = target;
+    ai_pool.map = &map;
+    ai_pool.next_chunk = 0;
+    if(world.ais.size() < Ai_parallel_min || ai_pool.workers.empty()) {
+        ai_decide_chunks();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(ai_pool.mutex);
+        ai_pool.busy = (int)ai_pool.workers.size();
+        ai_pool.job++;
+    }
+    ai_pool.wake.notify_all();
+    // the main thread takes chunks too
+    ai_decide_chunks();
+    std::unique_lock<std::mutex> lock(ai_pool.mutex);
+    ai_pool.done.wait(lock, [] { return ai_pool.busy == 0; });
+}
+
+// cells an ai moved out of or into this turn, == ai_touch_stamp
+unsigned ai_touched[Map_Width * Map_Height];
+unsigned ai_touch_stamp = 0;
+
+bool ai_touched_near(int x, int y) {
+    for(int cy = std::max(0, y - 1); cy <= std::min(Map_Height - 1, y + 1); cy++) {
+        for(int cx = std::max(0, x - 1); cx <= std::min(Map_Width - 1, x + 1); cx++) {
+            if(ai_touched[map_index(cx, cy)] == ai_touch_stamp) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Decide for everyone against the start of the turn, then act in order. A
+// decision is only as good as what it looked at: moves look at the 3x3 around
+// the ai, so if an earlier ai moved in or out of there it decides again on the
+// spot; attacks only need the target still alive. That's exactly what running
+// them one by one would have done.
+// Dead ones are still in the dense array until the event pass.
+void enemy_turn(Entity target, GameMap &map, Rng &rng) {
+    // the flow only gets computed if someone is going to follow it
+    for(size_t i = 0; i < world.ais.size(); i++) {
+        auto &ai = world.ais.dense[i];
+        if(!world.has(ai._owner, TAG_MARKED_FOR_DELETION) && ai.chases(target, map)) {
+            auto target_position = world.positions.get(target);
+            map_flow_update(player_flow, map, target_position->x, target_position->y);
+            break;
+        }
+    }
+
+    ai_decide_all(target, map);
+
+    if(++ai_touch_stamp == 0) {
+        std::fill(ai_touched, ai_touched + Map_Width * Map_Height, 0u);
+        ai_touch_stamp = 1;
+    }
+    for(size_t i = 0; i < world.ais.size(); i++) {
+        auto &ai = world.ais.dense[i];
+        if(world.has(ai._owner, TAG_MARKED_FOR_DELETION)) {
+            continue;
+        }
+        auto position = world.positions.get(ai._owner);
+        int x = position->x, y = position->y;
+        AiIntent intent = ai_intents[i];
+        if((intent.type == AI_MOVE || intent.type == AI_BLOCKED) && ai_touched_near(x, y)) {
+            intent = ai.decide(target, map);
+        } else if(intent.type == AI_ATTACK && world.fighters.get(target)->hp <= 0) {
+            intent.type = AI_IDLE;
+        }
+        ai.act(intent, target, map, rng);
+        if(position->x != x || position->y != y) {
+            ai_touched[map_index(x, y)] = ai_touch_stamp;
+            ai_touched[map_index(position->x, position->y)] = ai_touch_stamp;
+        }
+    }
+}
+
+//// BENCHMARKS
+// main.exe bench [max_monsters] [turns]
+// Fills an open floor with monsters and times the enemy turn, no console needed.
+#include <chrono>
+
+// positions_hash gets the fnv hash of where everyone ended up
+double bench_enemy_turn(int monster_count, int turns, uint32_t *positions_hash) {
+    static GameMap bench_map;
+    bench_map.walkable.fill();
+    bench_map.transparent.fill();
+
+    Entity target = entity_spawn(Map_Width / 2, Map_Height / 2, '@', TCODColor::white, "Player", true, render_priority.ENTITY);
+    world.add(world.fighters, target, Fighter(target, 1 << 30, 1000, 0));
+    // whole map in view, every monster gets to act
+    bench_map.visible.fill();
+    player_flow.dirty = true;
+
+    int spawned = 0;
+    for(int i = 0; i < Map_Width * Map_Height && spawned < monster_count; i++) {
+        int x = i % Map_Width, y = i / Map_Width;
+        if(x == Map_Width / 2 && y == Map_Height / 2) {
+            continue;
+        }
+        auto &m = monster_data[spawned % monster_data.size()];
+        Entity e = entity_spawn(x, y, m.visual, m.color, m.name.c_str(), true, render_priority.ENTITY);
+        world.add(world.fighters, e, Fighter(e, m.hp, m.defense, m.power, m.xp));
+        world.add(world.ais, e, Ai(e, BASIC_MONSTER));
+        spawned++;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for(int t = 0; t < turns; t++) {
+        enemy_turn(target, bench_map, rng.ai);
+        events_clear();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    uint32_t hash = 2166136261u;
+    for(auto &p : world.positions.dense) {
+        hash = (hash ^ (uint32_t)map_index(p.x, p.y)) * 16777619u;
+    }
+    *positions_hash = hash;
+
+    std::vector<Entity> to_destroy = world.positions.owners;
+    for(auto &e : to_destroy) {
+        world.destroy(e);
+    }
+
+    return std::chrono::duration<double, std::micro>(end - start).count() / turns;
+}
+
+// main.exe bench [max_monsters] [turns] [threads]
+// Every size runs once on one thread and once on the ai pool (threads 0 = one
+// per core) from the same seed, the two have to end up in the same place.
+int bench_run(int argc, char *argv[]) {
+    int max_monsters = argc > 2 ? atoi(argv[2]) : Map_Width * Map_Height - 1;
+    int turns = argc > 3 ? atoi(argv[3]) : 100;
+    int threads = argc > 4 ? atoi(argv[4]) : 0;
+    int pool_threads = threads > 0 ? threads : (int)std::thread::hardware_concurrency();
+    printf("%d threads\n", pool_threads);
+    printf("%10s %16s %16s %16s %10s\n", "monsters", "serial us/turn", "ns/monster", "pool us/turn", "speedup");
+    bool same = true;
+    for(int n = 250; n <= max_monsters; n *= 2) {
+        uint32_t serial_hash, pool_hash;
+        ai_pool.stop();
+        ai_threads = 1;
+        rng_seed_game(1);
+        double serial = bench_enemy_turn(n, turns, &serial_hash);
+        ai_pool.stop();
+        ai_threads = threads;
+        rng_seed_game(1);
+        double pooled = bench_enemy_turn(n, turns, &pool_hash);
+        printf("%10d %16.2f %16.2f %16.2f %9.2fx%s\n", n, serial, serial * 1000.0 / n, pooled, serial / pooled,
+            serial_hash == pool_hash ? "" : "  MISMATCH");
+        same = same && serial_hash == pool_hash;
+    }
+    return same ? 0 : 1;
+}
+
+// main.exe tilebench [reps]
+// Bulk tile ops on bit planes against the old struct of bools per tile, on the
+// real map size and on a big one.
+
+struct TileBools {
+    bool blocked = true;
+    bool block_sight = true;
+    bool explored = false;
+};
+
+template<typename F>
+double bench_ns(int reps, F fn) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for(int rep = 0; rep < reps; rep++) {
+        fn(rep);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count() / reps;
+}
+
+template<int W, int H>
+void bench_tiles(int reps) {
+    const int N = W * H;
+    static TileBools tiles[N];
+    static bool visible[N], occupied[N], mask[N];
+    static BitPlane<W, H> walkable, transparent, explored, visible_bits, occupied_bits, mask_bits;
+
+    Rng r;
+    rng_seed(r, 7);
+    for(int i = 0; i < N; i++) {
+        tiles[i].blocked = rand_int(r, 0, 2) == 0;
+        visible[i] = rand_int(r, 0, 3) == 0;
+        occupied[i] = rand_int(r, 0, 20) == 0;
+        if(!tiles[i].blocked) walkable.set(i % W, i / W);
+        if(visible[i]) visible_bits.set(i % W, i / W);
+        if(occupied[i]) occupied_bits.set(i % W, i / W);
+    }
+    // flips one cell per rep so nothing gets hoisted out of the loop
+    auto flip = [&](int rep) {
+        int i = rep % N;
+        visible[i] = !visible[i];
+        if(visible[i]) visible_bits.set(i % W, i / W); else visible_bits.reset(i % W, i / W);
+    };
+    volatile long sink = 0;
+
+    printf("%dx%d, %d bytes per tile array, %d bytes per plane\n", W, H, (int)sizeof(tiles), (int)sizeof(walkable));
+    printf("  %-22s %12s %12s\n", "ns/op", "struct", "bit planes");
+
+    double a = bench_ns(reps, [&](int rep) {
+        for(int i = 0; i < N; i++) tiles[i] = TileBools();
+        sink += tiles[rep % N].explored;
+    });
+    double b = bench_ns(reps, [&](int rep) {
+        walkable.clear();
+        transparent.clear();
+        explored.clear();
+        visible_bits.clear();
+        sink += explored.words[rep % explored.Words];
+    });
+    printf("  %-22s %12.1f %12.1f\n", "reset", a, b);
+
+    a = bench_ns(reps, [&](int rep) {
+        flip(rep);
+        for(int i = 0; i < N; i++) if(visible[i]) tiles[i].explored = true;
+        sink += tiles[rep % N].explored;
+    });
+    b = bench_ns(reps, [&](int rep) {
+        flip(rep);
+        explored.unite(visible_bits);
+        sink += explored.words[rep % explored.Words];
+    });
+    printf("  %-22s %12.1f %12.1f\n", "explored |= visible", a, b);
+
+    a = bench_ns(reps, [&](int rep) {
+        occupied[rep % N] = !occupied[rep % N];
+        for(int i = 0; i < N; i++) mask[i] = !tiles[i].blocked && !occupied[i];
+        sink += mask[rep % N];
+    });
+    b = bench_ns(reps, [&](int rep) {
+        occupied_bits.words[rep % occupied_bits.Words] ^= 1;
+        mask_bits = walkable;
+        mask_bits.subtract(occupied_bits);
+        sink += mask_bits.words[rep % mask_bits.Words];
+    });
+    printf("  %-22s %12.1f %12.1f\n", "walkable & ~occupied", a, b);
+
+    a = bench_ns(reps, [&](int rep) {
+        flip(rep);
+        int n = 0;
+        for(int i = 0; i < N; i++) n += visible[i];
+        sink += n;
+    });
+    b = bench_ns(reps, [&](int rep) {
+        flip(rep);
+        sink += visible_bits.count();
+    });
+    printf("  %-22s %12.1f %12.1f\n", "count", a, b);
+
+    a = bench_ns(reps, [&](int rep) {
+        flip(rep);
+        long s = 0;
+        for(int y = 0; y < H; y++) for(int x = 0; x < W; x++) if(occupied[x + y * W]) s += x;
+        sink += s;
+    });
+    b = bench_ns(reps, [&](int rep) {
+        flip(rep);
+        long s = 0;
+        for(int y = 0; y < H; y++) for(int x = occupied_bits.next_set(y, 0); x < W; x = occupied_bits.next_set(y, x + 1)) s += x;
+        sink += s;
+    });
+    printf("  %-22s %12.1f %12.1f\n", "row scan (5% set)", a, b);
+}
+
+int tile_bench_run(int argc, char *argv[]) {
+    int reps = argc > 2 ? atoi(argv[2]) : 2000;
+    bench_tiles<Map_Width, Map_Height>(reps * 20);
+    bench_tiles<1024, 1024>(std::max(1, reps / 10));
+    return 0;
+}
+
+// main.exe fovbench [reps]
+// Both fov algorithms against TCODMap::computeFov (FOV_BASIC) on a generated
+// floor and on big open maps with pillars, across radii. Cells lit is there to
+// see the algorithms agree roughly on what's visible.
+
+template<int W, int H>
+void bench_fov(const BitPlane<W, H> &transparent, int x, int y, int reps) {
+    static BitPlane<W, H> visible;
+    TCODMap tcod_map(W, H);
+    for(int cy = 0; cy < H; cy++) {
+        for(int cx = 0; cx < W; cx++) {
+            tcod_map.setProperties(cx, cy, transparent.get(cx, cy), true);
+        }
+    }
+
+    static const int radii[] = { 4, 10, 20, 0 };
+    for(int radius : radii) {
+        double shadow_us = bench_ns(reps, [&](int) {
+            fov_compute(transparent, visible, x, y, radius, fov_light_walls, FOV_SHADOWCAST);
+        }) / 1000.0;
+        int shadow_lit = visible.count();
+        double rays_us = bench_ns(reps, [&](int) {
+            fov_compute(transparent, visible, x, y, radius, fov_light_walls, FOV_RAYS);
+        }) / 1000.0;
+        int rays_lit = visible.count();
+        double tcod_us = bench_ns(reps, [&](int) {
+            tcod_map.computeFov(x, y, radius, fov_light_walls, FOV_BASIC);
+        }) / 1000.0;
+        int tcod_lit = 0;
+        for(int cy = 0; cy < H; cy++) {
+            for(int cx = 0; cx < W; cx++) {
+                tcod_lit += tcod_map.isInFov(cx, cy);
+            }
+        }
+        printf("%5dx%-5d %6d %12.2f %12.2f %12.2f %8d %8d %8d\n", W, H, radius, shadow_us, rays_us, tcod_us, shadow_lit, rays_lit, tcod_lit);
+    }
+}
+
+// open map with ~15% pillars, origin in the middle
+template<int W, int H>
+void bench_fov_pillars(int reps) {
+    static BitPlane<W, H> transparent;
+    Rng r;
+    rng_seed(r, 11);
+    transparent.fill();
+    for(int y = 0; y < H; y++) {
+        for(int x = 0; x < W; x++) {
+            if(rand_int(r, 0, 99) < 15 && (x != W / 2 || y != H / 2)) {
+                transparent.reset(x, y);
+            }
+        }
+    }
+    bench_fov(transparent, W / 2, H / 2, reps);
+}
+
+int fov_bench_run(int argc, char *argv[]) {
+    int reps = argc > 2 ? atoi(argv[2]) : 2000;
+    static FloorPlan plan;
+    floor_plan_generate(plan, 1, 1);
+
+    printf("%11s %6s %12s %12s %12s %8s %8s %8s\n", "map", "radius", "shadow us", "rays us", "tcod us", "lit", "lit", "lit");
+    bench_fov(plan.map.transparent, plan.start_x, plan.start_y, reps);
+    bench_fov_pillars<80, 43>(reps);
+    bench_fov_pillars<256, 256>(std::max(1, reps / 10));
+    bench_fov_pillars<1024, 1024>(std::max(1, reps / 100));
+    return 0;
+}
+
+// main.exe flowbench [turns]
+// Monsters chasing a goal that moves every turn on a 512x512 map with pillars.
+// Flow field: one field per turn plus a lookup per monster. Against an A* per
+// monster (Chebyshev heuristic, ties to the lower h), timed on a sample of
+// monsters and scaled up.
+
+static const int Flow_bench_size = 512;
+typedef FlowField<Flow_bench_size, Flow_bench_size> BenchFlow;
+typedef BitPlane<Flow_bench_size, Flow_bench_size> BenchBits;
+
+struct BenchSearch {
+    std::vector<unsigned> seen;   // == stamp: g is valid for this search
+    std::vector<int> g;
+    std::vector<std::pair<int, int>> heap; // (-(f * 1024 + h), cell)
+    unsigned stamp = 0;
+};
+
+// steps from `from` to `to`, -1 if there is no way
+int bench_astar(const BenchBits &walkable, BenchSearch &s, int from, int to) {
+    const int W = Flow_bench_size;
+    int tx = to % W, ty = to / W;
+    auto h = [&](int c) {
+        return std::max(abs(c % W - tx), abs(c / W - ty));
+    };
+    s.stamp++;
+    s.heap.clear();
+    s.seen[from] = s.stamp;
+    s.g[from] = 0;
+    s.heap.push_back({ -(h(from) * 1024 + h(from)), from });
+    while(!s.heap.empty()) {
+        std::pop_heap(s.heap.begin(), s.heap.end());
+        int c = s.heap.back().second;
+        int key = -s.heap.back().first;
+        s.heap.pop_back();
+        if(c == to) {
+            return s.g[c];
+        }
+        if(key / 1024 > s.g[c] + h(c)) {
+            continue; // stale
+        }
+        int x = c % W, y = c / W;
+        for(auto &d : flow_dirs) {
+            int nx = x + d[0], ny = y + d[1];
+            if(nx < 0 || ny < 0 || nx >= W || ny >= W || !walkable.get(nx, ny)) {
+                continue;
+            }
+            int n = nx + ny * W;
+            int ng = s.g[c] + 1;
+            if(s.seen[n] != s.stamp || ng < s.g[n]) {
+                s.seen[n] = s.stamp;
+                s.g[n] = ng;
+                s.heap.push_back({ -((ng + h(n)) * 1024 + h(n)), n });
+                std::push_heap(s.heap.begin(), s.heap.end());
+            }
+        }
+    }
+    return -1;
+}
+
+int flow_bench_run(int argc, char *argv[]) {
+    const int W = Flow_bench_size;
+    int turns = argc > 2 ? atoi(argv[2]) : 20;
+    static BenchBits walkable, occupied;
+    static BenchFlow toward, flee;
+    Rng r;
+    rng_seed(r, 5);
+    walkable.fill();
+    for(int i = 0; i < W * W; i++) {
+        if(rand_int(r, 0, 99) < 15) {
+            walkable.reset(i % W, i / W);
+        }
+    }
+    walkable.set(W / 2, W / 2);
+    toward.set_terrain(walkable);
+
+    // the variants on their own
+    int goals[16];
+    for(int i = 0; i < 16; i++) {
+        goals[i] = toward.cell(rand_int(r, 0, W - 1), rand_int(r, 0, W - 1));
+    }
+    int center = toward.cell(W / 2, W / 2);
+    double single_us = bench_ns(turns, [&](int) { flow_to(toward, &center, 1); }) / 1000.0;
+    double flee_us = bench_ns(turns, [&](int) { flow_flee(flee, toward); }) / 1000.0;
+    double multi_us = bench_ns(turns, [&](int) { flow_to(toward, goals, 16); }) / 1000.0;
+    printf("%dx%d, %d walkable\n", W, W, walkable.count());
+    printf("  field to 1 goal %.0f us, to 16 goals %.0f us, flee %.0f us\n", single_us, multi_us, flee_us);
+
+    printf("%10s %12s %12s %12s %16s\n", "monsters", "field us", "steps us", "ns/monster", "A* all us");
+    std::vector<int> monsters;
+    BenchSearch search;
+    search.seen.assign(W * W, 0);
+    search.g.assign(W * W, 0);
+    static const int counts[] = { 1000, 2000, 5000, 10000, 20000, 50000 };
+    for(int count : counts) {
+        occupied.clear();
+        monsters.clear();
+        int goal_x = W / 2, goal_y = W / 2;
+        occupied.set(goal_x, goal_y);
+        while((int)monsters.size() < count) {
+            int x = rand_int(r, 0, W - 1), y = rand_int(r, 0, W - 1);
+            if(walkable.get(x, y) && !occupied.get(x, y)) {
+                occupied.set(x, y);
+                monsters.push_back(x + y * W);
+            }
+        }
+        auto can_enter = [](int x, int y) {
+            return !occupied.get(x, y);
+        };
+
+        double field_us = 0, steps_us = 0;
+        for(int t = 0; t < turns; t++) {
+            // goal wanders
+            const int *d = flow_dirs[rand_int(r, 0, 7)];
+            if(walkable.get(goal_x + d[0], goal_y + d[1]) && !occupied.get(goal_x + d[0], goal_y + d[1])) {
+                occupied.reset(goal_x, goal_y);
+                goal_x += d[0];
+                goal_y += d[1];
+                occupied.set(goal_x, goal_y);
+            }
+            int goal = toward.cell(goal_x, goal_y);
+            field_us += bench_ns(1, [&](int) { flow_to(toward, &goal, 1); }) / 1000.0;
+            steps_us += bench_ns(1, [&](int) {
+                for(int &m : monsters) {
+                    int x = m % W, y = m / W, nx, ny;
+                    if(flow_next_step(toward, x, y, nx, ny, can_enter)) {
+                        occupied.reset(x, y);
+                        occupied.set(nx, ny);
+                        m = nx + ny * W;
+                    }
+                }
+            }) / 1000.0;
+        }
+
+        int sample = std::min(count, 50);
+        int goal = goal_x + goal_y * W;
+        double search_us = bench_ns(sample, [&](int i) {
+            bench_astar(walkable, search, monsters[i * (count / sample)], goal);
+        }) / 1000.0;
+        printf("%10d %12.1f %12.1f %12.1f %16.0f\n", count, field_us / turns, steps_us / turns, steps_us * 1000.0 / turns / count, search_us * count);
+    }
+    return 0;
+}
+
+// main.exe spawnbench [blueprints]
+// Picking what to spawn: the old way (weights for the level worked out again
+// and summed up for every spawn) against the per level alias tables, for the
+// game's own blueprints and made up lists of more. Also checks the tables come
+// up with each blueprint as often as its weight says, nested tables included.
+struct BenchBlueprint {
+    std::vector<WeightByLevel> weights;
+};
+
+double spawn_bench_old(const std::vector<BenchBlueprint> &blueprints, int level, int reps) {
+    static std::vector<int> chances;
+    Rng r;
+    rng_seed(r, 3);
+    volatile int sink = 0;
+    return bench_ns(reps, [&](int) {
+        chances.clear();
+        for(auto &b : blueprints) {
+            int chance = from_dungeon_level(b.weights, level);
+            if(chance > 0) {
+                chances.push_back(chance);
+            }
+        }
+        sink += rand_weighted_index(r, chances.data(), (int)chances.size());
+    });
+}
+
+double spawn_bench_alias(const SpawnTable &table, int reps) {
+    Rng r;
+    rng_seed(r, 3);
+    volatile int sink = 0;
+    return bench_ns(reps, [&](int) {
+        sink += spawn_table_pick(table, r);
+    });
+}
+
+// largest difference between the chance the table gives an outcome and its
+// weight, in % of the weight. Worked out from the columns, no picking.
+double spawn_exact_error(const SpawnTable &table, const std::vector<double> &expected) {
+    std::vector<double> chance(expected.size());
+    const double n = (double)table.keep.size();
+    for(size_t c = 0; c < table.keep.size(); c++) {
+        double keep = table.keep[c] / 4294967296.0;
+        chance[table.outcomes[c]] += keep / n;
+        chance[table.outcomes[table.alias[c]]] += (1.0 - keep) / n;
+    }
+    double worst = 0;
+    for(size_t i = 0; i < expected.size(); i++) {
+        worst = std::max(worst, expected[i] > 0 ? fabs(chance[i] - expected[i]) / expected[i] * 100.0 : chance[i] * 100.0);
+    }
+    return worst;
+}
+
+// same from picking `picks` times, nested tables too
+double spawn_check(const SpawnTable &table, const std::vector<double> &expected, int picks) {
+    std::vector<int> counts(expected.size());
+    Rng r;
+    rng_seed(r, 11);
+    for(int i = 0; i < picks; i++) {
+        int outcome = spawn_table_pick(table, r);
+        if(outcome < 0 || outcome >= (int)counts.size()) {
+            return 100.0;
+        }
+        counts[outcome]++;
+    }
+    double worst = 0;
+    for(size_t i = 0; i < expected.size(); i++) {
+        if(expected[i] > 0) {
+            worst = std::max(worst, fabs(counts[i] / (double)picks - expected[i]) / expected[i] * 100.0);
+        } else if(counts[i]) {
+            return 100.0;
+        }
+    }
+    return worst;
+}
+
+int spawn_bench_run(int argc, char *argv[]) {
+    int most = argc > 2 ? atoi(argv[2]) : 1000;
+    const int reps = 1000000;
+    printf("  %-28s %12s %12s\n", "ns/spawn", "old", "alias");
+
+    std::vector<BenchBlueprint> game;
+    for(auto &m : monster_data) {
+        game.push_back({ m.weights });
+    }
+    printf("  %-28s %12.1f %12.1f\n", "monsters, level 5", spawn_bench_old(game, 5, reps), spawn_bench_alias(monster_spawns.at(5), reps));
+    game.clear();
+    for(auto &item : item_data) {
+        game.push_back({ item.weights });
+    }
+    printf("  %-28s %12.1f %12.1f\n", "items, level 8", spawn_bench_old(game, 8, reps), spawn_bench_alias(item_spawns.at(8), reps));
+
+    // every game table gives each blueprint its own weight, the old code
+    // handed out the wrong items once one with no chance came before them
+    bool ok = true;
+    for(int level = 1; level <= 12; level++) {
+        auto check = [level, &ok](const SpawnLevels &spawns, const std::vector<std::vector<WeightByLevel>> &weights) {
+            std::vector<double> expected;
+            double total = 0;
+            for(auto &w : weights) {
+                expected.push_back(from_dungeon_level(w, level));
+                total += expected.back();
+            }
+            for(auto &e : expected) {
+                e /= total;
+            }
+            ok = ok && spawn_exact_error(spawns.at(level), expected) < 0.001;
+        };
+        std::vector<std::vector<WeightByLevel>> weights;
+        for(auto &m : monster_data) {
+            weights.push_back(m.weights);
+        }
+        check(monster_spawns, weights);
+        weights.clear();
+        for(auto &item : item_data) {
+            weights.push_back(item.weights);
+        }
+        check(item_spawns, weights);
+    }
+    printf("  game tables match the blueprint weights on levels 1-12: %s\n", ok ? "yes" : "NO");
+
+    // blueprints that come in at different levels, like the real ones
+    Rng r;
+    rng_seed(r, 5);
+    for(int count = 10; count <= most; count *= 10) {
+        std::vector<BenchBlueprint> blueprints(count);
+        for(auto &b : blueprints) {
+            b.weights.push_back({ rand_int(r, 1, 100), rand_int(r, 1, 10) });
+            b.weights.push_back({ rand_int(r, 0, 100), rand_int(r, 11, 20) });
+        }
+        SpawnLevels levels = spawn_levels_build(blueprints);
+        const SpawnTable &table = levels.at(12);
+        char label[64];
+        snprintf(label, sizeof(label), "%d blueprints, level 12", count);
+        printf("  %-28s %12.1f %12.1f", label, spawn_bench_old(blueprints, 12, reps / 10), spawn_bench_alias(table, reps));
+
+        std::vector<double> expected(count);
+        double total = 0;
+        for(int i = 0; i < count; i++) {
+            total += expected[i] = from_dungeon_level(blueprints[i].weights, 12);
+        }
+        for(auto &e : expected) {
+            e /= total;
+        }
+        double worst = spawn_exact_error(table, expected);
+        printf(", chances within %.1e%%\n", worst);
+        ok = ok && worst < 0.001;
+    }
+
+    // a table of tables: 1 in 4 an item from `rare`, otherwise one from `common`
+    SpawnTable common, rare, loot;
+    spawn_table_build(common, { { 3, 0 }, { 1, 1 } });
+    spawn_table_build(rare, { { 1, 2 }, { 1, 3 }, { 0, 4 } });
+    std::vector<SpawnWeight> tables = { { 3, 0, &common }, { 1, 0, &rare } };
+    spawn_table_build(loot, tables);
+    double worst = spawn_check(loot, { 0.5625, 0.1875, 0.125, 0.125, 0.0 }, 1000000);
+    printf("  %-28s %12s %12.1f, 1M picks within %.1f%%\n", "nested tables", "", spawn_bench_alias(loot, reps), worst);
+    ok = ok && worst < 1.0;
+    return ok ? 0 : 1;
+}
+
+// main.exe itembench [items]
+// Spawning items the way floors do, twice: the first round grows the world's
+// arrays, the second reuses them and shouldn't touch the heap at all.
+int item_bench_run(int argc, char *argv[]) {
+    int items = argc > 2 ? atoi(argv[2]) : 100000;
+    game_reset();
+    printf("sizeof(Item) %d, trivially copyable: %s\n", (int)sizeof(Item), std::is_trivially_copyable<Item>::value ? "yes" : "no");
+    for(int round = 0; round < 2; round++) {
+        AllocStats before = alloc_stats;
+        double spawn = bench_ns(items, [](int i) {
+            item_spawn(i % (int)item_data.size(), 1 + i % (Map_Width - 2), 1 + (i / (Map_Width - 2)) % (Map_Height - 2));
+        });
+        uint64_t allocs = alloc_stats.count - before.count;
+        int usable = 0;
+        for(auto &item : world.items.dense) {
+            usable += item_effects[item.effect].use != NULL;
+        }
+        printf("  round %d: %d items (%d usable), %6.1f ns/item, %llu allocations\n", round + 1, (int)world.items.size(), usable, spawn,
+            (unsigned long long)allocs);
+        while(world.items.size()) {
+            world.destroy(world.items.owners.back());
+        }
+    }
+    game_reset();
+    return 0;
+}
+
+// what attacks paid before the cache, every modifier walked on every read
+int stat_bench_walk(Entity e, Stat stat) {
+    int bonus = 0;
+    auto modifiers = world.modifiers.get(e);
+    for(int i = 0; i < modifiers->count; i++) {
+        if(modifiers->list[i].stat == stat) {
+            bonus += modifiers->list[i].amount;
+        }
+    }
+    return bonus;
+}
+
+// main.exe statbench [reps]
+// Attack damage with a growing modifier stack: summing the stack per attack
+// against reading Fighter::bonus. Then churns equipment and timed buffs and
+// checks the cache still matches a full walk.
+int stat_bench_run(int argc, char *argv[]) {
+    int reps = argc > 2 ? atoi(argv[2]) : 10000000;
+    game_reset();
+    Entity attacker = world.create();
+    Entity target = world.create();
+    world.add(world.fighters, attacker, Fighter(attacker, 100, 1, 2));
+    world.add(world.fighters, target, Fighter(target, 100, 1, 2));
+    world.add(world.equipments, attacker, Equipment(attacker));
+    world.add(world.modifiers, attacker, Modifiers());
+
+    Rng r;
+    rng_seed(r, 9);
+    bool ok = true;
+    auto matches = [&](Entity e) {
+        auto fighter = world.fighters.get(e);
+        return fighter->bonus[STAT_MAX_HP] == stat_bench_walk(e, STAT_MAX_HP) && fighter->bonus[STAT_POWER] == stat_bench_walk(e, STAT_POWER)
+            && fighter->bonus[STAT_DEFENSE] == stat_bench_walk(e, STAT_DEFENSE);
+    };
+    printf("%-20s %12s %12s\n", "modifiers", "walk ns", "cached ns");
+    for(int count = 2; count <= Modifier_capacity; count *= 2) {
+        while(world.modifiers.get(attacker)->count < count) {
+            modifier_add(attacker, Modifier { ENTITY_NONE, (uint8_t)rand_int(r, 0, STAT_COUNT - 1), (int16_t)rand_int(r, -3, 3), -1 });
+        }
+        world.add(world.modifiers, target, *world.modifiers.get(attacker));
+        modifiers_fold(target);
+
+        volatile int sink = 0;
+        double walk = bench_ns(reps, [&](int) {
+            auto a = world.fighters.get(attacker);
+            auto t = world.fighters.get(target);
+            sink = sink + (a->power_max + stat_bench_walk(attacker, STAT_POWER)) - (t->defense_max + stat_bench_walk(target, STAT_DEFENSE));
+        });
+        double cached = bench_ns(reps, [&](int) {
+            sink = sink + world.fighters.get(attacker)->power() - world.fighters.get(target)->defense();
+        });
+        printf("%-20d %12.2f %12.2f\n", count, walk, cached);
+        ok = ok && matches(attacker) && matches(target);
+    }
+
+    // equip/unequip every slot and run timed buffs down alongside the permanent ones
+    world.add(world.modifiers, attacker, Modifiers());
+    modifiers_fold(attacker);
+    std::vector<Entity> gear;
+    for(int slot = 0; slot < EQUIPMENT_SLOT_COUNT; slot++) {
+        Entity e = world.create();
+        world.add(world.equippables, e, Equippable((EquipmentSlot)slot, 1 + slot, 2, 5));
+        gear.push_back(e);
+    }
+    int turns = 10000;
+    for(int turn = 0; turn < turns; turn++) {
+        Entity item = gear[rand_int(r, 0, (int)gear.size() - 1)];
+        world.equipments.get(attacker)->toggle_equipment(item);
+        if(world.modifiers.get(attacker)->count < Modifier_capacity) {
+            modifier_add(attacker, Modifier { ENTITY_NONE, (uint8_t)rand_int(r, 0, STAT_COUNT - 1), (int16_t)rand_int(r, -3, 3),
+                (int16_t)rand_int(r, 1, 20) });
+        }
+        modifiers_tick();
+        ok = ok && matches(attacker);
+        event_bus.head = event_bus.tail; // nobody listening
+    }
+    printf("cache matches the stack after %d turns of equipment and buff churn: %s\n", turns, ok ? "yes" : "NO");
+    game_reset();
+    return ok ? 0 : 1;
+}
+
+// main.exe aoebench [reps]
+// Spell areas on a generated floor as the population grows: the old fireball
+// and lightning scans over every fighter against the stencil queries. The
+// uncontained circle has to hit exactly who the old scan hit, nearest has to
+// find someone as close as the old pick.
+int aoe_bench_run(int argc, char *argv[]) {
+    int reps = argc > 2 ? atoi(argv[2]) : 20000;
+    game_reset();
+    static GameMap bench_map;
+    Rng r;
+    rng_seed(r, 11);
+    map_generate(bench_map, r, Max_rooms, Room_min_size, Room_max_size, Map_Width, Map_Height);
+    std::vector<int> floor_cells;
+    for(int i = 0; i < Map_Width * Map_Height; i++) {
+        if(bench_map.walkable.get(i % Map_Width, i / Map_Width)) {
+            floor_cells.push_back(i);
+        }
+    }
+    const float range = 3.0f;
+    bool ok = true;
+    std::vector<Entity> old_hits, new_hits;
+    printf("%-10s %14s %14s %14s %14s %10s\n", "fighters", "old ball ns", "circle ns", "old bolt ns", "nearest ns", "walled");
+    static const int counts[] = { 10, 100, 1000, 10000 };
+    for(int count : counts) {
+        while((int)world.fighters.size() < count) {
+            int cell = floor_cells[rand_int(r, 0, (int)floor_cells.size() - 1)];
+            Entity e = entity_spawn(cell % Map_Width, cell / Map_Width, 'o', TCODColor::white, "Orc", true, render_priority.ENTITY);
+            world.add(world.fighters, e, Fighter(e, 10, 0, 3));
+        }
+        int cell = floor_cells[rand_int(r, 0, (int)floor_cells.size() - 1)];
+        Entity caster = world.fighters.owners[0];
+        auto cp = world.positions.get(caster);
+        map_compute_fov(bench_map, cp->x, cp->y);
+        dirty_tiles.clear();
+
+        AoeQuery q;
+        q.target_x = cell % Map_Width;
+        q.target_y = cell / Map_Width;
+        q.radius = range;
+        q.contained = false;
+
+        volatile size_t sink = 0;
+        double old_ball = bench_ns(reps, [&](int) {
+            old_hits.clear();
+            for(auto &fighter : world.fighters.dense) {
+                auto p = world.positions.get(fighter._owner);
+                if(p && distance_to(p->x, p->y, q.target_x, q.target_y) <= range) {
+                    old_hits.push_back(fighter._owner);
+                }
+            }
+            sink = sink + old_hits.size();
+        });
+        double circle = bench_ns(reps, [&](int) { sink = sink + aoe_fighters(q, bench_map).size(); });
+        new_hits = aoe_fighters(q, bench_map);
+        auto by_id = [](Entity a, Entity b) { return a.id < b.id; };
+        std::sort(old_hits.begin(), old_hits.end(), by_id);
+        std::sort(new_hits.begin(), new_hits.end(), by_id);
+        ok = ok && old_hits == new_hits;
+        q.contained = true;
+        size_t walled = new_hits.size() - aoe_fighters(q, bench_map).size();
+
+        float old_distance = 0;
+        double old_bolt = bench_ns(reps, [&](int) {
+            float closest = 1000000.f;
+            for(auto &fighter : world.fighters.dense) {
+                auto p = world.positions.get(fighter._owner);
+                if(fighter._owner != caster && p && map_in_fov(bench_map, p->x, p->y)) {
+                    closest = std::min(closest, distance_to(cp->x, cp->y, p->x, p->y));
+                }
+            }
+            old_distance = closest;
+        });
+        double nearest = bench_ns(reps, [&](int) { sink = sink + aoe_nearest(bench_map, cp->x, cp->y, (float)fov_radius, 1, caster).size(); });
+        auto &found = aoe_nearest(bench_map, cp->x, cp->y, (float)fov_radius, 1, caster);
+        if(found.empty()) {
+            ok = ok && old_distance == 1000000.f;
+        } else {
+            auto p = world.positions.get(found[0]);
+            ok = ok && distance_to(cp->x, cp->y, p->x, p->y) == old_distance;
+        }
+        printf("%-10d %14.1f %14.1f %14.1f %14.1f %10d\n", count, old_ball, circle, old_bolt, nearest, (int)walled);
+    }
+
+    // the other shapes from the first caster, aimed at the map center (walls
+    // and all, the bench doesn't care what's in the way)
+    auto cp = world.positions.get(world.fighters.owners[0]);
+    static const char *names[] = { "circle", "burst", "cone", "line" };
+    for(int shape = AOE_CIRCLE; shape <= AOE_LINE; shape++) {
+        AoeQuery q;
+        q.shape = (AoeShape)shape;
+        q.x = cp->x;
+        q.y = cp->y;
+        q.target_x = shape == AOE_CIRCLE ? cp->x : Map_Width / 2;
+        q.target_y = shape == AOE_CIRCLE ? cp->y : Map_Height / 2;
+        q.radius = 6.0f;
+        size_t cells = 0;
+        double ns = bench_ns(reps, [&](int) { cells = aoe_cells(q, bench_map).size(); });
+        q.contained = false;
+        size_t open = aoe_cells(q, bench_map).size();
+        double open_ns = bench_ns(reps, [&](int) { aoe_cells(q, bench_map); });
+        printf("  %-8s radius 6: %3d cells %8.1f ns, through walls %3d cells %8.1f ns\n", names[shape], (int)cells, ns, (int)open, open_ns);
+    }
+    printf("circle hits match the old scan, nearest as near as the old pick: %s\n", ok ? "yes" : "NO");
+    events_clear();
+    game_reset();
+    return ok ? 0 : 1;
+}
+
+// Message log throughput: pushing lines, then putting a page of text together
+// at various scroll depths (what the panel does every frame).
+int log_bench_run(int argc, char *argv[]) {
+    int messages = argc > 2 ? atoi(argv[2]) : 1000000;
+    message_log.clear();
+
+    auto allocs = alloc_stats.count;
+    auto start = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < messages; i++) {
+        message_log_push(MSG_ATTACK_HIT, "Orc", "Player", i % 10, NULL);
+    }
+    double push_ns = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count() / messages;
+    allocs = alloc_stats.count - allocs;
+
+    char buffer[128];
+    size_t chars = 0;
+    int pages = 100000;
+    start = std::chrono::high_resolution_clock::now();
+    for(int p = 0; p < pages; p++) {
+        message_log.scroll = (p * 97) % (message_log.max_scroll() + 1);
+        unsigned first = message_log.size() - Log_height - message_log.scroll;
+        for(int i = 0; i < Log_height; i++) {
+            const LogEntry &entry = message_log.line(first + i);
+            message_format(buffer, sizeof(buffer), entry.id, entry.line, entry.text, entry.subject, entry.other, entry.value);
+            chars += strlen(buffer);
+        }
+    }
+    double line_ns = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count() / ((double)pages * Log_height);
+
+    printf("%d messages, %u lines kept, %zu bytes\n", messages, message_log.size(), sizeof(message_log));
+    printf("  push   %8.1f ns/message, %llu allocations\n", push_ns, (unsigned long long)allocs);
+    printf("  format %8.1f ns/line (%zu chars)\n", line_ns, chars);
+    message_log.clear();
+    return 0;
+}
+
+//// GAME LOOP
+// One iteration is input -> update -> events -> render. Split up so the
+// windowed loop and the headless runner drive the exact same code.
+
+struct PlayerAction {
+    Movement move = { 0, 0 };
+    bool pickup = false;
+    bool take_stairs = false;
+    bool quit = false;
+};
+
+// page up/down and the wheel scroll the log, end jumps back to the newest line
+void gui_log_input(const TCOD_key_t &key, const TCOD_mouse_t &mouse) {
+    if(key.vk == TCODK_PAGEUP) {
+        message_log.scroll_by(Log_height);
+    } else if(key.vk == TCODK_PAGEDOWN) {
+        message_log.scroll_by(-Log_height);
+    } else if(key.vk == TCODK_END) {
+        message_log.scroll = 0;
+    } else if(mouse.wheel_up) {
+        message_log.scroll_by(1);
+    } else if(mouse.wheel_down) {
+        message_log.scroll_by(-1);
+    }
+}
+
+PlayerAction game_input(const TCOD_key_t &key, const TCOD_mouse_t &mouse) {
+    PlayerAction action;
+    Movement &m = action.move;
+    if(game_state == PLAYER_TURN || game_state == PLAYER_DEAD) {
+        gui_log_input(key, mouse);
+    }
+    if(game_state == PLAYER_TURN) {    
+        if(key.vk == TCODK_UP) {
+            m.y = -1;
+        } else if(key.vk == TCODK_DOWN) {
+            m.y = 1;
+        } else if(key.vk == TCODK_LEFT) {
+            m.x = -1;
+        } else if(key.vk == TCODK_RIGHT) {
+            m.x = 1;
+        } else if(key.c == 'r') {
+            m.x = 1;
+            m.y = -1;
+        } else if(key.c == 'e') {
+            m.x = -1;
+            m.y = -1;
+        } else if(key.c == 'd') {
+            m.x = -1;
+            m.y = 1;
+        } else if(key.c == 'f') {
+            m.x = 1;
+            m.y = 1;
+        } else if(key.c == 'z') {
+            game_state = ENEMY_TURN;
+        } else if(key.c == 'g') {
+            action.pickup = true;
+        } else if(key.c == 'i') {
+            previous_game_state = game_state;
+            game_state = SHOW_INVENTORY;
+        } else if(key.c == 'c') {
+            previous_game_state = game_state;
+            game_state = CHARACTER_SCREEN;
+        } else if(key.vk == TCODK_ENTER) {
+            action.take_stairs = true;
+        } else if(key.vk == TCODK_ESCAPE) {
+            action.quit = true;
+        } else if(key.vk == TCODK_ENTER) {
+            if(key.lalt) {
+                TCODConsole::setFullscreen(!TCODConsole::isFullscreen());
+            }
+        }
+    } else if(game_state == PLAYER_DEAD) {
+        if(key.c == 'i') {
+            previous_game_state = game_state;
+            game_state = SHOW_INVENTORY;
+        } else if(key.vk == TCODK_ESCAPE) {
+            action.quit = true;
+        } else if(key.vk == TCODK_ENTER) {
+            if(key.lalt) {
+                TCODConsole::setFullscreen(!TCODConsole::isFullscreen());
+            }
+        }
+    } else if(game_state == SHOW_INVENTORY) {
+        auto inventory = world.inventories.get(player);
+        int index = (int)key.c - (int)'a';
+        if(index >= 0 && previous_game_state != PLAYER_DEAD && index < (int)inventory->items.size()) {
+            if(key.lalt) {
+                // DROP ITEM
+                auto item_entity = inventory->items[index];
+                auto player_position = world.positions.get(player);
+                world.add(world.positions, item_entity, Position { player_position->x, player_position->y });
+                inventory->remove(item_entity);
+                auto equipment = world.equipments.get(player);
+                if(equipment->equipped(item_entity)) {
+                    equipment->toggle_equipment(item_entity);
+                }
+                game_state = ENEMY_TURN;
+            } else {
+                if(inventory->requires_target(index)) {
+                    targeting_item = inventory->items[index];
+                    previous_game_state = PLAYER_TURN;
+                    game_state = TARGETING;
+                    events_message_text(item_effects[world.items.get(targeting_item)->effect].targeting_message);
+                } else {
+                    // trying to use an item always consumes the turn
+                    inventory->use(index, game_context);
+                    game_state = ENEMY_TURN;
+                }
+            }
+        }
+        
+        if(key.vk == TCODK_ESCAPE) {
+            game_state = previous_game_state;
+        } else if(key.vk == TCODK_ENTER) {
+            if(key.lalt) {
+                TCODConsole::setFullscreen(!TCODConsole::isFullscreen());
+            }
+        }
+    } else if(game_state == TARGETING) {
+        int x = mouse.cx, y = mouse.cy;            
+        if(mouse.lbutton_pressed) {
+            auto item = world.items.get(targeting_item);
+            item->args.target_x = x;
+            item->args.target_y = y;
+            if(world.inventories.get(player)->use(targeting_item, game_context)) {
+                game_state = ENEMY_TURN;
+            }
+        } else if(key.vk == TCODK_ESCAPE || mouse.rbutton_pressed) {
+            game_state = previous_game_state;
+            events_message(MSG_TARGETING_CANCELLED);
+        }
+    } else if(game_state == MAIN_MENU) {
+        int index = (int)key.c - (int)'a';
+        if(index == 0) {    
+            new_game(game_seed);
+            recorder_new_game(game_seed);
+        } else if(index == 1) {
+            if(load_game(Save_path, Journal_path)) {
+                recorder_loaded_game();
+            } else {
+                engine_log(LogStatus::Information, "No saved game to continue");
+            }
+        } else if(index == 2 || key.vk == TCODK_ESCAPE) {
+            action.quit = true;
+        } else if(key.vk == TCODK_ENTER) {
+            if(key.lalt) {
+                TCODConsole::setFullscreen(!TCODConsole::isFullscreen());
+            }
+        }
+    } else if(game_state == LEVEL_UP) {
+        auto fighter = world.fighters.get(player);
+        char key_char = key.c;
+        if(key_char == 'a') {
+            fighter->hp_max += 20;
+            fighter->hp += 20;
+            game_state = previous_game_state;
+        } else if(key_char == 'b') {
+            fighter->power_max += 1;
+            game_state = previous_game_state;
+        } else if(key_char == 'c') {
+            fighter->defense_max += 1;
+            game_state = previous_game_state;
+        }
+    } else if(key.vk == TCODK_ESCAPE) {
+        game_state = previous_game_state;
+    }
+    return action;
+}
+
+void game_update(PlayerAction &action) {
+    if(game_state == PLAYER_TURN) {
+        Movement &m = action.move;
+        auto player_position = world.positions.get(player);
+        int dx = player_position->x + m.x, dy = player_position->y + m.y; 
+        if((m.x != 0 || m.y != 0) && !map_blocked(game_map, dx, dy)) {
+            Entity target;
+            if(entity_blocking_at(dx, dy, &target)) {
+                world.fighters.get(player)->attack(target);
+            } else {
+                world.move(player, dx, dy);
+                map_compute_fov(game_map, player_position->x, player_position->y);
+            }
+
+            game_state = ENEMY_TURN;
+        } else if(action.pickup) {
+            for(Entity entity = world.first_on_tile(player_position->x, player_position->y); entity.valid(); entity = world.next_on_tile(entity)) {
+                if(world.has(entity, COMPONENT_ITEM)) {
+                    events_queue(EventType::ItemPickup, entity);
+                    game_state = ENEMY_TURN;
+                    action.pickup = false;
+                    break;  
+                }
+            }
+            // if we still want to pickup after we checked entities there is nothing to pickup
+            if(action.pickup) {
+                events_message(MSG_NOTHING_TO_PICK_UP);
+            }
+        } else if(action.take_stairs) {
+            for(Entity entity = world.first_on_tile(player_position->x, player_position->y); entity.valid(); entity = world.next_on_tile(entity)) {
+                if(world.has(entity, COMPONENT_STAIRS)) {
+                    events_queue(EventType::NextFloor, entity);
+                    action.take_stairs = false;
+                    break;  
+                }
+            }
+        }
+        if(action.take_stairs) {
+            events_message(MSG_NO_STAIRS);
+        }
+    } else if(game_state == ENEMY_TURN) {
+        enemy_turn(player, game_map, rng.ai);
+        modifiers_tick();
+        game_turn++;
+
+        game_state = PLAYER_TURN;
+    }
+}
+
+//// EVENT HANDLERS
+
+void on_message(const Event &e) {
+    log_message(e.message, e.entity, e.other, e.value, e.text);
+}
+
+void on_attack(const Event &e) {
+    log_message(e.value > 0 ? MSG_ATTACK_HIT : MSG_ATTACK_NO_DAMAGE, e.entity, e.other, e.value);
+}
+
+void on_entity_dead(const Event &e) {
+    auto renderable = world.renderables.get(e.entity);
+    // shitty way to know if player died
+    if(e.entity == player) {
+        log_message(MSG_PLAYER_DIED);
+        game_state = PLAYER_DEAD;
+        renderable->gfx = '%';
+        renderable->color = TCOD_dark_red;
+        renderable->render_order = render_priority.CORPSE;
+        world.touch(e.entity);
+    } else {
+        log_message(MSG_DIED, e.entity);
+        
+        auto xp_gained = world.fighters.get(e.entity)->xp;
+        auto level = world.levels.get(player);
+        bool leveled_up = level->add_xp(xp_gained);
+        log_message(MSG_XP_GAINED, ENTITY_NONE, ENTITY_NONE, xp_gained);
+        
+        if(leveled_up) {
+            log_message(MSG_LEVEL_UP, ENTITY_NONE, ENTITY_NONE, level->current_level);
+            previous_game_state = game_state;
+            game_state = LEVEL_UP;
+        }
+
+        renderable->gfx = '%';
+        renderable->color = TCOD_dark_red;
+        renderable->render_order = render_priority.CORPSE;
+        world.touch(e.entity);
+        world.set_tag(e.entity, TAG_BLOCKS, false);
+        world.remove(world.fighters, e.entity);
+        world.remove(world.ais, e.entity);
+        auto name = world.names.get(e.entity);
+        name->name = arena_printf(floor_arena, "remains of %s", name->name);
+    }
+}
+
+void on_item_pickup(const Event &e) {
+    auto success = world.inventories.get(player)->add_item(e.entity);
+    if(success) {
+        log_message(MSG_PICKED_UP, e.entity);
+        // off the map
+        world.remove(world.positions, e.entity);
+    } else {
+        log_message(MSG_INVENTORY_FULL);
+    }
+}
+
+void on_next_floor(const Event &e) {
+    next_floor(game_map);
+}
+
+void on_equipment_change(const Event &e) {
+    log_message(e.value == 1 ? MSG_EQUIPPED : MSG_DEQUIPPED, e.entity);
+}
+
+void game_subscribe_events() {
+    events_subscribe(EventType::Message, on_message);
+    events_subscribe(EventType::Attack, on_attack);
+    events_subscribe(EventType::EntityDead, on_entity_dead);
+    events_subscribe(EventType::ItemPickup, on_item_pickup);
+    events_subscribe(EventType::NextFloor, on_next_floor);
+    events_subscribe(EventType::EquipmentChange, on_equipment_change);
+}
+
+void game_process_events() {
+    while(event_bus.head != event_bus.tail) {
+        // copy, handlers can queue more events
+        Event e = events_at(event_bus.head++);
+        // entity could have been destroyed by an earlier event (e.g. next floor),
+        // messages still go out, a gone entity just has no name
+        if(e.type != EventType::Message && e.entity.valid() && !world.alive(e.entity)) {
+            continue;
+        }
+        // what an event names is what the turn changed, for the journal
+        world.changed(e.entity);
+        world.changed(e.other);
+        for(unsigned i = 0; i < event_bus.subscriber_count[(int)e.type]; i++) {
+            event_bus.subscribers[(int)e.type][i](e);
+        }
+    }
+    events_clear();
+    journal_update();
+}
+
+// One console cell, laid out like libtcod's TCOD_ConsoleTile so a run of
+// them goes into the console's cells with one memcpy. Colours are RGBA
+// packed r in the low byte.
+struct MapCell {
+    int ch;
+    uint32_t fg;
+    uint32_t bg;
+};
+static_assert(sizeof(MapCell) == sizeof(TCOD_ConsoleTile), "MapCell has to match the console cells");
+
+// RGBA the way console cells store it, r in the low byte
+uint32_t render_pack(const TCODColor &c) {
+    return (uint32_t)c.r | (uint32_t)c.g << 8 | (uint32_t)c.b << 16 | 0xff000000u;
+}
+
+TCODColor render_unpack(uint32_t c) {
+    return TCODColor((int)(c & 0xff), (int)((c >> 8) & 0xff), (int)((c >> 16) & 0xff));
+}
+
+// What each map cell looks like in view (the entity with the highest
+// render_order on the lit tile colour) and once it's out of view (the highest
+// that stays drawn, stairs, on the dark colour). Picked again only for
+// restacked tiles, so a frame never walks the stacks fov uncovered or a menu
+// made it redraw, gameplay storage isn't touched or reordered. Walls don't
+// change within a floor and a new floor restacks everything.
+struct RenderTops {
+    MapCell lit[Map_Width * Map_Height];
+    MapCell kept[Map_Width * Map_Height];
+} render_tops;
+
+// the map's colours packed once per update, [wall] picks the colour
+struct RenderPalette {
+    uint32_t lit[2], kept[2], white;
+};
+
+void render_tops_pick(const GameMap &map, const RenderPalette &palette, int tile) {
+    const Renderable *top = NULL, *kept = NULL;
+    int x = tile % Map_Width, y = tile / Map_Width;
+    for(Entity e = world.first_on_tile(x, y); e.valid(); e = world.next_on_tile(e)) {
+        auto renderable = world.renderables.get(e);
+        if(!renderable) {
+            continue;
+        }
+        if(!top || renderable->render_order > top->render_order) {
+            top = renderable;
+        }
+        if(world.has(e, COMPONENT_STAIRS) && (!kept || renderable->render_order > kept->render_order)) {
+            kept = renderable;
+        }
+    }
+    int wall = !map.transparent.get(x, y);
+    render_tops.lit[tile] = { top ? top->gfx : ' ', top ? render_pack(top->color) : palette.white, palette.lit[wall] };
+    render_tops.kept[tile] = { kept ? kept->gfx : ' ', kept ? render_pack(kept->color) : palette.white, palette.kept[wall] };
+}
+
+void render_tops_update(const GameMap &map) {
+    RenderPalette palette = {
+        { render_pack(color_table.light_ground), render_pack(color_table.light_wall) },
+        { render_pack(color_table.dark_ground), render_pack(color_table.dark_wall) },
+        render_pack(TCODColor::white)
+    };
+    if(restacked_tiles.all) {
+        // most of a floor is bare, fill that in and only walk where something stands
+        for(int y = 0; y < Map_Height; y++) {
+            for(int x = 0; x < Map_Width; x++) {
+                int wall = !map.transparent.get(x, y);
+                render_tops.lit[x + y * Map_Width] = { ' ', palette.white, palette.lit[wall] };
+                render_tops.kept[x + y * Map_Width] = { ' ', palette.white, palette.kept[wall] };
+            }
+        }
+        for(Entity e : world.positions.owners) {
+            auto p = world.positions.get(e);
+            if(world.first_on_tile(p->x, p->y) == e) {
+                render_tops_pick(map, palette, p->x + Map_Width * p->y);
+            }
+        }
+    } else {
+        for(int tile : restacked_tiles.list) {
+            render_tops_pick(map, palette, tile);
+        }
+    }
+    restacked_tiles.clear();
+}
+
+// each byte of a bit plane word as 8 all-ones or all-zero masks
+struct RenderBitMasks {
+    uint32_t masks[256][8];
+    RenderBitMasks() {
+        for(int byte = 0; byte < 256; byte++) {
+            for(int bit = 0; bit < 8; bit++) {
+                masks[byte][bit] = 0u - (uint32_t)((byte >> bit) & 1);
+            }
+        }
+    }
+};
+const RenderBitMasks render_bit_masks;
+
+void render_expand_bits(uint32_t bits, uint32_t *masks) {
+    for(int byte = 0; byte < 4; byte++) {
+        memcpy(masks + byte * 8, render_bit_masks.masks[(bits >> (byte * 8)) & 0xff], 8 * sizeof(uint32_t));
+    }
+}
+
+// the cells of one map row, where they come from and where they go
+struct RenderRow {
+    const uint64_t *visible, *explored;
+    const MapCell *lit, *kept;
+    MapCell *out;
+    int words;
+};
+
+// 32 bits of a bit plane row starting at column x, zeros past the row's end
+uint32_t render_row_bits(const uint64_t *bits, int words, int x) {
+    int word = x >> 6, shift = x & 63;
+    uint64_t out = bits[word] >> shift;
+    if(shift > 32 && word + 1 < words) {
+        out |= bits[word + 1] << (64 - shift);
+    }
+    return (uint32_t)out;
+}
+
+const MapCell Map_cell_blank = { ' ', 0xffffffffu, 0xff000000u };
+
+// Cells x0..x0+n of a row from the fov bit planes: lit cells show what's on
+// them, explored ones what's kept, the rest is blank. Goes 32 cells at a time
+// through locals, bits spread into masks and each field an and/or with them,
+// no branches and nothing that could alias, so even -O2 vectorizes it like
+// the bit plane ops.
+void render_compose_span(const RenderRow &row, int x0, int n) {
+    const MapCell *lit = row.lit + x0, *kept = row.kept + x0;
+    MapCell *out = row.out + x0;
+    uint32_t lit_mask[32], seen_mask[32];
+    uint32_t ch[32], fg[32], bg[32];
+    for(int base = 0; base < n; base += 32) {
+        int count = std::min(32, n - base);
+        render_expand_bits(render_row_bits(row.visible, row.words, x0 + base), lit_mask);
+        render_expand_bits(render_row_bits(row.explored, row.words, x0 + base), seen_mask);
+        for(int i = 0; i < 32; i++) {
+            uint32_t l = lit_mask[i], s = ~l & seen_mask[i], d = ~(l | s);
+            int x = base + std::min(i, count - 1);
+            ch[i] = (l & (uint32_t)lit[x].ch) | (s & (uint32_t)kept[x].ch) | (d & (uint32_t)Map_cell_blank.ch);
+            fg[i] = (l & lit[x].fg) | (s & kept[x].fg) | (d & Map_cell_blank.fg);
+            bg[i] = (l & lit[x].bg) | (s & kept[x].bg) | (d & Map_cell_blank.bg);
+        }
+        for(int i = 0; i < count; i++) {
+            out[base + i] = { (int)ch[i], fg[i], bg[i] };
+        }
+    }
+}
+
+// the whole map as one flat array, what render_map hands the console
+MapCell map_cells[Map_Width * Map_Height];
+
+// the same choice for a single cell
+MapCell render_pick(const GameMap &map, int tile) {
+    int word = tile / Map_Width * MapBits::Row_words + (tile % Map_Width >> 6), bit = tile % Map_Width & 63;
+    if((map.visible.words[word] >> bit) & 1) {
+        return render_tops.lit[tile];
+    }
+    return (map.explored.words[word] >> bit) & 1 ? render_tops.kept[tile] : Map_cell_blank;
+}
+
+RenderRow render_map_row(const GameMap &map, int y) {
+    int row = y * Map_Width, words = y * MapBits::Row_words;
+    return {
+        map.visible.words + words, map.explored.words + words,
+        render_tops.lit + row, render_tops.kept + row, map_cells + row, MapBits::Row_words
+    };
+}
+
+// The console's own cell array, NULL = go through putCharEx. libtcod 1.13
+// has no public way to its cells, so the game always takes putCharEx.
+// Headless consoles swallow draws unless a bench gives them cells.
+#ifdef HEADLESS
+TCOD_ConsoleTile *console_tiles(TCODConsole *con) {
+    return con->tiles.empty() ? NULL : con->tiles.data();
+}
+#else
+TCOD_ConsoleTile *console_tiles(TCODConsole *) {
+    return NULL;
+}
+#endif
+
+void render_put_cell(TCODConsole *con, const GameMap &map, int tile) {
+    MapCell cell = render_pick(map, tile);
+    con->putCharEx(tile % Map_Width, tile / Map_Width, cell.ch, render_unpack(cell.fg), render_unpack(cell.bg));
+}
+
+// Redraws what's dirty, returns cells redrawn. With the console's cells at
+// hand a full redraw composes the map row by row into map_cells and copies
+// the rows over, the few cells a frame usually dirties are picked and copied
+// one by one. Without them (libtcod) every cell goes through putCharEx,
+// composing whole rows first buys nothing there.
+int render_map(TCODConsole *con, const GameMap &map) {
+    TCOD_ConsoleTile *tiles = console_tiles(con);
+    int stride = con->getWidth();
+    int cells = dirty_tiles.all ? Map_Width * Map_Height : (int)dirty_tiles.list.size();
+    if(!tiles) {
+        if(dirty_tiles.all) {
+            for(int tile = 0; tile < Map_Width * Map_Height; tile++) {
+                render_put_cell(con, map, tile);
+            }
+        } else {
+            for(int tile : dirty_tiles.list) {
+                render_put_cell(con, map, tile);
+            }
+        }
+    } else if(dirty_tiles.all) {
+        for(int y = 0; y < Map_Height; y++) {
+            render_compose_span(render_map_row(map, y), 0, Map_Width);
+            memcpy(tiles + y * stride, map_cells + y * Map_Width, Map_Width * sizeof(MapCell));
+        }
+    } else {
+        for(int tile : dirty_tiles.list) {
+            map_cells[tile] = render_pick(map, tile);
+            memcpy(tiles + tile % Map_Width + tile / Map_Width * stride, &map_cells[tile], sizeof(MapCell));
+        }
+    }
+    dirty_tiles.clear();
+    return cells;
+}
+
+struct RenderStats {
+    int cells_touched = 0;       // last frame
+    double frame_us = 0;         // last frame, all of game_render
+    uint64_t cells_touched_total = 0;
+    uint64_t frames = 0;
+} render_stats;
+
+// What's composed on the root console over the map: which modal screen and a
+// hash of everything it shows. The root console keeps its cells between
+// frames, so while the key stays the same and nothing under it is dirty the
+// frame skips the map and the menu entirely, strings and all.
+enum Overlay {
+    OVERLAY_NONE,
+    OVERLAY_MAIN_MENU,
+    OVERLAY_INVENTORY,
+    OVERLAY_LEVEL_UP,
+    OVERLAY_CHARACTER
+};
+
+struct OverlayKey {
+    Overlay id = OVERLAY_NONE;
+    uint32_t version = 0;
+
+    bool operator==(const OverlayKey &other) const { return id == other.id && version == other.version; }
+    bool operator!=(const OverlayKey &other) const { return !(*this == other); }
+};
+
+struct OverlayCache {
+    OverlayKey shown; // on the root console right now
+    int composed = 0; // times a menu was drawn, for menubench
+} overlay_cache;
+
+uint32_t overlay_mix(uint32_t h, uint32_t v) {
+    return (h ^ v) * 16777619u;
+}
+
+// only the numbers the screens print, no strings get built for this
+OverlayKey gui_overlay_key() {
+    OverlayKey key;
+    uint32_t h = 2166136261u;
+    if(game_state == MAIN_MENU) {
+        key.id = OVERLAY_MAIN_MENU;
+    } else if(game_state == SHOW_INVENTORY) {
+        key.id = OVERLAY_INVENTORY;
+        auto equipment = world.equipments.get(player);
+        for(auto item : world.inventories.get(player)->items) {
+            h = overlay_mix(h, item.id);
+            h = overlay_mix(h, (uint32_t)equipment->slot_of(item));
+        }
+    } else if(game_state == LEVEL_UP) {
+        key.id = OVERLAY_LEVEL_UP;
+        auto fighter = world.fighters.get(player);
+        h = overlay_mix(overlay_mix(overlay_mix(h, fighter->hp_max), fighter->power_max), fighter->defense_max);
+    } else if(game_state == CHARACTER_SCREEN) {
+        key.id = OVERLAY_CHARACTER;
+        auto fighter = world.fighters.get(player);
+        auto level = world.levels.get(player);
+        h = overlay_mix(overlay_mix(overlay_mix(h, level->current_level), level->current_xp), fighter->hp_max);
+        h = overlay_mix(overlay_mix(h, fighter->power()), fighter->defense());
+    }
+    key.version = h;
+    return key;
+}
+
+void game_render(TCODConsole *root_console, TCODConsole *bar, const TCOD_mouse_t &mouse) {
+    auto frame_start = std::chrono::high_resolution_clock::now();
+    // menus draw over the map and blend with what's under it, so a menu that
+    // has to be drawn again needs the whole map under it fresh, and so does
+    // the frame after it closes
+    OverlayKey overlay = gui_overlay_key();
+    bool compose = overlay.id != OVERLAY_NONE && (overlay != overlay_cache.shown || dirty_tiles.all || !dirty_tiles.list.empty());
+    if(compose || (overlay.id == OVERLAY_NONE && overlay_cache.shown.id != OVERLAY_NONE)) {
+        dirty_tiles.mark_all();
+    }
+    overlay_cache.shown = overlay;
+
+    render_tops_update(game_map);
+    // the root console keeps last frame's cells, only dirty ones get redrawn
+    int cells_touched = 0;
+    if(game_state == MAIN_MENU) {
+        if(compose) {
+            root_console->setDefaultForeground(TCODColor::white);
+            root_console->clear();
+            hud.invalidate();
+        }
+        dirty_tiles.clear();
+    } else {
+        cells_touched = render_map(root_console, game_map);
+    }
+
+    // UI RENDER
+    if(game_state != MAIN_MENU) {
+        gui_render_hud(root_console, bar, game_map, player, mouse.cx, mouse.cy);
+    }
+    
+    if(compose) {
+        overlay_cache.composed++;
+        if(game_state == MAIN_MENU) {
+            gui_render_main_menu(root_console, SCREEN_WIDTH, SCREEN_HEIGHT);
+        } else if(game_state == SHOW_INVENTORY) {
+            gui_render_inventory(root_console, "Press the key next to an item to use it (hold alt to drop), or Esc to cancel.\n", player, 50, SCREEN_WIDTH, SCREEN_HEIGHT);
+        } else if(game_state == LEVEL_UP) {
+            gui_render_level_up_menu(root_console, "Level up! Choose a stat to raise:", player, 40, SCREEN_WIDTH, SCREEN_HEIGHT);
+        } else if(game_state == CHARACTER_SCREEN) {
+            gui_render_character_screen(root_console, player, 30, 10, SCREEN_WIDTH, SCREEN_HEIGHT);
+        }
+    }
+
+    render_stats.cells_touched = cells_touched;
+    render_stats.cells_touched_total += cells_touched;
+    render_stats.frames++;
+    render_stats.frame_us = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - frame_start).count();
+}
+
+// Back to a blank slate, used by the headless runner to start over after dying
+void game_reset() {
+    floor_pregen_cancel();
+    journal.active = false;
+    world = World();
+    floor_arena.reset();
+    dirty_tiles.mark_all();
+    restacked_tiles.mark_all();
+    events_clear();
+    message_log.clear();
+    hud.invalidate();
+
+    game_map.rooms.clear();
+    game_map.num_rooms = 0;
+    game_map.level = 1;
+    game_map.walkable.clear();
+    game_map.transparent.clear();
+    game_map.explored.clear();
+    game_map.visible.clear();
+
+    player = ENTITY_NONE;
+    targeting_item = ENTITY_NONE;
+    game_state = MAIN_MENU;
+    previous_game_state = MAIN_MENU;
+}
+
+// Leaving a game in progress keeps it for Continue, a dead one is gone for good
+void game_save_on_quit() {
+    // anything the journal still had to write is about to be in the save anyway
+    journal_stop();
+    remove(Journal_path);
+    if(game_state == PLAYER_DEAD) {
+        remove(Save_path);
+    } else if(game_state != MAIN_MENU) {
+        save_game(Save_path);
+    }
+}
+
+//// MAIN LOOP
+// LOOP_WAIT (default): once there is nothing left to simulate the loop blocks
+// until input arrives, so an idle game sits at ~0% cpu instead of rendering
+// and flushing as fast as it can. LOOP_POLL is the old loop (`main poll`).
+// Background work that needs a frame calls loop_wake(). libtcod's wait can't
+// be interrupted from another thread, so while loop_expect_wake() is holding
+// a wake open, the loop polls input and sleeps on the wake in short slices.
+enum LoopMode {
+    LOOP_POLL,
+    LOOP_WAIT
+};
+
+const int LOOP_WAIT_SLICE_MS = 5;
+const int LOOP_EVENT_MASK = TCOD_EVENT_KEY_PRESS | TCOD_EVENT_MOUSE;
+
+struct LoopWake {
+    std::mutex mutex;
+    std::condition_variable cv;
+    int expected = 0;
+    bool woken = false;
+    std::chrono::steady_clock::time_point woken_at;
+    // how long from loop_wake() until that frame was flushed
+    int latency_count = 0;
+    double latency_total_us = 0;
+    double latency_worst_us = 0;
+} loop_wake_state;
+
+void loop_expect_wake(bool expect) {
+    std::lock_guard<std::mutex> lock(loop_wake_state.mutex);
+    loop_wake_state.expected += expect ? 1 : -1;
+}
+
+void loop_wake() {
+    {
+        std::lock_guard<std::mutex> lock(loop_wake_state.mutex);
+        if(!loop_wake_state.woken) {
+            loop_wake_state.woken = true;
+            loop_wake_state.woken_at = std::chrono::steady_clock::now();
+        }
+    }
+    loop_wake_state.cv.notify_one();
+}
+
+bool game_has_work() {
+    return game_state == ENEMY_TURN || events_pending();
+}
+
+// Blocks until there is input or a wake-up, returns true on a wake-up
+bool loop_wait(TCOD_key_t &key, TCOD_mouse_t &mouse) {
+    std::unique_lock<std::mutex> lock(loop_wake_state.mutex);
+    while(loop_wake_state.expected > 0 && !loop_wake_state.woken) {
+        lock.unlock();
+        if(TCODSystem::checkForEvent(LOOP_EVENT_MASK, &key, &mouse) != TCOD_EVENT_NONE || TCODConsole::isWindowClosed()) {
+            return false;
+        }
+        lock.lock();
+        loop_wake_state.cv.wait_for(lock, std::chrono::milliseconds(LOOP_WAIT_SLICE_MS), [] { return loop_wake_state.woken; });
+    }
+    if(loop_wake_state.woken) {
+        // no new input, don't replay the last key or click
+        key = TCOD_key_t();
+        key.vk = TCODK_NONE;
+        mouse.lbutton_pressed = mouse.rbutton_pressed = mouse.mbutton_pressed = false;
+        return true;
+    }
+    lock.unlock();
+    TCODSystem::waitForEvent(LOOP_EVENT_MASK, &key, &mouse, false);
+    return false;
+}
+
+void game_loop(TCODConsole *root_console, TCODConsole *bar, LoopMode mode) {
+    TCOD_key_t key = {TCODK_NONE,0};
+    TCOD_mouse_t mouse = TCOD_mouse_t();
+
+    while ( !TCODConsole::isWindowClosed() ) {
+        bool woken = false;
+        if(mode == LOOP_WAIT && !game_has_work()) {
+            woken = loop_wait(key, mouse);
+        } else {
+            TCODSystem::checkForEvent(LOOP_EVENT_MASK, &key, &mouse);
+        }
+
+        //// INPUT
+        recorder_frame(key, mouse, game_has_work());
+        PlayerAction action = game_input(key, mouse);
+        if(action.quit) {
+            return;
+        }
+
+        //// UPDATE
+        game_update(action);
+
+        // EVENTS
+        game_process_events();
+
+        //// RENDER
+        game_render(root_console, bar, mouse);
+
+        TCODConsole::flush();
+
+        if(woken) {
+            std::lock_guard<std::mutex> lock(loop_wake_state.mutex);
+            double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - loop_wake_state.woken_at).count();
+            loop_wake_state.woken = false;
+            loop_wake_state.latency_count++;
+            loop_wake_state.latency_total_us += us;
+            loop_wake_state.latency_worst_us = std::max(loop_wake_state.latency_worst_us, us);
+        }
+    }
+}
+
+//// HEADLESS
+// main.exe headless [turns] [seed] [shadowcast|rays]
+// Plays the game with a bot instead of the keyboard and no window, then
+// reports throughput and where the time went. Same seed => same game.
+
+// Scripted player: levels up, drinks/reads what it picks up, fights what is in
+// the way and otherwise walks the shortest path to the stairs.
+struct Bot {
+    int distance[Map_Width * Map_Height];
+    Entity stairs;
+    int inventory_cursor = 0;
+    int targeting_attempts = 0;
+    int inventory_turn = -1;
+
+    void stairs_distances() {
+        std::fill(distance, distance + Map_Width * Map_Height, -1);
+        stairs = world.stairs.size() ? world.stairs.owners[0] : ENTITY_NONE;
+        auto target = world.positions.get(stairs);
+        if(!target) {
+            return;
+        }
+        std::vector<int> frontier;
+        frontier.push_back(map_index(target->x, target->y));
+        distance[frontier[0]] = 0;
+        for(size_t i = 0; i < frontier.size(); i++) {
+            int x = frontier[i] % Map_Width, y = frontier[i] / Map_Width;
+            for(int dy = -1; dy <= 1; dy++) {
+                for(int dx = -1; dx <= 1; dx++) {
+                    int nx = x + dx, ny = y + dy;
+                    if(nx < 0 || ny < 0 || nx >= Map_Width || ny >= Map_Height || map_blocked(game_map, nx, ny)) {
+                        continue;
+                    }
+                    int n = map_index(nx, ny);
+                    if(distance[n] == -1) {
+                        distance[n] = distance[frontier[i]] + 1;
+                        frontier.push_back(n);
+                    }
+                }
+            }
+        }
+    }
+
+    static TCOD_key_t key_for_move(int dx, int dy) {
+        TCOD_key_t key = {TCODK_NONE,0};
+        if(dx == 0 && dy == -1) key.vk = TCODK_UP;
+        else if(dx == 0 && dy == 1) key.vk = TCODK_DOWN;
+        else if(dx == -1 && dy == 0) key.vk = TCODK_LEFT;
+        else if(dx == 1 && dy == 0) key.vk = TCODK_RIGHT;
+        else {
+            key.vk = TCODK_CHAR;
+            key.c = dx == 1 ? (dy == -1 ? 'r' : 'f') : (dy == -1 ? 'e' : 'd');
+        }
+        return key;
+    }
+
+    void next_input(TCOD_key_t &key, TCOD_mouse_t &mouse) {
+        key = {TCODK_NONE,0};
+        mouse = TCOD_mouse_t();
+        if(game_state == MAIN_MENU) {
+            key.vk = TCODK_CHAR;
+            key.c = 'a';
+        } else if(game_state == LEVEL_UP) {
+            key.vk = TCODK_CHAR;
+            key.c = 'a' + (char)(game_turn % 3);
+        } else if(game_state == SHOW_INVENTORY) {
+            // walk through the inventory one item per visit
+            auto inventory = world.inventories.get(player);
+            if(inventory->items.size()) {
+                key.vk = TCODK_CHAR;
+                key.c = 'a' + (char)(inventory_cursor++ % inventory->items.size());
+            } else {
+                key.vk = TCODK_ESCAPE;
+            }
+        } else if(game_state == TARGETING) {
+            // aim at the closest thing that fights, give up if there is nothing
+            auto p = world.positions.get(player);
+            float best = 1000000.f;
+            for(auto &f : world.fighters.dense) {
+                auto fp = world.positions.get(f._owner);
+                if(f._owner != player && fp && map_in_fov(game_map, fp->x, fp->y)) {
+                    float d = distance_to(p->x, p->y, fp->x, fp->y);
+                    if(d < best) {
+                        best = d;
+                        mouse.cx = fp->x;
+                        mouse.cy = fp->y;
+                    }
+                }
+            }
+            if(best == 1000000.f || targeting_attempts++ > 0) {
+                mouse.rbutton_pressed = true;
+            } else {
+                mouse.lbutton_pressed = true;
+            }
+        } else if(game_state == PLAYER_TURN) {
+            targeting_attempts = 0;
+            if(!world.alive(stairs)) {
+                stairs_distances();
+            }
+            auto p = world.positions.get(player);
+            auto fighter = world.fighters.get(player);
+            auto inventory = world.inventories.get(player);
+
+            for(Entity e = world.first_on_tile(p->x, p->y); e.valid(); e = world.next_on_tile(e)) {
+                if(world.has(e, COMPONENT_ITEM) && inventory->items.size() < (size_t)inventory->capacity) {
+                    key.vk = TCODK_CHAR;
+                    key.c = 'g';
+                    return;
+                }
+            }
+            if(inventory->items.size() > 1 && fighter->hp < fighter->hp_max / 2 && inventory_turn != game_turn) {
+                inventory_turn = game_turn;
+                key.vk = TCODK_CHAR;
+                key.c = 'i';
+                return;
+            }
+            if(distance[map_index(p->x, p->y)] == 0) {
+                key.vk = TCODK_ENTER;
+                return;
+            }
+            // downhill on the distance map, attacking anything blocking the way
+            int best_dx = 0, best_dy = 0, best = distance[map_index(p->x, p->y)];
+            for(int dy = -1; dy <= 1; dy++) {
+                for(int dx = -1; dx <= 1; dx++) {
+                    int nx = p->x + dx, ny = p->y + dy;
+                    if((dx == 0 && dy == 0) || !OccupancyGrid::in_bounds(nx, ny)) {
+                        continue;
+                    }
+                    int d = distance[map_index(nx, ny)];
+                    if(d >= 0 && (best < 0 || d < best)) {
+                        best = d;
+                        best_dx = dx;
+                        best_dy = dy;
+                    }
+                }
+            }
+            if(best_dx == 0 && best_dy == 0) {
+                key.vk = TCODK_CHAR;
+                key.c = 'z';
+                return;
+            }
+            key = key_for_move(best_dx, best_dy);
+        }
+    }
+};
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+// FNV-1a over the bits of state that matter, two runs with the same seed
+// have to end up with the same number
+uint32_t game_state_hash() {
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](int value) {
+        for(int i = 0; i < 4; i++) {
+            hash ^= (uint32_t)(value >> (i * 8)) & 0xff;
+            hash *= 16777619u;
+        }
+    };
+    mix(game_turn);
+    mix(game_map.level);
+    mix((int)game_state);
+    for(size_t i = 0; i < world.positions.size(); i++) {
+        mix((int)world.positions.owners[i].id);
+        mix(world.positions.dense[i].x);
+        mix(world.positions.dense[i].y);
+    }
+    for(auto &f : world.fighters.dense) {
+        mix(f.hp);
+    }
+    return hash;
+}
+
+long peak_memory_kb() {
+#ifdef __linux__
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    return -1;
+#endif
+}
 
-EntityFat *player;
-GameState game_state = MAIN_MENU;
-GameState previous_game_state = MAIN_MENU;
-EntityFat *targeting_item = NULL;
+int headless_run(int argc, char *argv[]) {
+    int turns = argc > 2 ? atoi(argv[2]) : 10000;
+    unsigned int seed = argc > 3 ? (unsigned int)strtoul(argv[3], NULL, 10) : 1;
+    if(argc > 4) {
+        fov_algorithm = strcmp(argv[4], "rays") == 0 ? FOV_RAYS : FOV_SHADOWCAST;
+    }
 
-void new_game() {
-    _entities.push_back(new EntityFat(SCREEN_WIDTH/2, SCREEN_HEIGHT/2, '@', TCODColor::white, "Player", true, render_priority.ENTITY));
-    
-    player = _entities[0];
-    player->fighter = new Fighter(player, 100, 1, 2);
-    player->inventory = new Inventory(player, 26);
-    player->level = new Level();
-    player->equipment = new Equipment();
-
-    EntityFat *e;
-    e = new EntityFat(0, 0, '-', TCOD_sky, "Dagger", false, render_priority.ITEM);
-    e->item = new Item();
-    e->item->name = "Dagger";
-    e->equippable = new Equippable(MAIN_HAND, 2, 0, 0);
-    
-    player->inventory->add_item(e);
-    player->equipment->toggle_equipment(e);
+    // draws go nowhere but the render code still runs, that is the "render" timing
+    TCODConsole *root_console = new TCODConsole(SCREEN_WIDTH, SCREEN_HEIGHT);
+    TCODConsole *bar = new TCODConsole(SCREEN_WIDTH, Panel_height);
+
+    game_seed = seed;
+    static Bot bot;
+    double time_input = 0, time_update = 0, time_events = 0, time_render = 0;
+    // event pass of the frames that took the stairs, that is where next_floor runs
+    double time_floor_change = 0, worst_floor_change = 0;
+    uint64_t floor_allocs = 0, floor_alloc_bytes = 0;
+    // starting a game sizes all the arrays, kept out of the per turn numbers
+    uint64_t new_game_allocs = 0, new_game_alloc_bytes = 0;
+    int new_games = 0;
+    AllocStats allocs_at_start = alloc_stats;
+    int deaths = 0, floors = 0, frames = 0;
+    int last_turn = game_turn, last_turn_frame = 0;
+    auto clock = std::chrono::high_resolution_clock::now;
+    auto us = [](std::chrono::high_resolution_clock::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count();
+    };
 
-    // generate map and fov
-    game_map.tcod_fov_map = new TCODMap(Map_Width, Map_Height);
-    // Should separate fov from map_generate (make_room)
-    map_generate(game_map, Max_rooms, Room_min_size, Room_max_size, Map_Width, Map_Height);
-    
-    // Place player in first room
-    rect_center(game_map.rooms[0], player->x, player->y);
-    // Setup fov from players position
-    game_map.tcod_fov_map->computeFov(player->x, player->y, fov_radius, fov_light_walls, fov_algorithm);
+    auto run_start = clock();
+    while(game_turn < turns) {
+        TCOD_key_t key;
+        TCOD_mouse_t mouse;
+
+        bool in_menu = game_state == MAIN_MENU;
+        AllocStats allocs_before_frame = alloc_stats;
+        auto t0 = clock();
+        bot.next_input(key, mouse);
+        recorder_frame(key, mouse, game_has_work());
+        PlayerAction action = game_input(key, mouse);
+        auto t1 = clock();
+        if(action.quit) {
+            break;
+        }
+        int level = game_map.level;
+        game_update(action);
+        auto t2 = clock();
+        AllocStats allocs_before_events = alloc_stats;
+        game_process_events();
+        auto t3 = clock();
+        game_render(root_console, bar, mouse);
+        auto t4 = clock();
+
+        time_input += us(t1 - t0);
+        time_update += us(t2 - t1);
+        time_events += us(t3 - t2);
+        time_render += us(t4 - t3);
+        frames++;
+        if(game_map.level != level) {
+            floors++;
+            time_floor_change += us(t3 - t2);
+            worst_floor_change = std::max(worst_floor_change, us(t3 - t2));
+            floor_allocs += alloc_stats.count - allocs_before_events.count;
+            floor_alloc_bytes += alloc_stats.bytes - allocs_before_events.bytes;
+        }
+        if(in_menu && game_state != MAIN_MENU) {
+            new_games++;
+            new_game_allocs += alloc_stats.count - allocs_before_frame.count;
+            new_game_alloc_bytes += alloc_stats.bytes - allocs_before_frame.bytes;
+        }
+        if(game_turn != last_turn) {
+            last_turn = game_turn;
+            last_turn_frame = frames;
+        } else if(frames - last_turn_frame > 10000) {
+            printf("no turn in 10000 frames, bot is stuck (state %d)\n", (int)game_state);
+            break;
+        }
 
-    // add entities to map
-    map_add_monsters(game_map);
-    map_add_items(game_map);
-    map_add_stairs(game_map);
-    
-    game_state = PLAYER_TURN;    
+        if(game_state == PLAYER_DEAD) {
+            deaths++;
+            int turns_so_far = game_turn;
+            game_reset();
+            game_turn = turns_so_far;
+            // handles restart from scratch after a reset, don't trust the old one
+            bot.stairs = ENTITY_NONE;
+            // next life gets its own dungeon, still fixed by the run seed
+            game_seed = ((uint64_t)seed << 32) | (uint64_t)deaths;
+        }
+    }
+    double total = us(clock() - run_start);
+
+    printf("seed %u, %d turns in %d frames, %.1f ms\n", seed, game_turn, frames, total / 1000.0);
+    printf("  %.0f turns/s, %d floors descended, %d deaths\n", game_turn / (total / 1000000.0), floors, deaths);
+    printf("  %-8s %12s %12s\n", "phase", "total ms", "us/frame");
+    printf("  %-8s %12.2f %12.3f\n", "input", time_input / 1000.0, time_input / frames);
+    printf("  %-8s %12.2f %12.3f\n", "update", time_update / 1000.0, time_update / frames);
+    printf("  %-8s %12.2f %12.3f\n", "events", time_events / 1000.0, time_events / frames);
+    printf("  %-8s %12.2f %12.3f\n", "render", time_render / 1000.0, time_render / frames);
+    printf("  %.1f map cells redrawn per frame (of %d)\n", (double)render_stats.cells_touched_total / render_stats.frames, Map_Width * Map_Height);
+    printf("  %.2f hud widgets redrawn per frame, panel blitted on %.1f%% of frames\n", (double)hud.widgets_drawn / render_stats.frames,
+        100.0 * hud.blits / render_stats.frames);
+    if(floors > 0) {
+        printf("  floor change %.1f us avg, %.1f us worst\n", time_floor_change / floors, worst_floor_change);
+        printf("  floor change %.1f allocations, %.0f bytes avg\n", (double)floor_allocs / floors, (double)floor_alloc_bytes / floors);
+    }
+    if(new_games > 0) {
+        printf("  new game %.1f allocations, %.0f bytes avg\n", (double)new_game_allocs / new_games, (double)new_game_alloc_bytes / new_games);
+    }
+    printf("  %.2f allocations, %.0f bytes per turn\n", (double)(alloc_stats.count - allocs_at_start.count - new_game_allocs) / game_turn,
+        (double)(alloc_stats.bytes - allocs_at_start.bytes - new_game_alloc_bytes) / game_turn);
+    printf("  events at most %u queued at once, queue grew %u times\n", event_bus.peak, event_bus.grown);
+    printf("  peak memory %ld KB\n", peak_memory_kb());
+    printf("  state hash %08x\n", game_state_hash());
+    // the pregen worker reads static tables that go away after main returns
+    floor_pregen_cancel();
+    return 0;
+}
 
-    gui_log_message(TCOD_light_azure, "Welcome %s \nA throne is the most devious trap of them all..", player->name.c_str());
+// what a map cell drew before render_tops, walking the stack every time
+const Renderable *render_bench_walk(const GameMap &map, int x, int y) {
+    bool in_fov = map.visible.get(x, y);
+    bool explored = map.explored.get(x, y);
+    const Renderable *top = NULL;
+    for(Entity e = world.first_on_tile(x, y); e.valid(); e = world.next_on_tile(e)) {
+        auto renderable = world.renderables.get(e);
+        if(!renderable || !(in_fov || (explored && world.has(e, COMPONENT_STAIRS)))) {
+            continue;
+        }
+        if(!top || renderable->render_order > top->render_order) {
+            top = renderable;
+        }
+    }
+    return top;
 }
 
-void next_floor(GameMap &map) {
-    map.level += 1;
-    
-    for(int i = 1; i < _entities.size(); i++) {
-        if(_entities[i] != player)
-            delete _entities[i];
+// and the background it picked, one branch per cell
+TCODColor render_bench_background(const GameMap &map, int x, int y) {
+    bool wall = !map.transparent.get(x, y);
+    if(map.visible.get(x, y)) {
+        return wall ? color_table.light_wall : color_table.light_ground;
+    }
+    if(map.explored.get(x, y)) {
+        return wall ? color_table.dark_wall : color_table.dark_ground;
     }
-    _entities.erase(_entities.begin(), _entities.end());
-    _entities.push_back(player);
+    return TCODColor::black;
+}
 
-    game_map.rooms.clear();
-    game_map.num_rooms = 0;
-    delete game_map.tcod_fov_map;
+template<int W, int H>
+void render_bench_viewport(Rng &r, int reps) {
+    static BitPlane<W, H> visible, explored;
+    static MapCell lit[W], kept[W], out[W * H];
+    for(int y = 0; y < H; y++) {
+        for(int x = 0; x < W; x++) {
+            if(rand_int(r, 0, 3) == 0) visible.set(x, y);
+            if(rand_int(r, 0, 1) == 0) explored.set(x, y);
+        }
+    }
+    for(int x = 0; x < W; x++) {
+        bool wall = rand_int(r, 0, 4) == 0;
+        lit[x] = { rand_int(r, 0, 4) == 0 ? 'o' : ' ', render_pack(TCODColor::white),
+            render_pack(wall ? color_table.light_wall : color_table.light_ground) };
+        kept[x] = { x % 97 == 0 ? '>' : ' ', render_pack(TCODColor::white),
+            render_pack(wall ? color_table.dark_wall : color_table.dark_ground) };
+    }
+    volatile uint32_t sink = 0;
+    double us = bench_ns(reps, [&](int) {
+        const int words = BitPlane<W, H>::Row_words;
+        for(int y = 0; y < H; y++) {
+            RenderRow row = { visible.words + y * words, explored.words + y * words, lit, kept, out + y * W, words };
+            render_compose_span(row, 0, W);
+        }
+        sink = out[W * H - 1].bg ^ out[W * H / 2].fg ^ (uint32_t)out[W].ch;
+    }) / 1000.0;
+    printf("%4dx%-6d %12.1f %12.2f\n", W, H, us, us * 1000.0 / (W * H));
+}
 
-    targeting_item = NULL;
-    
-    Tile t_base;
-    for(int x = 0; x < Map_Width; x++) {
+// main.exe renderbench [reps]
+// Full map redraws (what every frame with a menu up does) on a real floor with
+// more and more items piled around: walking each cell's stack and picking its
+// colours one by one, against composing the cells from the cached tops and the
+// bit planes and copying them into the console. Checks both give the same
+// cells everywhere, then times the compose alone on bigger viewports.
+int render_bench_run(int argc, char *argv[]) {
+    int reps = argc > 2 ? atoi(argv[2]) : 500;
+    TCODConsole *con = new TCODConsole(SCREEN_WIDTH, SCREEN_HEIGHT);
+#ifdef HEADLESS
+    con->tiles.resize(SCREEN_WIDTH * SCREEN_HEIGHT);
+#endif
+    game_reset();
+    new_game(1);
+    game_map.explored.fill();
+    Rng r;
+    rng_seed(r, 13);
+    bool ok = true;
+    printf("%-10s %14s %14s %14s\n", "entities", "walk us", "compose us", "restack us");
+    static const int counts[] = { 100, 1000, 10000, 50000 };
+    for(int count : counts) {
+        while((int)world.renderables.size() < count) {
+            int x = rand_int(r, 1, Map_Width - 2), y = rand_int(r, 1, Map_Height - 2);
+            if(game_map.walkable.get(x, y)) {
+                item_spawn(rand_int(r, 0, (int)item_data.size() - 1), x, y);
+            }
+        }
+        // headless draws are no-ops, the cells go into sink so the picks aren't optimized out
+        volatile uint32_t sink = 0;
+        double walk = bench_ns(reps, [&](int) {
+            uint32_t cells = 0;
+            for(int y = 0; y < Map_Height; y++) {
+                for(int x = 0; x < Map_Width; x++) {
+                    auto top = render_bench_walk(game_map, x, y);
+                    TCODColor bg = render_bench_background(game_map, x, y);
+                    cells += (top ? top->gfx : ' ') + bg.r;
+                }
+            }
+            sink = cells;
+        }) / 1000.0;
+        double restack = bench_ns(std::max(1, reps / 10), [&](int) {
+            restacked_tiles.mark_all();
+            render_tops_update(game_map);
+        }) / 1000.0;
+        double compose = bench_ns(reps, [&](int) {
+            render_tops_update(game_map);
+            dirty_tiles.mark_all();
+            render_map(con, game_map);
+            sink = map_cells[Map_Width * Map_Height - 1].bg;
+        }) / 1000.0;
+        printf("%-10d %14.1f %14.1f %14.1f\n", (int)world.renderables.size(), walk, compose, restack);
+
+        // wipe scattered cells and runs, some of them unexplored again, the
+        // dirty cell redraw has to bring them all back
+        TCOD_ConsoleTile *tiles = console_tiles(con);
+        for(int i = 0; tiles && i < 300; i++) {
+            int tile = rand_int(r, 0, Map_Width * Map_Height - 1);
+            int run = std::min(i % 3 == 0 ? rand_int(r, 1, 40) : 1, Map_Width - tile % Map_Width);
+            for(int t = tile; t < tile + run; t++) {
+                if(i % 5 == 0) {
+                    game_map.explored.reset(t % Map_Width, t / Map_Width);
+                }
+                tiles[t % Map_Width + t / Map_Width * con->getWidth()] = TCOD_ConsoleTile();
+                dirty_tiles.mark(t);
+            }
+        }
+        render_map(con, game_map);
         for(int y = 0; y < Map_Height; y++) {
-            game_map.tiles[map_index(x, y)] = t_base;   
-        }    
+            render_compose_span(render_map_row(game_map, y), 0, Map_Width);
+        }
+        for(int tile = 0; tile < Map_Width * Map_Height; tile++) {
+            int x = tile % Map_Width, y = tile / Map_Width;
+            auto top = render_bench_walk(game_map, x, y);
+            MapCell want = { top ? top->gfx : ' ', top ? render_pack(top->color) : render_pack(TCODColor::white),
+                render_pack(render_bench_background(game_map, x, y)) };
+            MapCell picked = render_pick(game_map, tile);
+            ok = ok && memcmp(&map_cells[tile], &want, sizeof(MapCell)) == 0 && memcmp(&picked, &want, sizeof(MapCell)) == 0;
+            ok = ok && (!tiles || memcmp(&tiles[x + y * con->getWidth()], &want, sizeof(MapCell)) == 0);
+        }
+        game_map.explored.fill();
     }
+    dirty_tiles.clear();
+    printf("composed cells match the stack walk on every cell: %s\n", ok ? "yes" : "NO");
+
+    printf("\n%-11s %12s %12s\n", "viewport", "compose us", "ns/cell");
+    render_bench_viewport<80, 43>(r, reps);
+    render_bench_viewport<256, 256>(r, std::max(1, reps / 10));
+    render_bench_viewport<1024, 1024>(r, std::max(1, reps / 100));
+    game_reset();
+    floor_pregen_cancel();
+    delete con;
+    return ok ? 0 : 1;
+}
 
-    // generate map and fov
-    game_map.tcod_fov_map = new TCODMap(Map_Width, Map_Height);
-    // Should separate fov from map_generate (make_room)
-    map_generate(game_map, Max_rooms, Room_min_size, Room_max_size, Map_Width, Map_Height);
-    
-    // Place player in first room
-    rect_center(game_map.rooms[0], player->x, player->y);
-    // Setup fov from players position
-    game_map.tcod_fov_map->computeFov(player->x, player->y, fov_radius, fov_light_walls, fov_algorithm);
-
-    // add entities to map
-    map_add_monsters(game_map);
-    map_add_items(game_map);
-    map_add_stairs(game_map);
-    
+// main.exe menubench [frames]
+// Frame time and allocations with each modal screen up: frames that reuse the
+// composed overlay against frames forced to draw the map and the menu again
+// (what every frame did before the overlay cache). Headless draws are no-ops,
+// so the times here are only the bookkeeping around them, allocations are
+// the same as in the real build.
+int menu_bench_run(int argc, char *argv[]) {
+    int frames = argc > 2 ? atoi(argv[2]) : 2000;
+    TCODConsole *root_console = new TCODConsole(SCREEN_WIDTH, SCREEN_HEIGHT);
+    TCODConsole *bar = new TCODConsole(SCREEN_WIDTH, Panel_height);
+    TCOD_mouse_t mouse = TCOD_mouse_t();
+    game_reset();
+    new_game(1);
+    auto inventory = world.inventories.get(player);
+    for(int i = 0; (int)inventory->items.size() < inventory->capacity; i++) {
+        item_spawn(i % (int)item_data.size(), 1, 1);
+        Entity e = world.items.owners.back();
+        world.remove(world.positions, e);
+        inventory->add_item(e);
+    }
+    events_clear();
+
+    static const GameState states[] = { MAIN_MENU, SHOW_INVENTORY, LEVEL_UP, CHARACTER_SCREEN };
+    static const char *names[] = { "main menu", "inventory", "level up", "character" };
+    printf("%-12s %12s %12s %14s %14s\n", "screen", "cached us", "redrawn us", "cached allocs", "redrawn allocs");
+    for(int i = 0; i < 4; i++) {
+        game_state = states[i];
+        game_render(root_console, bar, mouse);
+        int composed = overlay_cache.composed;
+        AllocStats before = alloc_stats;
+        double cached = bench_ns(frames, [&](int) { game_render(root_console, bar, mouse); }) / 1000.0;
+        double cached_allocs = (double)(alloc_stats.count - before.count) / frames;
+        bool reused = overlay_cache.composed == composed;
+        before = alloc_stats;
+        double redrawn = bench_ns(frames, [&](int) {
+            overlay_cache.shown = OverlayKey();
+            game_render(root_console, bar, mouse);
+        }) / 1000.0;
+        double redrawn_allocs = (double)(alloc_stats.count - before.count) / frames;
+        printf("%-12s %12.2f %12.2f %14.2f %14.2f%s\n", names[i], cached, redrawn, cached_allocs, redrawn_allocs, reused ? "" : "  (composed again!)");
+    }
+    printf("console pool: %d consoles\n", (int)console_pool.slots.size());
     game_state = PLAYER_TURN;
+    game_reset();
+    floor_pregen_cancel();
+    delete bar;
+    delete root_console;
+    return 0;
+}
 
-    player->fighter->heal(player->fighter->hp_max / 2);
+// main.exe savebench [turns]
+// The bot plays `turns` turns of a game, the log gets filled to the brim, then
+// saving and loading that gets timed. Also checks that a load gives back
+// exactly what was saved and that carrying on from a load plays out the same
+// as never having stopped.
+int save_bench_run(int argc, char *argv[]) {
+    int turns = argc > 2 ? atoi(argv[2]) : 50;
+    const int reps = 1000;
+    const char *path = "savebench.dat";
+    static Bot bot;
+    static Bot saved_bot;
+    auto clock = std::chrono::high_resolution_clock::now;
+    auto us = [](std::chrono::high_resolution_clock::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count();
+    };
+    auto play = [](int until) {
+        while(game_turn < until && game_state != PLAYER_DEAD) {
+            TCOD_key_t key;
+            TCOD_mouse_t mouse;
+            bot.next_input(key, mouse);
+            PlayerAction action = game_input(key, mouse);
+            game_update(action);
+            game_process_events();
+        }
+    };
 
-    events_queue({ EventType::Message, NULL, "You take a moment to rest, and recover your strength." });
+    game_reset();
+    game_seed = 1;
+    play(turns);
+    while(message_log.count < Log_capacity) {
+        log_message(MSG_ATTACK_HIT, player, player, message_log.count);
+    }
+    printf("turn %d, dungeon level %d, %d entities, %u log lines\n", game_turn, game_map.level,
+        (int)world.manager._generation.size() - (int)world.manager._free_indices.size() + (int)world.manager._free_head, message_log.size());
+
+    save_serialize(save_writer);
+    printf("  save is %d bytes, %d strings\n", (int)save_writer.data.size(), (int)save_writer.strings.size());
+
+    double serialize = bench_ns(reps, [](int) { save_serialize(save_writer); }) / 1000.0;
+    double save = bench_ns(reps, [path](int) { save_game(path); }) / 1000.0;
+    // loading restarts the floor pregen, don't time waiting for the last one
+    std::vector<char> saved = save_writer.data;
+    double deserialize = 0, load = 0;
+    for(int rep = 0; rep < reps; rep++) {
+        floor_pregen_wait();
+        auto t0 = clock();
+        save_deserialize(saved.data(), saved.size());
+        auto t1 = clock();
+        floor_pregen_wait();
+        auto t2 = clock();
+        load_game(path);
+        auto t3 = clock();
+        deserialize += us(t1 - t0);
+        load += us(t3 - t2);
+    }
+    printf("  %-24s %10.1f us\n", "serialize", serialize);
+    printf("  %-24s %10.1f us\n", "save (with file write)", save);
+    printf("  %-24s %10.1f us\n", "deserialize", deserialize / reps);
+    printf("  %-24s %10.1f us\n", "load (map + deserialize)", load / reps);
+
+    save_serialize(save_writer);
+    bool same = save_writer.data == saved;
+    printf("  load then save gives the same bytes: %s\n", same ? "yes" : "NO");
+
+    saved_bot = bot;
+    play(turns * 2);
+    uint32_t straight = game_state_hash();
+    save_serialize(save_writer);
+    std::vector<char> straight_save = save_writer.data;
+    load_game(path);
+    bot = saved_bot;
+    play(turns * 2);
+    save_serialize(save_writer);
+    bool resumed = game_state_hash() == straight && save_writer.data == straight_save;
+    printf("  carrying on from the load ends up the same at turn %d: %s\n", game_turn, resumed ? "yes" : "NO");
+
+    remove(path);
+    floor_pregen_cancel();
+    return same && resumed ? 0 : 1;
 }
 
-int main( int argc, char *argv[] ) {
-    srand((unsigned int)time(NULL));
+// main.exe journalbench [turns]
+// The bot plays with the journal on and what it costs the main thread per
+// turn gets printed, then two crashes: one right after a turn was written
+// (the load has to come back at exactly that turn) and one that tore the
+// last record in half (the load has to come back one turn earlier).
+int journal_bench_run(int argc, char *argv[]) {
+    int turns = argc > 2 ? atoi(argv[2]) : 2000;
+    static Bot bot;
+    static SaveWriter before; // the world one turn before the last
+    static SaveWriter last;
+    static SaveWriter at_snapshot; // the world as of the last snapshot asked for
+    journal.save_path = "journalbench.dat";
+    journal.path = "journalbench.journal";
+    journal.enabled = true;
+
+    game_reset();
+    game_seed = 1;
+    // the world as of each of the last two records
+    int records_at_snapshot = 0, snapshots = 0, records = 0;
+    double serialize_us = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    int deaths = 0;
+    while(game_turn < turns) {
+        TCOD_key_t key;
+        TCOD_mouse_t mouse;
+        bot.next_input(key, mouse);
+        PlayerAction action = game_input(key, mouse);
+        game_update(action);
+        game_process_events();
+        if(game_state == PLAYER_DEAD) {
+            // same as `main headless`, the next life starts with a snapshot of its own
+            deaths++;
+            int turns_so_far = game_turn;
+            game_reset();
+            game_turn = turns_so_far;
+            bot.stairs = ENTITY_NONE;
+            game_seed = ((uint64_t)1 << 32) | (uint64_t)deaths;
+            continue;
+        }
+        if(journal.records != records) {
+            records = journal.records;
+            auto t = std::chrono::high_resolution_clock::now();
+            std::swap(before.data, last.data);
+            save_serialize(last);
+            if(journal.snapshots != snapshots) {
+                snapshots = journal.snapshots;
+                records_at_snapshot = journal.records;
+                at_snapshot.data = last.data;
+            }
+            serialize_us += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - t).count();
+        }
+    }
+    double wall = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() - serialize_us / 1e6;
+    journal_wait();
+
+    int turns_recorded = journal.records - journal.whole_records;
+    printf("%d turns, %d deaths, dungeon level %d, %.2f s\n", game_turn, deaths, game_map.level, wall);
+    printf("  main thread per turn   %8.1f us avg %8.1f us worst\n", journal.main_us / std::max(1, turns_recorded), journal.main_us_worst);
+    printf("  new game / floor       %8.1f us avg, %d of them\n", journal.whole_us / std::max(1, journal.whole_records), journal.whole_records);
+    printf("  records                %8d, %6.0f bytes avg %6d bytes worst\n", journal.records,
+        (double)journal.record_bytes / std::max(1, journal.records), (int)journal.record_bytes_worst);
+    printf("  snapshots              %8d\n", journal.snapshots);
+    printf("  written per turn       %8.0f bytes (a save every turn would be %d)\n",
+        (double)journal.bytes_written / std::max(1, game_turn), (int)last.data.size());
+    printf("  worker                 %8.1f ms\n", journal.worker_us / 1000.0);
+
+    // the worker wrote the last snapshot from its copy, that has to be the game as it was then
+    bool snapshot_same = false;
+    {
+        SaveFile file;
+        snapshot_same = file.open(journal.save_path) && file.size == at_snapshot.data.size()
+            && memcmp(file.data, at_snapshot.data.data(), file.size) == 0;
+    }
+    printf("  last snapshot is the game at its turn: %s\n", snapshot_same ? "yes" : "NO");
+
+    // crash with everything on disk
+    save_serialize(last);
+    game_reset();
+    load_game(journal.save_path, journal.path);
+    save_serialize(save_writer);
+    bool recovered = save_writer.data == last.data;
+    printf("  crash after turn %d comes back the same: %s\n", game_turn, recovered ? "yes" : "NO");
+
+    // crash halfway through writing the last record, needs one before it
+    bool torn = true;
+    if(journal.records - records_at_snapshot >= 2) {
+        long size = 0;
+        if(FILE *f = fopen(journal.path, "rb")) {
+            fseek(f, 0, SEEK_END);
+            size = ftell(f);
+            fclose(f);
+        }
+        std::vector<char> bytes(size);
+        if(FILE *f = fopen(journal.path, "rb")) {
+            size = (long)fread(bytes.data(), 1, bytes.size(), f);
+            fclose(f);
+        }
+        if(FILE *f = fopen(journal.path, "wb")) {
+            fwrite(bytes.data(), 1, std::max(0L, size - 5), f);
+            fclose(f);
+        }
+        game_reset();
+        load_game(journal.save_path, journal.path);
+        save_serialize(save_writer);
+        torn = save_writer.data == before.data;
+        printf("  torn last record comes back at turn %d: %s\n", game_turn, torn ? "yes" : "NO");
+    } else {
+        printf("  torn last record: not enough turns since the last snapshot\n");
+    }
 
-    TCODConsole::setCustomFont("data/arial10x10.png", TCOD_FONT_TYPE_GREYSCALE | TCOD_FONT_LAYOUT_TCOD);
-    TCODConsole::initRoot(SCREEN_WIDTH, SCREEN_HEIGHT, "libtcod C++ tutorial", false);
-    TCOD_key_t key = {TCODK_NONE,0};
-    TCOD_mouse_t mouse;
-     
-    auto root_console = TCODConsole::root;
-    auto bar = new TCODConsole(SCREEN_WIDTH, Panel_height);
+    journal_stop();
+    remove(journal.save_path);
+    remove(journal.path);
+    floor_pregen_cancel();
+    return snapshot_same && recovered && torn ? 0 : 1;
+}
 
-    Context context = Context(_entities, game_map);
-    
-    while ( !TCODConsole::isWindowClosed() ) {
-        TCODSystem::checkForEvent(TCOD_EVENT_KEY_PRESS | TCOD_EVENT_MOUSE, &key, &mouse);
+// main.exe record [file] [turns] [seed]
+// `main headless` with the bot's inputs recorded to [file]
+int record_run(int argc, char *argv[]) {
+    if(!recorder_start(argc > 2 ? argv[2] : Replay_path)) {
+        return 1;
+    }
+    // headless_run reads its numbers from argv[2] on
+    int result = headless_run(argc - 1, argv + 1);
+    printf("  %u inputs recorded\n", recorder.inputs);
+    recorder_stop();
+    return result;
+}
 
-        //// INPUT
-        
-        Movement m = { 0, 0 };
-        bool pickup = false;
-        bool take_stairs = false;
-        if(game_state == PLAYER_TURN) {    
-            if(key.vk == TCODK_UP) {
-                m.y = -1;
-            } else if(key.vk == TCODK_DOWN) {
-                m.y = 1;
-            } else if(key.vk == TCODK_LEFT) {
-                m.x = -1;
-            } else if(key.vk == TCODK_RIGHT) {
-                m.x = 1;
-            } else if(key.c == 'r') {
-                m.x = 1;
-                m.y = -1;
-            } else if(key.c == 'e') {
-                m.x = -1;
-                m.y = -1;
-            } else if(key.c == 'd') {
-                m.x = -1;
-                m.y = 1;
-            } else if(key.c == 'f') {
-                m.x = 1;
-                m.y = 1;
-            } else if(key.c == 'z') {
-                game_state = ENEMY_TURN;
-            } else if(key.c == 'g') {
-                pickup = true;
-            } else if(key.c == 'i') {
-                previous_game_state = game_state;
-                game_state = SHOW_INVENTORY;
-            } else if(key.c == 'c') {
-                previous_game_state = game_state;
-                game_state = CHARACTER_SCREEN;
-            } else if(key.vk == TCODK_ENTER) {
-                take_stairs = true;
-            } else if(key.vk == TCODK_ESCAPE) {
-                return 0;
-            } else if(key.vk == TCODK_ENTER) {
-                if(key.lalt) {
-                    TCODConsole::setFullscreen(!TCODConsole::isFullscreen());
-                }
+// main.exe replay <file> [seek_turn]
+// Plays a recording back without rendering and reports how fast the turns
+// went and whether every keyframe hash still matches. With a turn it seeks
+// there from the closest snapshot and checks that ends up where a replay
+// from the start does.
+
+// Somewhere a replay can start: a new game, a loaded one or a keyframe snapshot
+struct ReplayStart {
+    uint32_t input;
+    int turn;
+    ReplayChunk type;
+    uint64_t seed;
+    const char *save;
+    uint32_t save_bytes;
+};
+
+struct Replay {
+    SaveFile file;
+    std::vector<ReplayInput> inputs;
+    std::vector<ReplayStart> starts;
+    std::vector<ReplayKeyframe> keyframes;
+
+    // how the last play() went
+    int frames = 0;
+    int keyframes_checked = 0;
+    int diverged_turn = -1;
+    double update_us = 0;
+};
+
+bool replay_open(Replay &replay, const char *path) {
+    if(!replay.file.open(path)) {
+        printf("could not read %s\n", path);
+        return false;
+    }
+    SaveReader r(replay.file.data, replay.file.data, replay.file.data + replay.file.size);
+    ReplayHeader header = r.value<ReplayHeader>();
+    if(!r.ok || header.magic != Replay_magic || header.version != Replay_version || header.map_width != Map_Width || header.map_height != Map_Height) {
+        printf("%s is not a recording this build can play\n", path);
+        return false;
+    }
+    // the end of a recording that was cut off is dropped, up to there it is fine
+    while(r.ok && r.p < r.end) {
+        uint8_t tag = r.value<uint8_t>();
+        if(tag == REPLAY_INPUT) {
+            ReplayInput in = r.value<ReplayInput>();
+            if(r.ok) {
+                replay.inputs.push_back(in);
             }
-        } else if(game_state == PLAYER_DEAD) {
-            if(key.c == 'i') {
-                previous_game_state = game_state;
-                game_state = SHOW_INVENTORY;
-            } else if(key.vk == TCODK_ESCAPE) {
-                return 0;
-            } else if(key.vk == TCODK_ENTER) {
-                if(key.lalt) {
-                    TCODConsole::setFullscreen(!TCODConsole::isFullscreen());
-                }
+        } else if(tag == REPLAY_NEW_GAME) {
+            ReplayNewGame chunk = r.value<ReplayNewGame>();
+            if(r.ok) {
+                replay.starts.push_back(ReplayStart { (uint32_t)replay.inputs.size(), chunk.turn, REPLAY_NEW_GAME, chunk.seed, NULL, 0 });
             }
-        } else if(game_state == SHOW_INVENTORY) {
-            int index = (int)key.c - (int)'a';
-            if(index >= 0 && previous_game_state != PLAYER_DEAD && index < player->inventory->items.size()) {
-                if(key.lalt) {
-                    // DROP ITEM
-                    auto item_entity = player->inventory->items[index];
-                    item_entity->x = player->x;
-                    item_entity->y = player->y;
-                    _entities.push_back(item_entity);
-                    player->inventory->remove(item_entity);
-                    if(player->equipment->main_hand == item_entity || player->equipment->off_hand == item_entity) {
-                        player->equipment->toggle_equipment(item_entity);
-                    }
-                    game_state = ENEMY_TURN;
-                } else {
-                    if(player->inventory->requires_target(index)) {
-                        targeting_item = player->inventory->items[index];
-                        previous_game_state = PLAYER_TURN;
-                        game_state = TARGETING;
-                        events_queue({ EventType::Message, NULL, targeting_item->item->targeting_message, TCOD_yellow });   
-                    } else {
-                        bool consumed = player->inventory->use(index, context);
-                        game_state = ENEMY_TURN;
-                    }
-                }
-                //if(consumed) {
-                // trying to use an item always consumes the turn
-                
-                //}
-            }
-            
-            if(key.vk == TCODK_ESCAPE) {
-                game_state = previous_game_state;
-            } else if(key.vk == TCODK_ENTER) {
-                if(key.lalt) {
-                    TCODConsole::setFullscreen(!TCODConsole::isFullscreen());
-                }
+        } else if(tag == REPLAY_LOADED_GAME || tag == REPLAY_KEYFRAME) {
+            ReplayKeyframe keyframe = {};
+            if(tag == REPLAY_KEYFRAME) {
+                keyframe = r.value<ReplayKeyframe>();
+            } else {
+                keyframe.input = (uint32_t)replay.inputs.size();
+                keyframe.snapshot_bytes = r.value<uint32_t>();
             }
-        } else if(game_state == TARGETING) {
-            int x = mouse.cx, y = mouse.cy;            
-            if(mouse.lbutton_pressed) {
-                //targeting_item->item->args.target_x
-                targeting_item->item->args.target_x = x;
-                targeting_item->item->args.target_y = y;
-                if(player->inventory->use(targeting_item, context)) {
-                    game_state = ENEMY_TURN;
-                }
-            } else if(key.vk == TCODK_ESCAPE || mouse.rbutton_pressed) {
-                game_state = previous_game_state;
-                events_queue({ EventType::Message, NULL, "Targeting cancelled", TCOD_yellow });   
-            }
-        } else if(game_state == MAIN_MENU) {
-            int index = (int)key.c - (int)'a';
-            if(index == 0) {    
-                new_game();
-                context.map = game_map;
-                context.entities = _entities;
-            } else if(index == 1) {
-                engine_log(LogStatus::Information, "Continue is not implemented (only show if available)");
-            } else if(index == 2 || key.vk == TCODK_ESCAPE) {
-                return 0;
-            } else if(key.vk == TCODK_ENTER) {
-                if(key.lalt) {
-                    TCODConsole::setFullscreen(!TCODConsole::isFullscreen());
-                }
+            if(keyframe.snapshot_bytes) {
+                r.align();
             }
-        } else if(game_state == LEVEL_UP) {
-            char key_char = key.c;
-            if(key_char == 'a') {
-                player->fighter->hp_max += 20;
-                player->fighter->hp += 20;
-                game_state = previous_game_state;
-            } else if(key_char == 'b') {
-                player->fighter->power_max += 1;
-                game_state = previous_game_state;
-            } else if(key_char == 'c') {
-                player->fighter->defense_max += 1;
-                game_state = previous_game_state;
+            const char *save = r.take(keyframe.snapshot_bytes);
+            if(!r.ok) {
+                break;
             }
-        } else if(key.vk == TCODK_ESCAPE) {
-            game_state = previous_game_state;
+            if(tag == REPLAY_KEYFRAME) {
+                replay.keyframes.push_back(keyframe);
+            }
+            if(keyframe.snapshot_bytes) {
+                replay.starts.push_back(ReplayStart { keyframe.input, keyframe.turn, (ReplayChunk)tag, 0, save, keyframe.snapshot_bytes });
+            }
+        } else {
+            break;
         }
+    }
+    return true;
+}
 
-        //// UPDATE
+// One frame the way the main loop does it, minus the render
+bool replay_frame(Replay &replay, const TCOD_key_t &key, const TCOD_mouse_t &mouse) {
+    PlayerAction action = game_input(key, mouse);
+    if(action.quit) {
+        return false;
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    game_update(action);
+    replay.update_us += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+    game_process_events();
+    replay.frames++;
+    return true;
+}
 
-        if(game_state == PLAYER_TURN) {
-            int dx = player->x + m.x, dy = player->y + m.y; 
-            if((m.x != 0 || m.y != 0) && !map_blocked(game_map, dx, dy)) {
-                EntityFat *target;
-                if(entity_blocking_at(dx, dy, &target)) {
-                    player->fighter->attack(target);
-                } else {
-                    player->x = dx;
-                    player->y = dy;
-                    game_map.tcod_fov_map->computeFov(player->x, player->y, fov_radius, fov_light_walls, fov_algorithm);
-                }
+bool replay_restore(const ReplayStart &start) {
+    floor_pregen_cancel();
+    if(start.type == REPLAY_NEW_GAME) {
+        game_reset();
+        game_turn = start.turn;
+        new_game(start.seed);
+    } else if(!save_deserialize(start.save, start.save_bytes)) {
+        return false;
+    }
+    if(start.type != REPLAY_KEYFRAME) {
+        // the rest of the main menu frame that started it
+        PlayerAction none;
+        game_update(none);
+        game_process_events();
+    }
+    return true;
+}
 
-                game_state = ENEMY_TURN;
-            } else if(pickup) {
-                for(int i = 0; i < _entities.size(); i++) {
-                    auto entity = _entities[i];
-                    if(player->x == entity->x && player->y == entity->y && entity->item) {
-                        events_queue({ EventType::ItemPickup, entity });
-                        game_state = ENEMY_TURN;
-                        pickup = false;
-                        break;  
-                    }
-                }
-                // if we still want to pickup after we checked entities there is nothing to pickup
-                if(pickup) {
-                    events_queue({ EventType::Message, NULL, "There is nothing here to pick up.", TCOD_yellow });
-                }
-            } else if(take_stairs) {
-                for(int i = 0; i < _entities.size(); i++) {
-                    auto entity = _entities[i];
-                    if(player->x == entity->x && player->y == entity->y && entity->stairs) {
-                        events_queue({ EventType::NextFloor, entity });
-                        take_stairs = false;
-                        break;  
-                    }
-                }
-            }
-            if(take_stairs) {
-                events_queue({ EventType::Message, NULL, "There are no stairs here.", TCOD_yellow });
+// Plays from starts[from] until the recording ends or the turn is `until`
+void replay_play(Replay &replay, size_t from, int until) {
+    replay.frames = replay.keyframes_checked = 0;
+    replay.diverged_turn = -1;
+    replay.update_us = 0;
+    TCOD_key_t key, none = TCOD_key_t();
+    TCOD_mouse_t mouse, no_mouse = TCOD_mouse_t();
+    size_t start = from, keyframe = 0;
+    const uint32_t first = replay.starts[from].input;
+    while(keyframe < replay.keyframes.size() && replay.keyframes[keyframe].input < first) {
+        keyframe++;
+    }
+    // a snapshot was taken after the work frames of its input
+    bool skip_work = replay.starts[from].type == REPLAY_KEYFRAME;
+    for(uint32_t i = first; i < replay.inputs.size(); i++) {
+        for(; start < replay.starts.size() && replay.starts[start].input == i; start++) {
+            // keyframe snapshots are only for seeking, games starting matter
+            if((start == from || replay.starts[start].type != REPLAY_KEYFRAME) && !replay_restore(replay.starts[start])) {
+                return;
             }
-        } else if(game_state == ENEMY_TURN) {
-            for(int i = 1; i < _entities.size(); i++) {
-                const auto entity = _entities[i];
-                if(!entity->marked_for_deletion && entity->ai) {
-                    entity->ai->take_turn(player, game_map);
-                }
+        }
+        if(!skip_work) {
+            for(int frame = 0; frame < replay.inputs[i].work_frames; frame++) {
+                replay_frame(replay, none, no_mouse);
             }
-
-           game_state = PLAYER_TURN;
         }
-
-        // EVENTS
-        for(auto &e : _event_queue) {
-            switch(e.type) {
-                case EventType::Message: {
-                    gui_log_message(e.color, e.message.c_str());
-                    //printf("|| %s \n", e.message.c_str());
-                    break;
-                }
-                case EventType::EntityDead: {
-                    // shitty way to know if player died
-                    if(e.entity == player) {
-                        gui_log_message(TCOD_red, "YOU died!");
-                        game_state = PLAYER_DEAD;
-                        player->gfx = '%';
-                        player->color = TCOD_dark_red;
-                        player->render_order = render_priority.CORPSE;
-                    } else {
-                        gui_log_message(TCOD_light_green, "%s died!", e.entity->name.c_str());
-                        
-                        auto xp_gained = e.entity->fighter->xp;
-                        bool leveled_up = player->level->add_xp(xp_gained);
-                        gui_log_message(TCOD_yellow, "You gain %d experience points.", xp_gained);
-                        
-                        if(leveled_up) {
-                            gui_log_message(TCOD_yellow, "You become stronger! You reached level %d", player->level->current_level);
-                            previous_game_state = game_state;
-                            game_state = LEVEL_UP;
-                        }
-
-                        e.entity->gfx = '%';
-                        e.entity->color = TCOD_dark_red;
-                        e.entity->render_order = render_priority.CORPSE;
-                        e.entity->blocks = false;
-                        delete e.entity->fighter;
-                        e.entity->fighter = NULL;
-                        delete e.entity->ai;
-                        e.entity->ai = NULL;
-                        e.entity->name = "remains of " + e.entity->name;
-                    }
-                    break;
-                }
-                case EventType::ItemPickup: {
-                    auto success = player->inventory->add_item(e.entity);
-                    if(success) {
-                        gui_log_message(TCOD_yellow, "You picked up the %s !", e.entity->item->name.c_str());
-                    } else {
-                        gui_log_message(TCOD_yellow, "You cannot carry anymore, inventory full");
-                    }
-                    
-                    int delete_count = 0;
-                    int index = 0;
-                    for(auto &ev : _entities) {
-                        if(ev == e.entity) {
-                            delete_count++;
-                            break;
-                        }
-                        index++;
-                    }
-                    if(delete_count == 0) {
-                        engine_log(LogStatus::Error, "NO ITEM REMOVED WHEN PICKED UP!");
-                    }
-                    _entities.erase(_entities.begin() + index);
-                    break;
-                }
-                case EventType::NextFloor: {
-                    next_floor(game_map);
-                    break;
-                }
-                case EventType::EquipmentChange: {
-                    if(e.flag == 0) {
-                        gui_log_message(TCOD_yellow, "You dequipped the %s", e.entity->item->name.c_str());
-                    } else if(e.flag == 1) {
-                        gui_log_message(TCOD_yellow, "You equipped the %s", e.entity->item->name.c_str());
-                    }
-                    break;
-                }
+        skip_work = false;
+        for(; keyframe < replay.keyframes.size() && replay.keyframes[keyframe].input == i; keyframe++) {
+            replay.keyframes_checked++;
+            if(game_turn != replay.keyframes[keyframe].turn || game_state_hash() != replay.keyframes[keyframe].hash) {
+                replay.diverged_turn = replay.keyframes[keyframe].turn;
+                return;
             }
         }
-        _event_queue.clear();
-
-        //// RENDER
+        if(game_turn >= until) {
+            return;
+        }
+        replay_input_unpack(replay.inputs[i], key, mouse);
+        if(!replay_frame(replay, key, mouse)) {
+            return;
+        }
+    }
+    while(game_turn < until && game_has_work()) {
+        replay_frame(replay, none, no_mouse);
+    }
+}
 
-        root_console->setDefaultForeground(TCODColor::white);
-        root_console->clear();
+int replay_run(int argc, char *argv[]) {
+    Replay replay;
+    if(argc < 3 || !replay_open(replay, argv[2])) {
+        printf("usage: main replay <file> [seek_turn]\n");
+        return 1;
+    }
+    if(replay.starts.empty() || replay.starts[0].type == REPLAY_KEYFRAME) {
+        printf("no game in %s\n", argv[2]);
+        return 1;
+    }
+    auto clock = std::chrono::high_resolution_clock::now;
+    auto ms = [](std::chrono::high_resolution_clock::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+    int snapshots = 0;
+    for(auto &start : replay.starts) {
+        snapshots += start.type == REPLAY_KEYFRAME;
+    }
+    printf("%s: %d games, %d inputs, %d keyframes, %d snapshots\n", argv[2], (int)replay.starts.size() - snapshots,
+        (int)replay.inputs.size(), (int)replay.keyframes.size(), snapshots);
+
+    int until = argc > 3 ? atoi(argv[3]) : INT_MAX;
+    auto t0 = clock();
+    replay_play(replay, 0, until);
+    double total = ms(clock() - t0);
+    uint32_t hash = game_state_hash();
+    int turn = game_turn;
+    printf("  from the start: turn %d in %d frames, %.1f ms, %.0f turns/s, update %.1f ms\n", turn, replay.frames, total,
+        (turn - replay.starts[0].turn) / (total / 1000.0), replay.update_us / 1000.0);
+    printf("  %d keyframes match", replay.keyframes_checked);
+    if(replay.diverged_turn >= 0) {
+        printf(", DIVERGED at the keyframe for turn %d (now at turn %d)\n", replay.diverged_turn, game_turn);
+        floor_pregen_cancel();
+        return 1;
+    }
+    printf(", state hash %08x\n", hash);
 
-        if(game_state != MAIN_MENU) {
-            for(int y = 0; y < Map_Height; y++) {
-                for(int x = 0; x < Map_Width; x++) {
-                    if (game_map.tcod_fov_map->isInFov(x, y)) {
-                        game_map.tiles[map_index(x, y)].explored = true;
-
-                        TCODConsole::root->setCharBackground(x, y,
-                            game_map.tiles[map_index(x, y)].block_sight ? color_table.light_wall : color_table.light_ground );
-                    } else if ( game_map.tiles[map_index(x, y)].explored ) {
-                        TCODConsole::root->setCharBackground(x,y,
-                            game_map.tiles[map_index(x, y)].block_sight ? color_table.dark_wall : color_table.dark_ground );
-                    }
-                }
-            }
+    bool same = true;
+    if(until != INT_MAX) {
+        size_t from = 0;
+        for(size_t i = 0; i < replay.starts.size() && replay.starts[i].turn <= until; i++) {
+            from = i;
+        }
+        auto t1 = clock();
+        replay_play(replay, from, until);
+        double seek = ms(clock() - t1);
+        same = game_turn == turn && game_state_hash() == hash && replay.diverged_turn < 0;
+        printf("  seek from turn %d: turn %d in %d frames, %.2f ms, same as from the start: %s\n", replay.starts[from].turn,
+            game_turn, replay.frames, seek, same ? "yes" : "NO");
+    }
+    floor_pregen_cancel();
+    return same ? 0 : 1;
+}
 
-            std::sort(_entities.begin(), _entities.end(), entity_render_sort);
+#ifdef HEADLESS
+// main.exe idle [seconds]
+// Runs the real main loop with a driver thread pressing 'z' (wait a turn)
+// every 100ms, once per loop mode, and reports cpu use and how long a key or
+// a wake-up takes to make it to the screen.
+double cpu_seconds() {
+#ifdef __linux__
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#else
+    return clock() / (double)CLOCKS_PER_SEC;
+#endif
+}
 
-            for(int i = 0; i < _entities.size(); i++) {
-                const auto entity = _entities[i];
-                if((entity->stairs && game_map.tiles[map_index(entity->x, entity->y)].explored) 
-                    || game_map.tcod_fov_map->isInFov(entity->x, entity->y)) {
-                    root_console->setDefaultForeground(entity->color);
-                    root_console->putChar(entity->x, entity->y, entity->gfx);
-                }
+void idle_measure(const char *label, LoopMode mode, bool wakes, double seconds) {
+    TCODConsole *root_console = new TCODConsole(SCREEN_WIDTH, SCREEN_HEIGHT);
+    TCODConsole *bar = new TCODConsole(SCREEN_WIDTH, Panel_height);
+    game_reset();
+    game_seed = 1;
+    headless_input.closed = false;
+    headless_input.latency_count = 0;
+    headless_input.latency_total_us = headless_input.latency_worst_us = 0;
+    loop_wake_state.latency_count = 0;
+    loop_wake_state.latency_total_us = loop_wake_state.latency_worst_us = 0;
+    uint64_t frames_before = render_stats.frames;
+
+    if(wakes) {
+        loop_expect_wake(true);
+    }
+    std::thread driver([wakes, seconds] {
+        TCOD_key_t key = TCOD_key_t();
+        key.vk = TCODK_CHAR;
+        key.c = 'a';
+        headless_push_key(key); // main menu, new game
+        key.c = 'z';
+        auto start = std::chrono::steady_clock::now();
+        int tick = 0;
+        while(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < seconds) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            if(wakes && tick % 2 == 1) {
+                loop_wake();
+            } else if(tick % 2 == 0) {
+                headless_push_key(key);
             }
+            tick++;
         }
+        headless_close_window();
+    });
+
+    double cpu_start = cpu_seconds();
+    auto wall_start = std::chrono::steady_clock::now();
+    game_loop(root_console, bar, mode);
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+    double cpu = cpu_seconds() - cpu_start;
+    driver.join();
+    if(wakes) {
+        loop_expect_wake(false);
+    }
 
-        // UI RENDER
-        if(game_state != MAIN_MENU) {
-            bar->setDefaultBackground(TCODColor::black);
-            bar->clear();
-            gui_render_bar(bar, 1, 1, Bar_width, "HP", player->fighter->hp, player->fighter->hp_max, TCOD_light_red, TCOD_darker_red);
-            gui_render_mouse_look(bar, game_map, mouse.cx, mouse.cy);
-            bar->printEx(1, 3, TCOD_BKGND_NONE, TCOD_LEFT, "Dungeon level: %d", game_map.level);
-            
-            float colorCoef = 0.4f;
-            for(int i = 0, y = 1; i < gui_log.size(); i++, y++) {
-                bar->setDefaultForeground(gui_log[i]->color * colorCoef);
-                bar->print(Log_x, y, gui_log[i]->text);
-                // could one-line this with a clamp;
-                if (colorCoef < 1.0f ) {
-                    colorCoef += 0.3f;
-                }
-            }
+    printf("  %-12s cpu %5.1f%%, %8.0f frames/s, key latency %7.1f us avg %8.1f us worst", label, 100.0 * cpu / wall,
+        (render_stats.frames - frames_before) / wall,
+        headless_input.latency_total_us / std::max(1, headless_input.latency_count), headless_input.latency_worst_us);
+    if(wakes) {
+        printf(", wake latency %7.1f us avg %8.1f us worst", loop_wake_state.latency_total_us / std::max(1, loop_wake_state.latency_count),
+            loop_wake_state.latency_worst_us);
+    }
+    printf("\n");
+    delete root_console;
+    delete bar;
+}
 
-            TCODConsole::blit(bar, 0, 0, SCREEN_WIDTH, Panel_height, root_console, 0, Panel_y);
-        } else {
-            gui_render_main_menu(root_console, SCREEN_WIDTH, SCREEN_HEIGHT);
-        }
-        
-        if(game_state == SHOW_INVENTORY) {
-            gui_render_inventory(root_console, "Press the key next to an item to use it (hold alt to drop), or Esc to cancel.\n", player, 50, SCREEN_WIDTH, SCREEN_HEIGHT);
-        } else if(game_state == LEVEL_UP) {
-            gui_render_level_up_menu(root_console, "Level up! Choose a stat to raise:", player, 40, SCREEN_WIDTH, SCREEN_HEIGHT);
-        } else if(game_state == CHARACTER_SCREEN) {
-            gui_render_character_screen(root_console, player, 30, 10, SCREEN_WIDTH, SCREEN_HEIGHT);
-        }
+int idle_run(int argc, char *argv[]) {
+    double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+    printf("%.1f s per mode, a key every 100 ms\n", seconds);
+    idle_measure("poll", LOOP_POLL, false, seconds);
+    idle_measure("wait", LOOP_WAIT, false, seconds);
+    idle_measure("wait + wakes", LOOP_WAIT, true, seconds);
+    floor_pregen_cancel();
+    return 0;
+}
+#endif
 
-        TCODConsole::flush();
+int main( int argc, char *argv[] ) {
+    game_subscribe_events();
+
+    if(argc > 1 && strcmp(argv[1], "bench") == 0) {
+        rng_seed_game(1);
+        return bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "headless") == 0) {
+        return headless_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "logbench") == 0) {
+        return log_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "tilebench") == 0) {
+        return tile_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "fovbench") == 0) {
+        return fov_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "flowbench") == 0) {
+        return flow_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "spawnbench") == 0) {
+        return spawn_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "itembench") == 0) {
+        return item_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "statbench") == 0) {
+        return stat_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "aoebench") == 0) {
+        return aoe_bench_run(argc, argv);
     }
+    if(argc > 1 && strcmp(argv[1], "renderbench") == 0) {
+        return render_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "menubench") == 0) {
+        return menu_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "savebench") == 0) {
+        return save_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "journalbench") == 0) {
+        return journal_bench_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "record") == 0) {
+        return record_run(argc, argv);
+    }
+    if(argc > 1 && strcmp(argv[1], "replay") == 0) {
+        return replay_run(argc, argv);
+    }
+
+#ifdef HEADLESS
+    if(argc > 1 && strcmp(argv[1], "idle") == 0) {
+        return idle_run(argc, argv);
+    }
+    printf("Headless build, usage:\n  main headless [turns] [seed] [shadowcast|rays]\n  main bench [max_monsters] [turns] [threads]\n  main logbench [messages]\n  main tilebench [reps]\n  main fovbench [reps]\n  main flowbench [turns]\n  main spawnbench [blueprints]\n  main itembench [items]\n  main statbench [reps]\n  main aoebench [reps]\n  main renderbench [reps]\n  main menubench [frames]\n  main savebench [turns]\n  main journalbench [turns]\n  main record [file] [turns] [seed]\n  main replay <file> [seek_turn]\n  main idle [seconds]\n");
+    return 1;
+#else
+    // `main poll` keeps the old always-running loop
+    LoopMode mode = argc > 1 && strcmp(argv[1], "poll") == 0 ? LOOP_POLL : LOOP_WAIT;
+    game_seed = (uint64_t)time(NULL);
+
+    TCODConsole::setCustomFont("data/arial10x10.png", TCOD_FONT_TYPE_GREYSCALE | TCOD_FONT_LAYOUT_TCOD);
+    TCODConsole::initRoot(SCREEN_WIDTH, SCREEN_HEIGHT, "libtcod C++ tutorial", false);
+     
+    auto root_console = TCODConsole::root;
+    auto bar = new TCODConsole(SCREEN_WIDTH, Panel_height);
+    
+    journal.enabled = true;
+    recorder_start(Replay_path);
+    game_loop(root_console, bar, mode);
+    recorder_stop();
+    game_save_on_quit();
+    floor_pregen_cancel();
 
     return 0;
-}
\ No newline at end of file
+#endif
+}